@@ -0,0 +1,112 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+/*
+
+This sketch shows how to get state changes pushed from a Sonos speaker,
+instead of polling for them. The sketch subscribes to the AVTransport and
+RenderingControl events of the speaker, and prints transport state, track,
+volume and mute changes to the Arduino Serial Monitor as they happen.
+
+Enter the IP address of your speaker below. The speaker must be able to
+reach the Arduino on SONOS_EVENT_PORT.
+
+*/
+
+#include <SPI.h>
+#include <Ethernet.h>
+#include <SonosUPnP.h>
+#include <SonosEvents.h>
+#include <MicroXPath_P.h>
+
+#define SONOS_EVENT_PORT 3400
+
+#define ETHERNET_ERROR_DHCP "E: DHCP"
+#define SONOS_ERROR_SUBSCRIBE "E: Subscribe"
+
+EthernetClient g_ethClient;
+SonosEvents g_sonosEvents = SonosEvents(g_ethClient, SONOS_EVENT_PORT);
+
+byte g_mac[] = {0x54, 0x48, 0x4F, 0x4D, 0x41, 0x53};
+IPAddress g_ethernetStaticIP(192, 168, 0, 123);
+
+// Living room
+IPAddress g_sonosLivingrIP(192, 168, 0, 201);
+
+void transportStateChanged(IPAddress speakerIP, uint8_t state)
+{
+  switch (state)
+  {
+    case SONOS_STATE_PLAYING:
+      Serial.println("Playing");
+      break;
+    case SONOS_STATE_PAUSED:
+      Serial.println("Paused");
+      break;
+    default:
+      Serial.println("Stopped");
+      break;
+  }
+}
+
+void trackChanged(IPAddress speakerIP, uint16_t number, uint32_t duration, const char *uri)
+{
+  Serial.print("Track ");
+  Serial.print(number, DEC);
+  Serial.print(", ");
+  Serial.print(duration, DEC);
+  Serial.print(" s, ");
+  Serial.println(uri);
+}
+
+void volumeChanged(IPAddress speakerIP, uint8_t volume)
+{
+  Serial.print("Volume ");
+  Serial.println(volume, DEC);
+}
+
+void muteChanged(IPAddress speakerIP, bool state)
+{
+  Serial.println(state ? "Muted" : "Unmuted");
+}
+
+void setup()
+{
+  Serial.begin(9600);
+  if (!Ethernet.begin(g_mac))
+  {
+    Serial.println(ETHERNET_ERROR_DHCP);
+    Ethernet.begin(g_mac, g_ethernetStaticIP);
+  }
+  g_sonosEvents.setTransportStateCallback(transportStateChanged);
+  g_sonosEvents.setTrackCallback(trackChanged);
+  g_sonosEvents.setVolumeCallback(volumeChanged);
+  g_sonosEvents.setMuteCallback(muteChanged);
+  g_sonosEvents.begin(Ethernet.localIP());
+  if (!g_sonosEvents.subscribe(g_sonosLivingrIP, UPNP_AV_TRANSPORT) ||
+      !g_sonosEvents.subscribe(g_sonosLivingrIP, UPNP_RENDERING_CONTROL))
+  {
+    Serial.println(SONOS_ERROR_SUBSCRIBE);
+  }
+}
+
+void loop()
+{
+  // Receives events and renews the subscriptions before they expire
+  g_sonosEvents.poll();
+}
@@ -0,0 +1,344 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+// Measures the latency and throughput of every SonosUPnP action on a Linux
+// host, with the connection features off and on. Run it against the
+// ZonePlayer simulator, or a real speaker, e.g.:
+//
+//   ../simulator/ZonePlayerSimulator -n 4 &
+//   ./SonosBenchmark -g 4
+//
+// Build: g++ -std=gnu++11 -O2 -I../../src -I../../src/posix SonosBenchmark.cpp
+//          ../../src/*.cpp ../../src/posix/*.cpp ../../../MicroXPath/src/MicroXPath_P.cpp
+//          -o SonosBenchmark
+//
+// Errors are failed requests, as told by getLastError(), the async callback
+// and the return values of the fan-out, batch, browse and topology actions.
+// Fire-and-forget responses still in flight are read before the time is
+// taken, so they count towards it and free their sockets.
+//
+// MB/s is the response data received and parsed per second, run the
+// simulator with -m to see how it scales with large track metadata.
+//
+// Options:
+//   -s <ip>     first speaker (127.0.0.1)
+//   -g <count>  speakers for the fan-out actions, counted up from the first (4)
+//   -n <count>  iterations per action (200)
+//   -a <text>   only actions whose name contains the text
+//   -c <text>   only configurations whose name contains the text
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include "SonosUPnP.h"
+#include "SonosBatch.h"
+#include "SonosTopology.h"
+
+#define BENCHMARK_WARMUP 5
+#define BENCHMARK_MAX_GROUP 16
+#define BENCHMARK_SPEAKER_ID "000E58000001"
+#define BENCHMARK_CACHE_TTL_MS 1000
+#define BENCHMARK_BROWSE_COUNT 20
+
+struct Action
+{
+  const char *name;
+  void (*run)(SonosUPnP &sonos);
+};
+
+struct Configuration
+{
+  const char *name;
+  bool keepAlive;
+  bool earlyAbort;
+  bool cache;
+  bool fireAndForget;
+};
+
+static IPAddress speakerIP(127, 0, 0, 1);
+static IPAddress groupIPs[BENCHMARK_MAX_GROUP];
+static uint8_t groupSize = 4;
+static uint32_t errors = 0;
+static char uriBuffer[256];
+static char itemId[16];
+static char itemTitle[64];
+static char itemArtist[32];
+static char itemAlbum[32];
+static BrowseItem browseItem =
+{
+  itemId, sizeof(itemId), itemTitle, sizeof(itemTitle), itemArtist, sizeof(itemArtist),
+  itemAlbum, sizeof(itemAlbum), uriBuffer, sizeof(uriBuffer)
+};
+
+static void ethernetError()
+{
+  errors++;
+}
+
+static void asyncDone(int8_t, IPAddress, uint8_t, bool success, int32_t)
+{
+  // Fire-and-forget outcomes, and those of begin* requests, which the
+  // callback frees before waitAsync sees them
+  if (!success) errors++;
+}
+
+static void waitAsync(SonosUPnP &sonos, int8_t handle)
+{
+  if (handle < 0) errors++;
+  while (sonos.poll()) posixWait(1);
+  if (sonos.getAsyncStatus(handle) == SONOS_ASYNC_FAILED) errors++;
+  sonos.endAsync(handle);
+}
+
+static void collect(SonosUPnP &sonos)
+{
+  // Responses of fire-and-forget requests still in flight
+  while (sonos.poll()) posixWait(1);
+}
+
+static void countFailed(uint8_t succeeded)
+{
+  errors += groupSize - succeeded;
+}
+
+static void browsed(uint16_t, BrowseItem *)
+{
+}
+
+static void browseQueue(SonosUPnP &sonos)
+{
+  if (!sonos.browseQueue(speakerIP, 0, BENCHMARK_BROWSE_COUNT, &browseItem, browsed, 0)) errors++;
+}
+
+static void refreshTopology(SonosUPnP &sonos)
+{
+  SonosTopology topology(&sonos, speakerIP);
+  topology.refresh();
+  if (!topology.isValid()) errors++;
+}
+
+static void scene(SonosUPnP &sonos)
+{
+  sonos.removeAllTracksFromQueue(speakerIP);
+  sonos.addPlaylistToQueue(speakerIP, 0);
+  sonos.setPlayMode(speakerIP, SONOS_PLAY_MODE_NORMAL);
+  sonos.setVolume(speakerIP, 20);
+  sonos.playQueue(speakerIP, BENCHMARK_SPEAKER_ID);
+}
+
+static void sceneBatch(SonosUPnP &sonos)
+{
+  SonosBatch batch(&sonos);
+  batch.begin(speakerIP);
+  scene(sonos);
+  uint8_t steps = batch.getStepCount();
+  errors += steps - batch.send();
+}
+
+static const Action actions[] =
+{
+  { "play", [](SonosUPnP &sonos) { sonos.play(speakerIP); } },
+  { "pause", [](SonosUPnP &sonos) { sonos.pause(speakerIP); } },
+  { "stop", [](SonosUPnP &sonos) { sonos.stop(speakerIP); } },
+  { "skip", [](SonosUPnP &sonos) { sonos.skip(speakerIP, SONOS_DIRECTION_FORWARD); } },
+  { "seekTrack", [](SonosUPnP &sonos) { sonos.seekTrack(speakerIP, 1); } },
+  { "seekTime", [](SonosUPnP &sonos) { sonos.seekTime(speakerIP, 0, 0, 10); } },
+  { "setPlayMode", [](SonosUPnP &sonos) { sonos.setPlayMode(speakerIP, SONOS_PLAY_MODE_NORMAL); } },
+  { "setAVTransportURI", [](SonosUPnP &sonos) { sonos.setAVTransportURI(speakerIP, SONOS_SOURCE_FILE_SCHEME, "//server/music/track.mp3"); } },
+  { "playFile", [](SonosUPnP &sonos) { sonos.playFile(speakerIP, "//server/music/track.mp3"); } },
+  { "playHttp", [](SonosUPnP &sonos) { sonos.playHttp(speakerIP, "track/123.mp3"); } },
+  { "playRadio", [](SonosUPnP &sonos) { sonos.playRadio(speakerIP, "//radio.example.com/stream.mp3", "Radio"); } },
+  { "playLineIn", [](SonosUPnP &sonos) { sonos.playLineIn(speakerIP, BENCHMARK_SPEAKER_ID); } },
+  { "playQueue", [](SonosUPnP &sonos) { sonos.playQueue(speakerIP, BENCHMARK_SPEAKER_ID); } },
+  { "playConnectToMaster", [](SonosUPnP &sonos) { sonos.playConnectToMaster(speakerIP, BENCHMARK_SPEAKER_ID); } },
+  { "disconnectFromMaster", [](SonosUPnP &sonos) { sonos.disconnectFromMaster(speakerIP); } },
+  { "setMute", [](SonosUPnP &sonos) { sonos.setMute(speakerIP, false); } },
+  { "setVolume", [](SonosUPnP &sonos) { sonos.setVolume(speakerIP, 20); } },
+  { "setBass", [](SonosUPnP &sonos) { sonos.setBass(speakerIP, 0); } },
+  { "setTreble", [](SonosUPnP &sonos) { sonos.setTreble(speakerIP, 0); } },
+  { "setLoudness", [](SonosUPnP &sonos) { sonos.setLoudness(speakerIP, true); } },
+  { "setRelativeVolume", [](SonosUPnP &sonos) { sonos.setRelativeVolume(speakerIP, 0); } },
+  { "rampToVolume", [](SonosUPnP &sonos) { sonos.rampToVolume(speakerIP, 20, SONOS_RAMP_SLEEP_TIMER); } },
+  { "setGroupVolume", [](SonosUPnP &sonos) { sonos.setGroupVolume(speakerIP, 20); } },
+  { "setRelativeGroupVolume", [](SonosUPnP &sonos) { sonos.setRelativeGroupVolume(speakerIP, 0); } },
+  { "setStatusLight", [](SonosUPnP &sonos) { sonos.setStatusLight(speakerIP, true); } },
+  { "addPlaylistToQueue", [](SonosUPnP &sonos) { sonos.addPlaylistToQueue(speakerIP, 0); } },
+  { "addTrackToQueue", [](SonosUPnP &sonos) { sonos.addTrackToQueue(speakerIP, SONOS_SOURCE_FILE_SCHEME, "//server/music/track.mp3"); } },
+  { "removeAllTracksFromQueue", [](SonosUPnP &sonos) { sonos.removeAllTracksFromQueue(speakerIP); } },
+  { "playMany", [](SonosUPnP &sonos) { countFailed(sonos.playMany(groupIPs, groupSize, 0)); } },
+  { "pauseMany", [](SonosUPnP &sonos) { countFailed(sonos.pauseMany(groupIPs, groupSize, 0)); } },
+  { "stopMany", [](SonosUPnP &sonos) { countFailed(sonos.stopMany(groupIPs, groupSize, 0)); } },
+  { "setMuteMany", [](SonosUPnP &sonos) { countFailed(sonos.setMuteMany(groupIPs, groupSize, false, 0)); } },
+  { "setVolumeMany", [](SonosUPnP &sonos) { countFailed(sonos.setVolumeMany(groupIPs, groupSize, 20, 0)); } },
+  { "scene", scene },
+  { "sceneBatch", sceneBatch },
+  { "beginPlay", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginPlay(speakerIP)); } },
+  { "beginPause", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginPause(speakerIP)); } },
+  { "beginStop", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginStop(speakerIP)); } },
+  { "beginSkip", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginSkip(speakerIP, SONOS_DIRECTION_FORWARD)); } },
+  { "beginSetMute", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginSetMute(speakerIP, false)); } },
+  { "beginSetVolume", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginSetVolume(speakerIP, 20)); } },
+  { "beginSetBass", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginSetBass(speakerIP, 0)); } },
+  { "beginSetTreble", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginSetTreble(speakerIP, 0)); } },
+  { "beginSetLoudness", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginSetLoudness(speakerIP, true)); } },
+  { "beginSetRelativeVolume", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginSetRelativeVolume(speakerIP, 0)); } },
+  { "beginRampToVolume", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginRampToVolume(speakerIP, 20, SONOS_RAMP_SLEEP_TIMER)); } },
+  { "setRepeat", [](SonosUPnP &sonos) { sonos.setRepeat(speakerIP, false); } },
+  { "setShuffle", [](SonosUPnP &sonos) { sonos.setShuffle(speakerIP, false); } },
+  { "toggleRepeat", [](SonosUPnP &sonos) { sonos.toggleRepeat(speakerIP); } },
+  { "toggleShuffle", [](SonosUPnP &sonos) { sonos.toggleShuffle(speakerIP); } },
+  { "togglePause", [](SonosUPnP &sonos) { sonos.togglePause(speakerIP); } },
+  { "toggleMute", [](SonosUPnP &sonos) { sonos.toggleMute(speakerIP); } },
+  { "toggleLoudness", [](SonosUPnP &sonos) { sonos.toggleLoudness(speakerIP); } },
+  { "getState", [](SonosUPnP &sonos) { sonos.getState(speakerIP); } },
+  { "getPlayMode", [](SonosUPnP &sonos) { sonos.getPlayMode(speakerIP); } },
+  { "getRepeat", [](SonosUPnP &sonos) { sonos.getRepeat(speakerIP); } },
+  { "getShuffle", [](SonosUPnP &sonos) { sonos.getShuffle(speakerIP); } },
+  { "getTrackInfo", [](SonosUPnP &sonos) { sonos.getTrackInfo(speakerIP, uriBuffer, sizeof(uriBuffer)); } },
+  { "getPositionInfo", [](SonosUPnP &sonos) { TrackInfo info; sonos.getPositionInfo(speakerIP, &info, uriBuffer, sizeof(uriBuffer)); } },
+  { "getTrackNumber", [](SonosUPnP &sonos) { sonos.getTrackNumber(speakerIP); } },
+  { "getTrackURI", [](SonosUPnP &sonos) { sonos.getTrackURI(speakerIP, uriBuffer, sizeof(uriBuffer)); } },
+  { "getSource", [](SonosUPnP &sonos) { sonos.getSource(speakerIP); } },
+  { "getSourceFromURI", [](SonosUPnP &sonos) { sonos.getSourceFromURI("x-file-cifs://server/music/track.mp3"); } },
+  { "getTrackDurationInSeconds", [](SonosUPnP &sonos) { sonos.getTrackDurationInSeconds(speakerIP); } },
+  { "getTrackPositionInSeconds", [](SonosUPnP &sonos) { sonos.getTrackPositionInSeconds(speakerIP); } },
+  { "getTrackPositionPerMille", [](SonosUPnP &sonos) { sonos.getTrackPositionPerMille(speakerIP); } },
+  { "getMute", [](SonosUPnP &sonos) { sonos.getMute(speakerIP); } },
+  { "getVolume", [](SonosUPnP &sonos) { sonos.getVolume(speakerIP); } },
+  { "getOutputFixed", [](SonosUPnP &sonos) { sonos.getOutputFixed(speakerIP); } },
+  { "getBass", [](SonosUPnP &sonos) { sonos.getBass(speakerIP); } },
+  { "getTreble", [](SonosUPnP &sonos) { sonos.getTreble(speakerIP); } },
+  { "getLoudness", [](SonosUPnP &sonos) { sonos.getLoudness(speakerIP); } },
+  { "browseQueue", browseQueue },
+  { "browseSavedQueues", [](SonosUPnP &sonos) { sonos.browseSavedQueues(speakerIP, 0, BENCHMARK_BROWSE_COUNT, &browseItem, browsed, 0); } },
+  { "refreshTopology", refreshTopology },
+  { "beginGetState", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginGetState(speakerIP)); } },
+  { "beginGetPlayMode", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginGetPlayMode(speakerIP)); } },
+  { "beginGetTrackNumber", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginGetTrackNumber(speakerIP)); } },
+  { "beginGetTrackDuration", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginGetTrackDuration(speakerIP)); } },
+  { "beginGetTrackPosition", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginGetTrackPosition(speakerIP)); } },
+  { "beginGetMute", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginGetMute(speakerIP)); } },
+  { "beginGetVolume", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginGetVolume(speakerIP)); } },
+  { "beginGetBass", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginGetBass(speakerIP)); } },
+  { "beginGetTreble", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginGetTreble(speakerIP)); } },
+  { "beginGetLoudness", [](SonosUPnP &sonos) { waitAsync(sonos, sonos.beginGetLoudness(speakerIP)); } }
+};
+
+static const Configuration configurations[] =
+{
+  { "close", false, false, false, false },
+  { "keep-alive", true, false, false, false },
+  { "keep-alive+abort", true, true, false, false },
+  { "keep-alive+cache", true, false, true, false },
+  { "keep-alive+forget", true, false, false, true }
+};
+
+static void runAction(const Action *action, const Configuration *configuration, uint32_t iterations)
+{
+  SonosClient client;
+  SonosUPnP sonos(client, ethernetError);
+  sonos.setKeepAlive(configuration->keepAlive);
+  sonos.setEarlyAbort(configuration->earlyAbort);
+  sonos.setFireAndForget(configuration->fireAndForget);
+  sonos.setAsyncCallback(asyncDone);
+  if (configuration->cache)
+  {
+    for (uint8_t field = 0; field < SONOS_CACHE_FIELDS; field++)
+    {
+      sonos.setCacheTTL(field, BENCHMARK_CACHE_TTL_MS);
+    }
+  }
+  for (uint8_t i = 0; i < BENCHMARK_WARMUP; i++)
+  {
+    action->run(sonos);
+  }
+  collect(sonos);
+  errors = 0;
+  std::vector<uint32_t> latencies(iterations);
+  uint64_t received = posixBytesReceived();
+  uint32_t start = micros();
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    uint32_t actionStart = micros();
+    uint32_t failed = errors;
+    action->run(sonos);
+    latencies[i] = micros() - actionStart;
+    // Blocking requests that failed without losing the connection
+    if (errors == failed && sonos.getLastError() != SONOS_ERROR_NONE) errors++;
+  }
+  collect(sonos);
+  uint32_t total = micros() - start;
+  received = posixBytesReceived() - received;
+  sonos.closeConnections();
+  std::sort(latencies.begin(), latencies.end());
+  printf(
+    "%-26s %-17s %9u %9u %10.0f %8.2f %7u\n", action->name, configuration->name,
+    latencies[iterations / 2], latencies[std::min(iterations - 1, iterations * 99 / 100)],
+    total ? iterations * 1000000.0 / total : 0.0, total ? (double)received / total : 0.0, errors);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t iterations = 200;
+  const char *actionFilter = "";
+  const char *configurationFilter = "";
+  int option;
+  while ((option = getopt(argc, argv, "s:g:n:a:c:")) != -1)
+  {
+    switch (option)
+    {
+      case 's':
+      {
+        unsigned a, b, c, d;
+        if (sscanf(optarg, "%u.%u.%u.%u", &a, &b, &c, &d) != 4) return 1;
+        speakerIP = IPAddress(a, b, c, d);
+        break;
+      }
+      case 'g': groupSize = constrain(atoi(optarg), 1, BENCHMARK_MAX_GROUP); break;
+      case 'n': iterations = atoi(optarg); break;
+      case 'a': actionFilter = optarg; break;
+      case 'c': configurationFilter = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-s speaker ip] [-g group size] [-n iterations] [-a action] [-c configuration]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (!iterations) iterations = 1;
+  for (uint8_t i = 0; i < groupSize; i++)
+  {
+    groupIPs[i] = speakerIP;
+    groupIPs[i][3] += i;
+  }
+
+  printf("%-26s %-17s %9s %9s %10s %8s %7s\n", "action", "configuration", "p50 (us)", "p99 (us)", "ops/s", "MB/s", "errors");
+  for (size_t a = 0; a < sizeof(actions) / sizeof(actions[0]); a++)
+  {
+    if (!strstr(actions[a].name, actionFilter)) continue;
+    for (size_t c = 0; c < sizeof(configurations) / sizeof(configurations[0]); c++)
+    {
+      if (!strstr(configurations[c].name, configurationFilter)) continue;
+      runAction(&actions[a], &configurations[c], iterations);
+    }
+  }
+  return 0;
+}
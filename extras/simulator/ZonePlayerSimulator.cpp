@@ -0,0 +1,751 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+// Stand-in Sonos ZonePlayer for measuring the library on a Linux host. Each
+// simulated speaker listens on port 1400 of its own loopback address, from
+// 127.0.0.1 and up, and answers the AVTransport, RenderingControl,
+// GroupRenderingControl, DeviceProperties, ContentDirectory and
+// ZoneGroupTopology actions like a real speaker. Speakers join each other's
+// groups with an x-rincon: source, and every speaker reports the same zone
+// group state.
+//
+// Build: g++ -std=gnu++11 -O2 ZonePlayerSimulator.cpp -o ZonePlayerSimulator
+//
+// Options:
+//   -n <count>    number of speakers (1)
+//   -d <ms>       response delay (0)
+//   -j <ms>       random extra delay, up to the given time (0)
+//   -f <percent>  requests that fail, by dropping the connection, a SOAP
+//                 fault or a truncated response (0)
+//   -m <bytes>    size of the DIDL TrackMetaData in GetPositionInfo (1000)
+//   -q <tracks>   tracks in each queue at start (100)
+//   -p <port>     port (1400)
+//   -v            log every request
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+#define SIMULATOR_MAX_EVENTS 64
+#define SIMULATOR_READ_SIZE 4096
+#define SIMULATOR_FAILURE_DROP 0
+#define SIMULATOR_FAILURE_FAULT 1
+#define SIMULATOR_FAILURE_TRUNCATE 2
+#define SIMULATOR_SAVED_QUEUES 5
+
+struct Speaker
+{
+  int fd;
+  char ip[16];
+  char id[13];
+  bool playing;
+  bool paused;
+  uint8_t volume;
+  uint8_t groupVolume;
+  bool mute;
+  int8_t bass;
+  int8_t treble;
+  bool loudness;
+  bool led;
+  std::string playMode;
+  std::string uri;
+  std::string group;
+  uint16_t queueLength;
+  uint32_t queueUpdate;
+  uint16_t track;
+  uint32_t duration;
+  uint64_t positionAt;
+  uint32_t position;
+  uint32_t requests;
+};
+
+struct Response
+{
+  uint64_t sendAt;
+  std::string data;
+  bool close;
+};
+
+struct Connection
+{
+  int fd;
+  Speaker *speaker;
+  std::string input;
+  std::vector<Response> responses;
+};
+
+static std::vector<Speaker> speakers;
+static std::vector<Connection *> connections;
+static uint32_t delayMs = 0;
+static uint32_t jitterMs = 0;
+static uint32_t failurePercent = 0;
+static uint32_t metaDataSize = 1000;
+static uint16_t queueLength = 100;
+static uint16_t port = 1400;
+static bool verbose = false;
+
+static uint64_t now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+static std::string format(const char *formatString, ...) __attribute__((format(printf, 1, 2)));
+static std::string format(const char *formatString, ...)
+{
+  char buffer[512];
+  va_list arguments;
+  va_start(arguments, formatString);
+  vsnprintf(buffer, sizeof(buffer), formatString, arguments);
+  va_end(arguments);
+  return buffer;
+}
+
+static std::string timeString(uint32_t seconds)
+{
+  return format("%u:%02u:%02u", seconds / 3600, seconds / 60 % 60, seconds % 60);
+}
+
+static std::string escape(const std::string &text)
+{
+  std::string escaped;
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    switch (text[i])
+    {
+      case '<': escaped += "&lt;"; break;
+      case '>': escaped += "&gt;"; break;
+      case '&': escaped += "&amp;"; break;
+      case '"': escaped += "&quot;"; break;
+      default: escaped += text[i];
+    }
+  }
+  return escaped;
+}
+
+static std::string getTag(const std::string &body, const char *name)
+{
+  std::string start = format("<%s>", name);
+  std::string end = format("</%s>", name);
+  size_t from = body.find(start);
+  if (from == std::string::npos) return "";
+  from += start.size();
+  size_t to = body.find(end, from);
+  return to == std::string::npos ? "" : body.substr(from, to - from);
+}
+
+static std::string getHeader(const std::string &header, const char *name)
+{
+  // Header names are matched without case, values are trimmed
+  size_t nameLength = strlen(name);
+  size_t line = 0;
+  while (line < header.size())
+  {
+    size_t end = header.find('\n', line);
+    if (end == std::string::npos) end = header.size();
+    if (end - line > nameLength && !strncasecmp(header.c_str() + line, name, nameLength) && header[line + nameLength] == ':')
+    {
+      size_t from = line + nameLength + 1;
+      while (from < end && header[from] == ' ') from++;
+      size_t to = end;
+      while (to > from && (header[to - 1] == '\r' || header[to - 1] == ' ')) to--;
+      return header.substr(from, to - from);
+    }
+    line = end + 1;
+  }
+  return "";
+}
+
+static uint32_t getPosition(Speaker *speaker)
+{
+  // The position moves on while playing, and the track loops
+  uint32_t position = speaker->position;
+  if (speaker->playing) position += (now() - speaker->positionAt) / 1000;
+  return speaker->duration ? position % speaker->duration : 0;
+}
+
+static void setPlaying(Speaker *speaker, bool playing, bool paused)
+{
+  speaker->position = getPosition(speaker);
+  speaker->positionAt = now();
+  speaker->playing = playing;
+  speaker->paused = paused;
+}
+
+static std::string trackMetaData(Speaker *speaker)
+{
+  std::string didl =
+    "<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
+    "xmlns:r=\"urn:schemas-rinconnetworks-com:metadata-1-0/\" xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\">"
+    "<item id=\"-1\" parentID=\"-1\" restricted=\"true\"><res protocolInfo=\"x-file-cifs:*:audio/mpeg:*\" duration=\"" +
+    timeString(speaker->duration) + "\">" + speaker->uri + "</res>"
+    "<r:streamContent></r:streamContent><upnp:albumArtURI>/getaa?s=1&amp;u=" + speaker->uri + "</upnp:albumArtURI>"
+    "<dc:title>Simulated Track " + format("%u", speaker->track) + "</dc:title><upnp:class>object.item.audioItem.musicTrack</upnp:class>"
+    "<dc:creator>Simulated Artist</dc:creator><upnp:album>Simulated Album</upnp:album>";
+  // Padded to the configured size with a long description
+  std::string description;
+  while (didl.size() + description.size() + 64 < metaDataSize) description += "Lorem ipsum dolor sit amet. ";
+  if (!description.empty()) didl += "<r:description>" + description + "</r:description>";
+  didl += "</item></DIDL-Lite>";
+  return escape(didl);
+}
+
+static Speaker *findSpeaker(const std::string &id)
+{
+  for (size_t i = 0; i < speakers.size(); i++)
+  {
+    if (id == speakers[i].id) return &speakers[i];
+  }
+  return 0;
+}
+
+static Speaker *getCoordinator(Speaker *speaker)
+{
+  // A speaker joined to a member plays from that member's coordinator
+  for (size_t i = 0; i < speakers.size(); i++)
+  {
+    Speaker *next = findSpeaker(speaker->group);
+    if (!next || next == speaker) return speaker;
+    speaker = next;
+  }
+  return speaker;
+}
+
+static std::string browse(Speaker *speaker, const std::string &body)
+{
+  // The queue, or the saved queues, from the starting index; items are
+  // escaped once as DIDL-Lite values and the whole result once more
+  std::string objectID = getTag(body, "ObjectID");
+  bool savedQueues = objectID == "SQ:";
+  uint32_t total = savedQueues ? SIMULATOR_SAVED_QUEUES : speaker->queueLength;
+  uint32_t start = atoi(getTag(body, "StartingIndex").c_str());
+  uint32_t count = atoi(getTag(body, "RequestedCount").c_str());
+  std::string didl =
+    "<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
+    "xmlns:r=\"urn:schemas-rinconnetworks-com:metadata-1-0/\" xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\">";
+  uint32_t returned = 0;
+  for (uint32_t index = start; index < total && (!count || returned < count); index++, returned++)
+  {
+    if (savedQueues)
+    {
+      didl += format(
+        "<container id=\"SQ:%u\" parentID=\"SQ:\" restricted=\"true\"><dc:title>Simulated Playlist %u</dc:title>"
+        "<res protocolInfo=\"file:*:audio/mpegurl:*\">file:///jffs/settings/savedqueues.rsq#%u</res>"
+        "<upnp:class>object.container.playlistContainer</upnp:class></container>", index, index + 1, index);
+      continue;
+    }
+    didl += format(
+      "<item id=\"Q:0/%u\" parentID=\"Q:0\" restricted=\"true\">"
+      "<res protocolInfo=\"x-file-cifs:*:audio/mpeg:*\" duration=\"0:03:21\">x-file-cifs://server/music/track%u.mp3</res>"
+      "<upnp:albumArtURI>/getaa?s=1&amp;u=x-file-cifs%%3a%%2f%%2fserver%%2fmusic%%2ftrack%u.mp3</upnp:albumArtURI>",
+      index + 1, index + 1, index + 1);
+    didl += format(
+      "<dc:title>Simulated Track %u</dc:title><upnp:class>object.item.audioItem.musicTrack</upnp:class>"
+      "<dc:creator>Simulated Artist</dc:creator><upnp:album>Simulated Album</upnp:album></item>", index + 1);
+  }
+  didl += "</DIDL-Lite>";
+  return
+    "<Result>" + escape(didl) + "</Result>" +
+    format("<NumberReturned>%u</NumberReturned><TotalMatches>%u</TotalMatches>", returned, total) +
+    format("<UpdateID>%u</UpdateID>", savedQueues ? 1 : speaker->queueUpdate);
+}
+
+static std::string zoneGroupState()
+{
+  // One group per coordinator, the members are self-closing like those of a
+  // speaker without satellites
+  std::string state = "<ZoneGroupState><ZoneGroups>";
+  for (size_t i = 0; i < speakers.size(); i++)
+  {
+    Speaker *coordinator = &speakers[i];
+    if (getCoordinator(coordinator) != coordinator) continue;
+    state += format("<ZoneGroup Coordinator=\"RINCON_%s01400\" ID=\"RINCON_%s01400:1\">", coordinator->id, coordinator->id);
+    for (size_t j = 0; j < speakers.size(); j++)
+    {
+      Speaker *member = &speakers[j];
+      if (getCoordinator(member) != coordinator) continue;
+      state += format(
+        "<ZoneGroupMember UUID=\"RINCON_%s01400\" Location=\"http://%s:%u/xml/device_description.xml\" "
+        "ZoneName=\"Room %u\" SoftwareVersion=\"57.3-79200\"/>", member->id, member->ip, port, (unsigned)j + 1);
+    }
+    state += "</ZoneGroup>";
+  }
+  state += "</ZoneGroups><VanishedDevices></VanishedDevices></ZoneGroupState>";
+  return "<ZoneGroupState>" + escape(state) + "</ZoneGroupState>";
+}
+
+static std::string handleAction(Speaker *speaker, const std::string &service, const std::string &action, const std::string &body, bool &fault)
+{
+  // Returns the content of the response element
+  fault = false;
+  if (service == "AVTransport")
+  {
+    if (action == "Play") setPlaying(speaker, true, false);
+    else if (action == "Pause") setPlaying(speaker, false, true);
+    else if (action == "Stop") setPlaying(speaker, false, false);
+    else if (action == "Next" || action == "Previous")
+    {
+      speaker->track = action == "Next" ? speaker->track + 1 : (speaker->track > 1 ? speaker->track - 1 : 1);
+      speaker->position = 0;
+      speaker->positionAt = now();
+    }
+    else if (action == "Seek")
+    {
+      std::string target = getTag(body, "Target");
+      if (getTag(body, "Unit") == "TRACK_NR") speaker->track = atoi(target.c_str());
+      else
+      {
+        unsigned hours = 0, minutes = 0, seconds = 0;
+        sscanf(target.c_str(), "%u:%u:%u", &hours, &minutes, &seconds);
+        speaker->position = hours * 3600 + minutes * 60 + seconds;
+        speaker->positionAt = now();
+      }
+    }
+    else if (action == "SetAVTransportURI")
+    {
+      // A speaker given another speaker as its source joins its group
+      speaker->uri = getTag(body, "CurrentURI");
+      speaker->group = speaker->id;
+      if (!speaker->uri.compare(0, 16, "x-rincon:RINCON_")) speaker->group = speaker->uri.substr(16, 12);
+      speaker->track = 1;
+      setPlaying(speaker, false, false);
+      speaker->position = 0;
+    }
+    else if (action == "SetPlayMode") speaker->playMode = getTag(body, "NewPlayMode");
+    else if (action == "GetTransportInfo")
+    {
+      const char *state = speaker->playing ? "PLAYING" : speaker->paused ? "PAUSED_PLAYBACK" : "STOPPED";
+      return format(
+        "<CurrentTransportState>%s</CurrentTransportState><CurrentTransportStatus>OK</CurrentTransportStatus>"
+        "<CurrentSpeed>1</CurrentSpeed>", state);
+    }
+    else if (action == "GetTransportSettings")
+    {
+      return "<PlayMode>" + speaker->playMode + "</PlayMode><RecQualityMode>NOT_IMPLEMENTED</RecQualityMode>";
+    }
+    else if (action == "GetPositionInfo")
+    {
+      return
+        format("<Track>%u</Track>", speaker->track) +
+        "<TrackDuration>" + timeString(speaker->duration) + "</TrackDuration>"
+        "<TrackMetaData>" + trackMetaData(speaker) + "</TrackMetaData>"
+        "<TrackURI>" + speaker->uri + "</TrackURI>"
+        "<RelTime>" + timeString(getPosition(speaker)) + "</RelTime>"
+        "<AbsTime>NOT_IMPLEMENTED</AbsTime><RelCount>2147483647</RelCount><AbsCount>2147483647</AbsCount>";
+    }
+    else if (action == "AddURIToQueue")
+    {
+      speaker->queueLength++;
+      speaker->queueUpdate++;
+      return format(
+        "<FirstTrackNumberEnqueued>%u</FirstTrackNumberEnqueued><NumTracksAdded>1</NumTracksAdded>"
+        "<NewQueueLength>%u</NewQueueLength>", speaker->queueLength, speaker->queueLength);
+    }
+    else if (action == "RemoveAllTracksFromQueue")
+    {
+      speaker->queueLength = 0;
+      speaker->queueUpdate++;
+    }
+    else if (action == "BecomeCoordinatorOfStandaloneGroup") speaker->group = speaker->id;
+    else fault = true;
+    return "";
+  }
+  if (service == "RenderingControl")
+  {
+    if (action == "GetVolume") return format("<CurrentVolume>%u</CurrentVolume>", speaker->volume);
+    if (action == "GetMute") return format("<CurrentMute>%d</CurrentMute>", speaker->mute);
+    if (action == "GetBass") return format("<CurrentBass>%d</CurrentBass>", speaker->bass);
+    if (action == "GetTreble") return format("<CurrentTreble>%d</CurrentTreble>", speaker->treble);
+    if (action == "GetLoudness") return format("<CurrentLoudness>%d</CurrentLoudness>", speaker->loudness);
+    if (action == "GetOutputFixed") return "<CurrentFixed>0</CurrentFixed>";
+    if (action == "SetVolume") speaker->volume = atoi(getTag(body, "DesiredVolume").c_str());
+    else if (action == "SetMute") speaker->mute = getTag(body, "DesiredMute") == "1";
+    else if (action == "SetBass") speaker->bass = atoi(getTag(body, "DesiredBass").c_str());
+    else if (action == "SetTreble") speaker->treble = atoi(getTag(body, "DesiredTreble").c_str());
+    else if (action == "SetLoudness") speaker->loudness = getTag(body, "DesiredLoudness") == "1";
+    else if (action == "SetRelativeVolume")
+    {
+      int volume = speaker->volume + atoi(getTag(body, "Adjustment").c_str());
+      speaker->volume = volume < 0 ? 0 : volume > 100 ? 100 : volume;
+      return format("<NewVolume>%u</NewVolume>", speaker->volume);
+    }
+    else if (action == "RampToVolume")
+    {
+      // The volume is set at once, the ramp time is about what a speaker
+      // reports, a second for every few steps
+      int volume = atoi(getTag(body, "DesiredVolume").c_str());
+      volume = volume < 0 ? 0 : volume > 100 ? 100 : volume;
+      unsigned steps = volume > speaker->volume ? volume - speaker->volume : speaker->volume - volume;
+      speaker->volume = volume;
+      return format("<RampTime>%u</RampTime>", (steps + 3) / 4);
+    }
+    else fault = true;
+    return "";
+  }
+  if (service == "GroupRenderingControl")
+  {
+    if (action == "GetGroupVolume") return format("<CurrentVolume>%u</CurrentVolume>", speaker->groupVolume);
+    if (action == "SetGroupVolume") speaker->groupVolume = atoi(getTag(body, "DesiredVolume").c_str());
+    else if (action == "SetRelativeGroupVolume")
+    {
+      int volume = speaker->groupVolume + atoi(getTag(body, "Adjustment").c_str());
+      speaker->groupVolume = volume < 0 ? 0 : volume > 100 ? 100 : volume;
+      return format("<NewVolume>%u</NewVolume>", speaker->groupVolume);
+    }
+    else if (action != "SnapshotGroupVolume") fault = true;
+    return "";
+  }
+  if (service == "ContentDirectory")
+  {
+    if (action == "Browse") return browse(speaker, body);
+    fault = true;
+    return "";
+  }
+  if (service == "ZoneGroupTopology")
+  {
+    if (action == "GetZoneGroupState") return zoneGroupState();
+    fault = true;
+    return "";
+  }
+  if (service == "DeviceProperties")
+  {
+    if (action == "SetLEDState") speaker->led = getTag(body, "DesiredLEDState") == "On";
+    else if (action == "GetLEDState") return speaker->led ? "<CurrentLEDState>On</CurrentLEDState>" : "<CurrentLEDState>Off</CurrentLEDState>";
+    else fault = true;
+    return "";
+  }
+  fault = true;
+  return "";
+}
+
+static std::string httpResponse(const char *status, const std::string &body, bool close)
+{
+  return
+    format("HTTP/1.1 %s\r\nCONTENT-LENGTH: %u\r\n", status, (unsigned)body.size()) +
+    "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\nEXT:\r\nServer: Linux UPnP/1.0 Sonos/57.3-79200 (ZPS9)\r\n" +
+    (close ? "Connection: close\r\n" : "") + "\r\n" + body;
+}
+
+static std::string soapEnvelope(const std::string &body)
+{
+  return
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body>" + body + "</s:Body></s:Envelope>";
+}
+
+static std::string soapFault(uint16_t errorCode)
+{
+  return soapEnvelope(format(
+    "<s:Fault><faultcode>s:Client</faultcode><faultstring>UPnPError</faultstring><detail>"
+    "<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\"><errorCode>%u</errorCode></UPnPError>"
+    "</detail></s:Fault>", errorCode));
+}
+
+static void queueResponse(Connection *connection, const std::string &data, bool close)
+{
+  // Responses are sent in request order, after the configured delay
+  uint64_t sendAt = now() + delayMs + (jitterMs ? rand() % (jitterMs + 1) : 0);
+  if (!connection->responses.empty() && connection->responses.back().sendAt > sendAt)
+  {
+    sendAt = connection->responses.back().sendAt;
+  }
+  Response response = { sendAt, data, close };
+  connection->responses.push_back(response);
+}
+
+static bool handleRequest(Connection *connection, const std::string &header, const std::string &body)
+{
+  // Returns false when the connection is dropped
+  Speaker *speaker = connection->speaker;
+  speaker->requests++;
+  std::string connectionHeader = getHeader(header, "Connection");
+  bool close = strncasecmp(connectionHeader.c_str(), "keep-alive", 10) != 0;
+  std::string soapAction = getHeader(header, "SOAPAction");
+  size_t serviceStart = soapAction.find("service:");
+  size_t serviceEnd = soapAction.find(':', serviceStart + 8);
+  size_t actionStart = soapAction.find('#');
+  std::string service = serviceStart == std::string::npos || serviceEnd == std::string::npos ? "" :
+    soapAction.substr(serviceStart + 8, serviceEnd - serviceStart - 8);
+  std::string action = actionStart == std::string::npos ? "" : soapAction.substr(actionStart + 1);
+  while (!action.empty() && action[action.size() - 1] == '"') action.erase(action.size() - 1);
+  if (verbose) printf("%s %s#%s%s\n", speaker->ip, service.c_str(), action.c_str(), close ? "" : " (keep-alive)");
+
+  if (!header.compare(0, 10, "SUBSCRIBE ") || !header.compare(0, 12, "UNSUBSCRIBE "))
+  {
+    std::string response = "HTTP/1.1 200 OK\r\nSID: uuid:" + std::string(speaker->id) + "_sub0000000001\r\nTIMEOUT: Second-3600\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    queueResponse(connection, response, true);
+    return true;
+  }
+  if (failurePercent && (uint32_t)(rand() % 100) < failurePercent)
+  {
+    switch (rand() % 3)
+    {
+      case SIMULATOR_FAILURE_DROP:
+        if (verbose) printf("%s dropped\n", speaker->ip);
+        return false;
+      case SIMULATOR_FAILURE_FAULT:
+        if (verbose) printf("%s fault\n", speaker->ip);
+        queueResponse(connection, httpResponse("500 Internal Server Error", soapFault(501), close), close);
+        return true;
+      case SIMULATOR_FAILURE_TRUNCATE:
+        if (verbose) printf("%s truncated\n", speaker->ip);
+        std::string response = httpResponse("200 OK", soapEnvelope("<u:" + action + "Response></u:" + action + "Response>"), true);
+        queueResponse(connection, response.substr(0, response.size() / 2), true);
+        return true;
+    }
+  }
+  bool fault;
+  std::string content = handleAction(speaker, service, action, body, fault);
+  if (fault)
+  {
+    queueResponse(connection, httpResponse("500 Internal Server Error", soapFault(401), close), close);
+    return true;
+  }
+  std::string response = soapEnvelope(
+    "<u:" + action + "Response xmlns:u=\"urn:schemas-upnp-org:service:" + service + ":1\">" +
+    content + "</u:" + action + "Response>");
+  queueResponse(connection, httpResponse("200 OK", response, close), close);
+  return true;
+}
+
+static bool parseRequests(Connection *connection)
+{
+  // Handles every complete request in the input, pipelined requests included
+  while (true)
+  {
+    std::string &input = connection->input;
+    size_t headerEnd = input.find("\n\n");
+    size_t crlfEnd = input.find("\r\n\r\n");
+    size_t separator = 2;
+    if (crlfEnd != std::string::npos && (headerEnd == std::string::npos || crlfEnd < headerEnd))
+    {
+      headerEnd = crlfEnd;
+      separator = 4;
+    }
+    if (headerEnd == std::string::npos) return true;
+    std::string header = input.substr(0, headerEnd);
+    size_t contentLength = atoi(getHeader(header, "Content-Length").c_str());
+    size_t bodyStart = headerEnd + separator;
+    if (input.size() < bodyStart + contentLength) return true;
+    std::string body = input.substr(bodyStart, contentLength);
+    input.erase(0, bodyStart + contentLength);
+    if (!handleRequest(connection, header, body)) return false;
+    if (!connection->responses.empty() && connection->responses.back().close) return true;
+  }
+}
+
+static void closeConnection(Connection *connection)
+{
+  close(connection->fd);
+  for (size_t i = 0; i < connections.size(); i++)
+  {
+    if (connections[i] == connection)
+    {
+      connections.erase(connections.begin() + i);
+      break;
+    }
+  }
+  delete connection;
+}
+
+static bool sendResponses(Connection *connection)
+{
+  // Returns false when the connection was closed
+  uint64_t time = now();
+  while (!connection->responses.empty() && connection->responses.front().sendAt <= time)
+  {
+    Response &response = connection->responses.front();
+    size_t sent = 0;
+    while (sent < response.data.size())
+    {
+      ssize_t result = send(connection->fd, response.data.data() + sent, response.data.size() - sent, MSG_NOSIGNAL);
+      if (result < 0 && errno == EINTR) continue;
+      if (result <= 0)
+      {
+        closeConnection(connection);
+        return false;
+      }
+      sent += result;
+    }
+    bool closing = response.close;
+    connection->responses.erase(connection->responses.begin());
+    if (closing)
+    {
+      closeConnection(connection);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool listenSpeaker(Speaker *speaker, int epollFd)
+{
+  speaker->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int enable = 1;
+  setsockopt(speaker->fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  inet_pton(AF_INET, speaker->ip, &address.sin_addr);
+  if (bind(speaker->fd, (sockaddr *)&address, sizeof(address)) || listen(speaker->fd, 64))
+  {
+    fprintf(stderr, "Cannot listen on %s:%u: %s\n", speaker->ip, port, strerror(errno));
+    return false;
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = speaker;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, speaker->fd, &event);
+  return true;
+}
+
+static bool isSpeaker(void *pointer)
+{
+  for (size_t i = 0; i < speakers.size(); i++)
+  {
+    if (pointer == &speakers[i]) return true;
+  }
+  return false;
+}
+
+int main(int argc, char **argv)
+{
+  uint8_t count = 1;
+  int option;
+  while ((option = getopt(argc, argv, "n:d:j:f:m:q:p:v")) != -1)
+  {
+    switch (option)
+    {
+      case 'n': count = atoi(optarg); break;
+      case 'd': delayMs = atoi(optarg); break;
+      case 'j': jitterMs = atoi(optarg); break;
+      case 'f': failurePercent = atoi(optarg); break;
+      case 'm': metaDataSize = atoi(optarg); break;
+      case 'q': queueLength = atoi(optarg); break;
+      case 'p': port = atoi(optarg); break;
+      case 'v': verbose = true; break;
+      default:
+        fprintf(stderr, "Usage: %s [-n speakers] [-d delay ms] [-j jitter ms] [-f failure %%] [-m metadata bytes] [-q queue tracks] [-p port] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (!count) count = 1;
+  srand(time(0));
+  int epollFd = epoll_create1(EPOLL_CLOEXEC);
+  speakers.resize(count);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    Speaker *speaker = &speakers[i];
+    snprintf(speaker->ip, sizeof(speaker->ip), "127.0.0.%u", i + 1);
+    snprintf(speaker->id, sizeof(speaker->id), "000E58%06X", i + 1);
+    speaker->playing = false;
+    speaker->paused = false;
+    speaker->volume = 20;
+    speaker->groupVolume = 20;
+    speaker->mute = false;
+    speaker->bass = 0;
+    speaker->treble = 0;
+    speaker->loudness = true;
+    speaker->led = true;
+    speaker->playMode = "NORMAL";
+    speaker->uri = "x-file-cifs://server/music/track.mp3";
+    speaker->group = speaker->id;
+    speaker->queueLength = queueLength;
+    speaker->queueUpdate = 1;
+    speaker->track = 1;
+    speaker->duration = 201;
+    speaker->position = 0;
+    speaker->positionAt = now();
+    speaker->requests = 0;
+    if (!listenSpeaker(speaker, epollFd)) return 1;
+    printf("ZonePlayer RINCON_%s01400 on %s:%u\n", speaker->id, speaker->ip, port);
+  }
+  fflush(stdout);
+
+  struct epoll_event events[SIMULATOR_MAX_EVENTS];
+  char buffer[SIMULATOR_READ_SIZE];
+  while (true)
+  {
+    // Sleeps until a request arrives or the next delayed response is due
+    int timeout = -1;
+    uint64_t time = now();
+    for (size_t i = 0; i < connections.size(); i++)
+    {
+      if (connections[i]->responses.empty()) continue;
+      uint64_t sendAt = connections[i]->responses.front().sendAt;
+      int wait = sendAt > time ? sendAt - time : 0;
+      if (timeout < 0 || wait < timeout) timeout = wait;
+    }
+    int ready = epoll_wait(epollFd, events, SIMULATOR_MAX_EVENTS, timeout);
+    for (int i = 0; i < ready; i++)
+    {
+      if (isSpeaker(events[i].data.ptr))
+      {
+        Speaker *speaker = (Speaker *)events[i].data.ptr;
+        int fd = accept4(speaker->fd, 0, 0, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        Connection *connection = new Connection();
+        connection->fd = fd;
+        connection->speaker = speaker;
+        connections.push_back(connection);
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = connection;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        continue;
+      }
+      Connection *connection = (Connection *)events[i].data.ptr;
+      bool known = false;
+      for (size_t j = 0; j < connections.size() && !known; j++)
+      {
+        known = connections[j] == connection;
+      }
+      if (!known) continue;
+      ssize_t received = recv(connection->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+      if (received <= 0)
+      {
+        if (received < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        closeConnection(connection);
+        continue;
+      }
+      connection->input.append(buffer, received);
+      if (!parseRequests(connection)) closeConnection(connection);
+    }
+    for (size_t i = 0; i < connections.size(); i++)
+    {
+      if (!sendResponses(connections[i])) i--;
+    }
+  }
+}
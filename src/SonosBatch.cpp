@@ -0,0 +1,284 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#include "SonosBatch.h"
+
+SonosBatch::SonosBatch(SonosUPnP *sonos)
+{
+  this->sonos = sonos;
+  this->stopOnFailure = false;
+  this->overflow = false;
+  this->stepCount = 0;
+  this->valueLength = 0;
+}
+
+void SonosBatch::begin(IPAddress speakerIP)
+{
+  // Until send(), the blocking setters called for the speaker are recorded
+  // instead of sent; other speakers and the getters are not affected
+  this->speakerIP = speakerIP;
+  stepCount = 0;
+  valueLength = 0;
+  overflow = false;
+  sonos->batch = this;
+}
+
+void SonosBatch::setStopOnFailure(bool stopOnFailure)
+{
+  this->stopOnFailure = stopOnFailure;
+}
+
+uint8_t SonosBatch::send()
+{
+  // Steps are written ahead of their responses, up to SONOS_BATCH_WINDOW, and
+  // the responses are read in order; returns the number of steps that succeeded.
+  // Like single requests, transport commands go to the group coordinator
+  if (sonos->batch == this) sonos->batch = 0;
+  if (overflow)
+  {
+    for (uint8_t i = 0; i < stepCount; i++)
+    {
+      steps[i].status = SONOS_BATCH_SKIPPED;
+    }
+    return 0;
+  }
+  bool keepAlive = sonos->keepAlive;
+  sonos->keepAlive = true;
+  uint8_t succeeded = 0;
+  uint8_t sent = 0;
+  uint8_t answered = 0;
+  uint8_t connectState = 0;
+  bool connectionAnswered = false;
+  IPAddress targetIP;
+  while (answered < stepCount)
+  {
+    if (sent == answered)
+    {
+      // Nothing in flight, the rest goes out on a kept or a new connection
+      IPAddress nextIP = getTargetIP(&steps[answered]);
+      if (!keepAlive && sonos->connection && nextIP != targetIP) sonos->ethClient->stop();
+      targetIP = nextIP;
+      connectState = sonos->ethClient_connect(targetIP, 0);
+      connectionAnswered = false;
+      if (!connectState) break;
+    }
+    // Only steps to the same speaker are pipelined, and none after a group
+    // change, as it changes where the later ones are routed
+    while (sent < stepCount && sent - answered < SONOS_BATCH_WINDOW &&
+           (sent == answered || (getTargetIP(&steps[sent]) == targetIP && !sonos->isGroupChange(steps[sent - 1].action_P))))
+    {
+      writeStep(&steps[sent++], targetIP);
+    }
+    if (readStep())
+    {
+      connectionAnswered = true;
+      if (sonos->connection->requestResult.error != SONOS_ERROR_NONE)
+      {
+        // Answered with an error, the connection itself is still good
+        completeStep(&steps[answered++], SONOS_BATCH_FAILED);
+        if (stopOnFailure)
+        {
+          sonos->ethClient->stop();
+          break;
+        }
+      }
+      else
+      {
+        completeStep(&steps[answered++], SONOS_BATCH_DONE);
+        succeeded++;
+      }
+      // Requests after a response that ends the connection are sent again
+      if (!sonos->connection->reusable)
+      {
+        sonos->ethClient->stop();
+        sent = answered;
+      }
+      continue;
+    }
+    // A kept connection may have been dropped by the speaker while idle, then
+    // nothing was read and the steps are sent again on a new one
+    bool closed = sonos->connection->requestResult.error == SONOS_ERROR_NONE && !sonos->readLength;
+    sonos->ethClient->stop();
+    if (connectState == 2 && !connectionAnswered && closed)
+    {
+      sent = answered;
+      continue;
+    }
+    // The speaker may have carried out the steps in flight, like a single
+    // request they are not sent again
+    while (answered < sent)
+    {
+      completeStep(&steps[answered++], SONOS_BATCH_FAILED);
+    }
+    if (sonos->ethernetErrCallback) sonos->ethernetErrCallback();
+    if (stopOnFailure) break;
+  }
+  // Not sent after a failure, or no connection could be made for them
+  while (answered < stepCount)
+  {
+    completeStep(&steps[answered++], connectState ? SONOS_BATCH_SKIPPED : SONOS_BATCH_FAILED);
+  }
+  sonos->keepAlive = keepAlive;
+  if (!keepAlive && sonos->connection) sonos->ethClient->stop();
+  sonos->connection = 0;
+  // The last result is that of the first step that failed
+  sonos->lastResult.error = SONOS_ERROR_NONE;
+  sonos->lastResult.httpStatus = 0;
+  sonos->lastResult.upnpError = 0;
+  for (uint8_t i = 0; i < stepCount; i++)
+  {
+    if (steps[i].status != SONOS_BATCH_FAILED) continue;
+    sonos->lastResult = steps[i].result;
+    break;
+  }
+  return succeeded;
+}
+
+uint8_t SonosBatch::getStepCount()
+{
+  return stepCount;
+}
+
+uint8_t SonosBatch::getStepStatus(uint8_t step)
+{
+  if (step >= stepCount) return SONOS_BATCH_SKIPPED;
+  return steps[step].status;
+}
+
+const SonosResult *SonosBatch::getStepResult(uint8_t step)
+{
+  // Valid until the next begin()
+  if (step >= stepCount) return 0;
+  return &steps[step].result;
+}
+
+bool SonosBatch::record(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue)
+{
+  // Values are copied, they are often formatted on the caller's stack; a
+  // step that does not fit makes send() skip the whole batch
+  if (ip != speakerIP) return false;
+  if (stepCount == SONOS_BATCH_MAX_STEPS)
+  {
+    overflow = true;
+    return true;
+  }
+  Step *step = &steps[stepCount++];
+  step->upnpMessageType = upnpMessageType;
+  step->status = SONOS_BATCH_QUEUED;
+  step->action_P = action_P;
+  step->field = field;
+  step->valueA = copyValue(valueA);
+  step->valueB = copyValue(valueB);
+  step->extraStart_P = extraStart_P;
+  step->extraEnd_P = extraEnd_P;
+  step->extraValue = sonos->meta ? copyMeta(sonos->meta) : copyValue(extraValue);
+  step->meta = sonos->meta && step->extraValue == SONOS_BATCH_NO_VALUE ? sonos->meta : 0;
+  #ifdef SONOS_STATS_MODE
+  step->sentAt = 0;
+  #endif
+  return true;
+}
+
+uint16_t SonosBatch::copyValue(const char *value)
+{
+  size_t length = strlen(value);
+  if (!length) return SONOS_BATCH_NO_VALUE;
+  if (valueLength + length + 1 > SONOS_BATCH_VALUE_SIZE)
+  {
+    overflow = true;
+    return SONOS_BATCH_NO_VALUE;
+  }
+  uint16_t offset = valueLength;
+  memcpy(values + offset, value, length + 1);
+  valueLength += length + 1;
+  return offset;
+}
+
+uint16_t SonosBatch::copyMeta(const MetaData *meta)
+{
+  // Escaped once here, the DIDL-Lite is then sent like any other extra value;
+  // when it does not fit, e.g. on AVR, the step writes it from the caller's
+  // MetaData at send() instead
+  uint16_t length = sonos->metaWrite(meta, false, 0);
+  if (valueLength + length + 1 > SONOS_BATCH_VALUE_SIZE) return SONOS_BATCH_NO_VALUE;
+  uint16_t offset = valueLength;
+  sonos->metaWrite(meta, false, values + offset);
+  valueLength += length + 1;
+  return offset;
+}
+
+const char *SonosBatch::getValue(uint16_t offset)
+{
+  return offset == SONOS_BATCH_NO_VALUE ? "" : values + offset;
+}
+
+IPAddress SonosBatch::getTargetIP(Step *step)
+{
+  return sonos->routeRequest(speakerIP, step->upnpMessageType, step->action_P);
+}
+
+void SonosBatch::writeStep(Step *step, IPAddress ip)
+{
+  #ifdef SONOS_STATS_MODE
+  step->sentAt = micros();
+  #endif
+  sonos->meta = step->meta;
+  sonos->upnpWriteRequest(
+    ip, step->upnpMessageType, step->action_P, step->field, getValue(step->valueA), getValue(step->valueB),
+    step->extraStart_P, step->extraEnd_P, getValue(step->extraValue));
+  sonos->meta = 0;
+}
+
+bool SonosBatch::readStep()
+{
+  // Reads one response, with the UPnP error code of a fault; the next one can
+  // only be found when the body has a known length, without it the connection
+  // ends with this response. False when it was cut short by a timeout or close
+  sonos->connection->requestResult.error = SONOS_ERROR_NONE;
+  sonos->connection->requestResult.upnpError = 0;
+  if (!sonos->ethClient_readHeaders()) return false;
+  sonos->ethClient_checkStatus();
+  if (sonos->connection->bodyLeft >= 0) sonos->ethClient_discard(true);
+  if (sonos->connection->bodyLeft) sonos->connection->reusable = false;
+  uint8_t error = sonos->connection->requestResult.error;
+  return error != SONOS_ERROR_TIMEOUT && error != SONOS_ERROR_CLOSED;
+}
+
+void SonosBatch::completeStep(Step *step, uint8_t status)
+{
+  // Errors are those of the step's connection, steps in flight when it failed
+  // share them
+  step->status = status;
+  step->result.error = SONOS_ERROR_NONE;
+  step->result.httpStatus = 0;
+  step->result.upnpError = 0;
+  if (status == SONOS_BATCH_SKIPPED) return;
+  if (sonos->connection) step->result = sonos->connection->requestResult;
+  else step->result.error = SONOS_ERROR_NO_CONNECTION;
+  if (status == SONOS_BATCH_DONE) step->result.error = SONOS_ERROR_NONE;
+  else if (step->result.error == SONOS_ERROR_NONE) step->result.error = SONOS_ERROR_CLOSED;
+  #ifdef SONOS_STATS_MODE
+  // Timed from when the step was last written
+  uint32_t time = step->sentAt ? (uint32_t)(micros() - step->sentAt) : 0;
+  sonos->statsRecord(speakerIP, step->action_P, step->result.error, time, 0);
+  #endif
+  sonos->cacheWriteThrough(
+    speakerIP, step->action_P, getValue(step->valueA), step->extraStart_P, getValue(step->extraValue),
+    status == SONOS_BATCH_DONE);
+}
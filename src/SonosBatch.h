@@ -0,0 +1,122 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#ifndef SonosBatch_h
+#define SonosBatch_h
+
+#include "SonosUPnP.h"
+
+// Pipelined requests, written back to back on one kept connection and
+// answered in order by the speaker:
+/*
+POST /MediaRenderer/AVTransport/Control HTTP/1.1      -> RemoveAllTracksFromQueue
+POST /MediaRenderer/AVTransport/Control HTTP/1.1      -> AddURIToQueue
+POST /MediaRenderer/RenderingControl/Control HTTP/1.1 -> SetVolume
+
+HTTP/1.1 200 OK                                       <- RemoveAllTracksFromQueue
+HTTP/1.1 200 OK                                       <- AddURIToQueue
+HTTP/1.1 200 OK                                       <- SetVolume
+*/
+#define SONOS_BATCH_QUEUED 0
+#define SONOS_BATCH_DONE 1
+#define SONOS_BATCH_FAILED 2
+#define SONOS_BATCH_SKIPPED 3
+#define SONOS_BATCH_NO_VALUE 0xFFFF
+#ifndef SONOS_BATCH_MAX_STEPS
+  #if (defined(__AVR__))
+    #define SONOS_BATCH_MAX_STEPS 6
+  #else
+    #define SONOS_BATCH_MAX_STEPS 16
+  #endif
+#endif
+// Room for the values of all steps, copied when recorded; meta data that
+// does not fit is kept by reference and written at send()
+#ifndef SONOS_BATCH_VALUE_SIZE
+  #if (defined(__AVR__))
+    #define SONOS_BATCH_VALUE_SIZE 128
+  #else
+    #define SONOS_BATCH_VALUE_SIZE 1024
+  #endif
+#endif
+// Max requests sent ahead of their responses, keeps both sides from blocking
+// on full socket buffers
+#ifndef SONOS_BATCH_WINDOW
+  #if (defined(__AVR__))
+    #define SONOS_BATCH_WINDOW 3
+  #else
+    #define SONOS_BATCH_WINDOW 8
+  #endif
+#endif
+
+class SonosBatch
+{
+
+  public:
+
+    SonosBatch(SonosUPnP *sonos);
+
+    void begin(IPAddress speakerIP);
+    void setStopOnFailure(bool stopOnFailure);
+    uint8_t send();
+    uint8_t getStepCount();
+    uint8_t getStepStatus(uint8_t step);
+    const SonosResult *getStepResult(uint8_t step);
+
+  private:
+
+    friend class SonosUPnP;
+
+    struct Step
+    {
+      uint8_t upnpMessageType;
+      uint8_t status;
+      PGM_P action_P;
+      const char *field;
+      uint16_t valueA;
+      uint16_t valueB;
+      PGM_P extraStart_P;
+      PGM_P extraEnd_P;
+      uint16_t extraValue;
+      const MetaData *meta;
+      SonosResult result;
+      #ifdef SONOS_STATS_MODE
+      uint32_t sentAt;
+      #endif
+    };
+
+    SonosUPnP *sonos;
+    IPAddress speakerIP;
+    bool stopOnFailure;
+    bool overflow;
+    uint8_t stepCount;
+    uint16_t valueLength;
+    Step steps[SONOS_BATCH_MAX_STEPS];
+    char values[SONOS_BATCH_VALUE_SIZE];
+
+    bool record(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue);
+    uint16_t copyValue(const char *value);
+    uint16_t copyMeta(const MetaData *meta);
+    const char *getValue(uint16_t offset);
+    IPAddress getTargetIP(Step *step);
+    void writeStep(Step *step, IPAddress ip);
+    bool readStep();
+    void completeStep(Step *step, uint8_t status);
+};
+
+#endif
@@ -0,0 +1,184 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#include "SonosDiscovery.h"
+
+const char p_SsdpMSearch[] PROGMEM = SSDP_M_SEARCH;
+const char p_SsdpHeaderUsnName[] PROGMEM = SSDP_HEADER_USN_NAME;
+const char p_SsdpHeaderServerName[] PROGMEM = SSDP_HEADER_SERVER_NAME;
+
+SonosDiscovery::SonosDiscovery()
+{
+  this->count = 0;
+  this->scanning = false;
+}
+
+bool SonosDiscovery::beginScan()
+{
+  // Multicast search, every ZonePlayer answers within MX seconds
+  udp.begin(SSDP_LOCAL_PORT);
+  if (!sendSearch(UPNP_MULTICAST_IP, UPNP_MULTICAST_PORT)) return false;
+  scanStarted = millis();
+  scanTimeout = UPNP_MULTICAST_TIMEOUT_S * 1000UL + 500;
+  scanning = true;
+  return true;
+}
+
+bool SonosDiscovery::beginRescan()
+{
+  // Unicast search to the known players only, players not answering are removed
+  udp.begin(SSDP_LOCAL_PORT);
+  scanStarted = millis();
+  scanTimeout = SSDP_RESCAN_TIMEOUT_MS;
+  scanning = true;
+  bool sent = false;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    sent |= sendSearch(zonePlayers[i].ip, UPNP_MULTICAST_PORT);
+  }
+  return sent;
+}
+
+bool SonosDiscovery::poll()
+{
+  // Handles the responses received so far, returns true while scanning
+  if (!scanning) return false;
+  while (udp.parsePacket()) readResponse();
+  if ((uint32_t)(millis() - scanStarted) > scanTimeout)
+  {
+    scanning = false;
+    removeStale();
+    udp.stop();
+  }
+  return scanning;
+}
+
+void SonosDiscovery::clear()
+{
+  count = 0;
+}
+
+uint8_t SonosDiscovery::getCount()
+{
+  return count;
+}
+
+ZonePlayer *SonosDiscovery::getZonePlayer(uint8_t index)
+{
+  return index < count ? &zonePlayers[index] : 0;
+}
+
+ZonePlayer *SonosDiscovery::findZonePlayer(const char *id)
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (!strcmp(zonePlayers[i].id, id)) return &zonePlayers[i];
+  }
+  return 0;
+}
+
+ZonePlayer *SonosDiscovery::findZonePlayer(IPAddress ip)
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (zonePlayers[i].ip == ip) return &zonePlayers[i];
+  }
+  return 0;
+}
+
+
+bool SonosDiscovery::sendSearch(IPAddress ip, uint16_t port)
+{
+  char buffer[sizeof(SSDP_M_SEARCH) + 8];
+  sprintf_P(buffer, p_SsdpMSearch, ip[0], ip[1], ip[2], ip[3], port, UPNP_MULTICAST_TIMEOUT_S);
+  if (!udp.beginPacket(ip, port)) return false;
+  udp.write((const uint8_t *)buffer, strlen(buffer));
+  return udp.endPacket();
+}
+
+void SonosDiscovery::readResponse()
+{
+  char line[SSDP_LINE_SIZE];
+  char id[SONOS_ID_SIZE] = "";
+  char model[SONOS_MODEL_SIZE] = "";
+  while (readLine(line, sizeof(line)))
+  {
+    if (!strncasecmp_P(line, p_SsdpHeaderUsnName, sizeof(SSDP_HEADER_USN_NAME) - 1))
+    {
+      // uuid:RINCON_000E58A0B2C601400::urn:... gives the ID 000E58A0B2C6
+      const char *rincon = strstr(line, SSDP_RINCON_PREFIX);
+      if (!rincon) continue;
+      rincon += sizeof(SSDP_RINCON_PREFIX) - 1;
+      uint8_t length = 0;
+      while (rincon[length] && rincon[length] != ':') length++;
+      if (length > 5) length -= 5;
+      if (length >= sizeof(id)) length = sizeof(id) - 1;
+      memcpy(id, rincon, length);
+      id[length] = '\0';
+    }
+    else if (!strncasecmp_P(line, p_SsdpHeaderServerName, sizeof(SSDP_HEADER_SERVER_NAME) - 1))
+    {
+      // Model is given in parentheses at the end, e.g. (ZPS9)
+      const char *start = strrchr(line, '(');
+      if (!start) continue;
+      strlcpy(model, start + 1, sizeof(model));
+      char *end = strchr(model, ')');
+      if (end) *end = '\0';
+    }
+  }
+  if (!*id) return;
+  ZonePlayer *zonePlayer = findZonePlayer(id);
+  if (!zonePlayer)
+  {
+    if (count >= SONOS_MAX_ZONE_PLAYERS) return;
+    zonePlayer = &zonePlayers[count++];
+    strcpy(zonePlayer->id, id);
+    *zonePlayer->model = '\0';
+  }
+  zonePlayer->ip = udp.remoteIP();
+  if (*model) strcpy(zonePlayer->model, model);
+  zonePlayer->lastSeen = millis();
+}
+
+bool SonosDiscovery::readLine(char *buffer, size_t bufferSize)
+{
+  // Reads one header line from the current packet, truncated to the buffer size
+  size_t length = 0;
+  int character;
+  while ((character = udp.read()) >= 0 && character != '\n')
+  {
+    if (character != '\r' && length < bufferSize - 1) buffer[length++] = character;
+  }
+  buffer[length] = '\0';
+  return length || character >= 0;
+}
+
+void SonosDiscovery::removeStale()
+{
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (zonePlayers[i].lastSeen - scanStarted < 0x80000000UL)
+    {
+      if (kept != i) zonePlayers[kept] = zonePlayers[i];
+      kept++;
+    }
+  }
+  count = kept;
+}
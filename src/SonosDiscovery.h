@@ -0,0 +1,96 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#ifndef SonosDiscovery_h
+#define SonosDiscovery_h
+
+#include "SonosUPnP.h"
+
+// SSDP discovery:
+/*
+M-SEARCH * HTTP/1.1
+HOST: 239.255.255.250:1900
+MAN: "ssdp:discover"
+MX: 2
+ST: urn:schemas-upnp-org:device:ZonePlayer:1
+
+HTTP/1.1 200 OK
+CACHE-CONTROL: max-age = 1800
+LOCATION: http://192.168.0.201:1400/xml/device_description.xml
+SERVER: Linux UPnP/1.0 Sonos/57.3-79200 (ZPS9)
+ST: urn:schemas-upnp-org:device:ZonePlayer:1
+USN: uuid:RINCON_000E58A0B2C601400::urn:schemas-upnp-org:device:ZonePlayer:1
+*/
+#define SSDP_M_SEARCH "M-SEARCH * HTTP/1.1\r\nHOST: %d.%d.%d.%d:%d\r\nMAN: \"ssdp:discover\"\r\nMX: %d\r\nST: urn:schemas-upnp-org:device:ZonePlayer:1\r\n\r\n"
+#define SSDP_HEADER_USN_NAME "usn:"
+#define SSDP_HEADER_SERVER_NAME "server:"
+#define SSDP_RINCON_PREFIX "RINCON_"
+#define SSDP_LOCAL_PORT 1901
+#define SSDP_LINE_SIZE 64
+#define SSDP_RESCAN_TIMEOUT_MS 1000
+#define SONOS_ID_SIZE 13
+#define SONOS_MODEL_SIZE 8
+#ifndef SONOS_MAX_ZONE_PLAYERS
+  #if (defined(__AVR__))
+    #define SONOS_MAX_ZONE_PLAYERS 6
+  #else
+    #define SONOS_MAX_ZONE_PLAYERS 32
+  #endif
+#endif
+
+struct ZonePlayer
+{
+  IPAddress ip;
+  char id[SONOS_ID_SIZE];
+  char model[SONOS_MODEL_SIZE];
+  uint32_t lastSeen;
+};
+
+class SonosDiscovery
+{
+
+  public:
+
+    SonosDiscovery();
+
+    bool beginScan();
+    bool beginRescan();
+    bool poll();
+    void clear();
+    uint8_t getCount();
+    ZonePlayer *getZonePlayer(uint8_t index);
+    ZonePlayer *findZonePlayer(const char *id);
+    ZonePlayer *findZonePlayer(IPAddress ip);
+
+  private:
+
+    SonosUDP udp;
+    ZonePlayer zonePlayers[SONOS_MAX_ZONE_PLAYERS];
+    uint8_t count;
+    bool scanning;
+    uint32_t scanStarted;
+    uint32_t scanTimeout;
+
+    bool sendSearch(IPAddress ip, uint16_t port);
+    void readResponse();
+    bool readLine(char *buffer, size_t bufferSize);
+    void removeStale();
+};
+
+#endif
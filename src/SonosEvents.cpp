@@ -0,0 +1,534 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#include "SonosEvents.h"
+
+#define EVENT_PARSE_TEXT 0
+#define EVENT_PARSE_NAME 1
+#define EVENT_PARSE_TAG 2
+#define EVENT_PARSE_VALUE 3
+#define EVENT_VALUE_NONE 0
+#define EVENT_VALUE_VAL 1
+#define EVENT_VALUE_CHANNEL 2
+
+const char p_GenaSubscribe[] PROGMEM = GENA_SUBSCRIBE;
+const char p_GenaUnsubscribe[] PROGMEM = GENA_UNSUBSCRIBE;
+const char p_GenaHttpVersion[] PROGMEM = HTTP_VERSION;
+const char p_GenaHeaderHost[] PROGMEM = GENA_HEADER_HOST;
+const char p_GenaHeaderCallback[] PROGMEM = GENA_HEADER_CALLBACK;
+const char p_GenaHeaderNT[] PROGMEM = GENA_HEADER_NT;
+const char p_GenaHeaderSid[] PROGMEM = GENA_HEADER_SID;
+const char p_GenaHeaderTimeout[] PROGMEM = GENA_HEADER_TIMEOUT;
+const char p_GenaHeaderSidName[] PROGMEM = GENA_HEADER_SID_NAME;
+const char p_GenaHeaderTimeoutName[] PROGMEM = GENA_HEADER_TIMEOUT_NAME;
+const char p_GenaHeaderContentLengthName[] PROGMEM = GENA_HEADER_CONTENT_LENGTH_NAME;
+const char p_GenaNotifyResponse[] PROGMEM = GENA_NOTIFY_RESPONSE;
+const char p_UpnpAvTransportEventEndpoint[] PROGMEM = UPNP_AV_TRANSPORT_EVENT_ENDPOINT;
+const char p_UpnpRenderingControlEventEndpoint[] PROGMEM = UPNP_RENDERING_CONTROL_EVENT_ENDPOINT;
+const char p_UpnpZoneGroupTopologyEventEndpoint[] PROGMEM = UPNP_ZONE_GROUP_TOPOLOGY_EVENT_ENDPOINT;
+
+const char p_EventTransportState[] PROGMEM = SONOS_EVENT_TRANSPORT_STATE;
+const char p_EventCurrentTrack[] PROGMEM = SONOS_EVENT_CURRENT_TRACK;
+const char p_EventCurrentTrackDuration[] PROGMEM = SONOS_EVENT_CURRENT_TRACK_DURATION;
+const char p_EventCurrentTrackURI[] PROGMEM = SONOS_EVENT_CURRENT_TRACK_URI;
+const char p_EventVolume[] PROGMEM = SONOS_EVENT_VOLUME;
+const char p_EventMute[] PROGMEM = SONOS_EVENT_MUTE;
+const char p_EventAttributeVal[] PROGMEM = SONOS_EVENT_ATTRIBUTE_VAL;
+const char p_EventAttributeChannel[] PROGMEM = SONOS_EVENT_ATTRIBUTE_CHANNEL;
+
+static uint32_t eventTimeInSeconds(const char *time)
+{
+  // Parses h:mm:ss
+  uint32_t seconds = 0;
+  uint32_t part = 0;
+  for (; *time; time++)
+  {
+    if (*time == ':')
+    {
+      seconds = (seconds + part) * 60;
+      part = 0;
+    }
+    else if (*time >= '0' && *time <= '9')
+    {
+      part = part * 10 + *time - '0';
+    }
+  }
+  return seconds + part;
+}
+
+static void eventUnescape(char *value)
+{
+  // Attribute values of the LastChange document are escaped once more
+  char *output = value;
+  while (*value)
+  {
+    if (*value == '&')
+    {
+      if (!strncmp(value, "&amp;", 5)) { *output++ = '&'; value += 5; continue; }
+      if (!strncmp(value, "&lt;", 4)) { *output++ = '<'; value += 4; continue; }
+      if (!strncmp(value, "&gt;", 4)) { *output++ = '>'; value += 4; continue; }
+      if (!strncmp(value, "&quot;", 6)) { *output++ = '"'; value += 6; continue; }
+      if (!strncmp(value, "&apos;", 6)) { *output++ = '\''; value += 6; continue; }
+    }
+    *output++ = *value++;
+  }
+  *output = '\0';
+}
+
+SonosEvents::SonosEvents(SonosClient client, uint16_t port) : server(port)
+{
+  this->ethClient = client;
+  this->port = port;
+  for (uint8_t i = 0; i < SONOS_EVENT_SUBSCRIPTIONS; i++)
+  {
+    this->subscriptions[i].upnpMessageType = 0;
+    *this->subscriptions[i].sid = '\0';
+  }
+  this->transportStateCallback = 0;
+  this->volumeCallback = 0;
+  this->muteCallback = 0;
+  this->trackCallback = 0;
+  this->topologyCallback = 0;
+}
+
+void SonosEvents::begin(IPAddress localIP)
+{
+  this->localIP = localIP;
+  server.begin();
+}
+
+bool SonosEvents::subscribe(IPAddress speakerIP, uint8_t upnpMessageType)
+{
+  Subscription *subscription = findSubscription(speakerIP, upnpMessageType);
+  if (subscription) return sendSubscribe(subscription, true) || sendSubscribe(subscription, false);
+  subscription = findSubscription(speakerIP, 0);
+  if (!subscription) return false;
+  subscription->ip = speakerIP;
+  subscription->upnpMessageType = upnpMessageType;
+  if (sendSubscribe(subscription, false)) return true;
+  subscription->upnpMessageType = 0;
+  return false;
+}
+
+bool SonosEvents::unsubscribe(IPAddress speakerIP, uint8_t upnpMessageType)
+{
+  Subscription *subscription = findSubscription(speakerIP, upnpMessageType);
+  if (!subscription) return false;
+  sendUnsubscribe(subscription);
+  return true;
+}
+
+void SonosEvents::unsubscribeAll()
+{
+  for (uint8_t i = 0; i < SONOS_EVENT_SUBSCRIPTIONS; i++)
+  {
+    if (subscriptions[i].upnpMessageType) sendUnsubscribe(&subscriptions[i]);
+  }
+}
+
+void SonosEvents::poll()
+{
+  // Renew subscriptions before the speaker lets them expire
+  for (uint8_t i = 0; i < SONOS_EVENT_SUBSCRIPTIONS; i++)
+  {
+    Subscription *subscription = &subscriptions[i];
+    if (subscription->upnpMessageType && (int32_t)(millis() - subscription->renewAt) >= 0)
+    {
+      if (!sendSubscribe(subscription, true) && !sendSubscribe(subscription, false))
+      {
+        subscription->renewAt = millis() + GENA_RENEW_MARGIN_S * 1000UL / 4;
+      }
+    }
+  }
+  SonosClient client = server.available();
+  if (client) handleNotify(client);
+}
+
+void SonosEvents::setTransportStateCallback(void (*callback)(IPAddress speakerIP, uint8_t state))
+{
+  transportStateCallback = callback;
+}
+
+void SonosEvents::setVolumeCallback(void (*callback)(IPAddress speakerIP, uint8_t volume))
+{
+  volumeCallback = callback;
+}
+
+void SonosEvents::setMuteCallback(void (*callback)(IPAddress speakerIP, bool state))
+{
+  muteCallback = callback;
+}
+
+void SonosEvents::setTrackCallback(void (*callback)(IPAddress speakerIP, uint16_t number, uint32_t duration, const char *uri))
+{
+  trackCallback = callback;
+}
+
+void SonosEvents::setTopologyCallback(void (*callback)(IPAddress speakerIP))
+{
+  // Called when the groups change, e.g. to invalidate a SonosTopology; the
+  // zone group state itself is not parsed here
+  topologyCallback = callback;
+}
+
+
+SonosEvents::Subscription *SonosEvents::findSubscription(IPAddress speakerIP, uint8_t upnpMessageType)
+{
+  // A message type of 0 finds a free slot
+  for (uint8_t i = 0; i < SONOS_EVENT_SUBSCRIPTIONS; i++)
+  {
+    Subscription *subscription = &subscriptions[i];
+    if (subscription->upnpMessageType == upnpMessageType && (!upnpMessageType || subscription->ip == speakerIP))
+    {
+      return subscription;
+    }
+  }
+  return 0;
+}
+
+bool SonosEvents::sendSubscribe(Subscription *subscription, bool renew)
+{
+  if (renew && !*subscription->sid) return false;
+  if (!ethClient.connect(subscription->ip, UPNP_PORT)) return false;
+  char buffer[GENA_HEADER_LINE_SIZE];
+  writeRequestStart(p_GenaSubscribe, subscription->ip, subscription->upnpMessageType, buffer, sizeof(buffer));
+  if (renew)
+  {
+    client_write_P(ethClient, p_GenaHeaderSid);
+    ethClient.print(subscription->sid);
+    ethClient.print("\n");
+  }
+  else
+  {
+    sprintf_P(buffer, p_GenaHeaderCallback, localIP[0], localIP[1], localIP[2], localIP[3], port);
+    ethClient.print(buffer);
+    client_write_P(ethClient, p_GenaHeaderNT);
+  }
+  sprintf_P(buffer, p_GenaHeaderTimeout, (unsigned long)GENA_TIMEOUT_S);
+  ethClient.print(buffer);
+  ethClient.print("\n");
+
+  // Status line, then SID and TIMEOUT headers
+  uint32_t timeout = GENA_TIMEOUT_S;
+  bool success = false;
+  int16_t length = readHeaderLine(ethClient, buffer, sizeof(buffer));
+  const char *status = strchr(buffer, ' ');
+  if (length > 0 && status && atoi(status + 1) == 200)
+  {
+    success = true;
+    while ((length = readHeaderLine(ethClient, buffer, sizeof(buffer))) > 0)
+    {
+      if (isHeader(buffer, p_GenaHeaderSidName))
+      {
+        const char *sid = buffer + sizeof(GENA_HEADER_SID_NAME) - 1;
+        while (*sid == ' ') sid++;
+        strlcpy(subscription->sid, sid, sizeof(subscription->sid));
+      }
+      else if (isHeader(buffer, p_GenaHeaderTimeoutName))
+      {
+        const char *seconds = strchr(buffer, '-');
+        if (seconds && atol(seconds + 1) > GENA_RENEW_MARGIN_S * 2) timeout = atol(seconds + 1);
+      }
+    }
+  }
+  while (ethClient.available()) ethClient.read();
+  ethClient.stop();
+  if (!success)
+  {
+    // The speaker no longer knows the SID, a new subscription is needed
+    *subscription->sid = '\0';
+    return false;
+  }
+  subscription->renewAt = millis() + (timeout - GENA_RENEW_MARGIN_S) * 1000UL;
+  return true;
+}
+
+void SonosEvents::sendUnsubscribe(Subscription *subscription)
+{
+  if (*subscription->sid && ethClient.connect(subscription->ip, UPNP_PORT))
+  {
+    char buffer[GENA_HEADER_LINE_SIZE];
+    writeRequestStart(p_GenaUnsubscribe, subscription->ip, subscription->upnpMessageType, buffer, sizeof(buffer));
+    client_write_P(ethClient, p_GenaHeaderSid);
+    ethClient.print(subscription->sid);
+    ethClient.print("\n\n");
+    readHeaderLine(ethClient, buffer, sizeof(buffer));
+    while (ethClient.available()) ethClient.read();
+    ethClient.stop();
+  }
+  subscription->upnpMessageType = 0;
+  *subscription->sid = '\0';
+}
+
+void SonosEvents::writeRequestStart(PGM_P method_P, IPAddress speakerIP, uint8_t upnpMessageType, char *buffer, size_t bufferSize)
+{
+  client_write_P(ethClient, method_P);
+  client_write_P(
+    ethClient,
+    upnpMessageType == UPNP_RENDERING_CONTROL ? p_UpnpRenderingControlEventEndpoint :
+    upnpMessageType == UPNP_ZONE_GROUP_TOPOLOGY ? p_UpnpZoneGroupTopologyEventEndpoint : p_UpnpAvTransportEventEndpoint);
+  client_write_P(ethClient, p_GenaHttpVersion);
+  snprintf_P(buffer, bufferSize, p_GenaHeaderHost, speakerIP[0], speakerIP[1], speakerIP[2], speakerIP[3], UPNP_PORT);
+  ethClient.print(buffer);
+}
+
+void SonosEvents::handleNotify(SonosClient client)
+{
+  char line[GENA_HEADER_LINE_SIZE];
+  int16_t length;
+  int32_t contentLength = -1;
+  Subscription *subscription = 0;
+  while ((length = readHeaderLine(client, line, sizeof(line))) > 0)
+  {
+    if (isHeader(line, p_GenaHeaderSidName))
+    {
+      const char *sid = line + sizeof(GENA_HEADER_SID_NAME) - 1;
+      while (*sid == ' ') sid++;
+      for (uint8_t i = 0; i < SONOS_EVENT_SUBSCRIPTIONS; i++)
+      {
+        if (subscriptions[i].upnpMessageType && !strcmp(subscriptions[i].sid, sid)) subscription = &subscriptions[i];
+      }
+    }
+    else if (isHeader(line, p_GenaHeaderContentLengthName))
+    {
+      contentLength = atol(line + sizeof(GENA_HEADER_CONTENT_LENGTH_NAME) - 1);
+    }
+  }
+  if (length == 0 && subscription)
+  {
+    // Stream the property set through the parser, LastChange is never buffered
+    eventIP = subscription->ip;
+    bool topology = subscription->upnpMessageType == UPNP_ZONE_GROUP_TOPOLOGY;
+    parseEventReset();
+    uint32_t start = millis();
+    while (contentLength && (client.available() || (client.connected() && (uint32_t)(millis() - start) < UPNP_RESPONSE_TIMEOUT_MS)))
+    {
+      if (!client.available())
+      {
+        yield();
+        continue;
+      }
+      if (contentLength > 0) contentLength--;
+      if (topology) client.read();
+      else parseEventChar(client.read());
+    }
+    if (topology && topologyCallback) topologyCallback(eventIP);
+    else if (!topology) parseEventEnd();
+  }
+  client_write_P(client, p_GenaNotifyResponse);
+  client.stop();
+}
+
+int16_t SonosEvents::readHeaderLine(SonosClient &client, char *buffer, size_t bufferSize)
+{
+  // Returns the line length, 0 for the empty line ending the header or -1 on
+  // timeout; lines longer than the buffer are truncated
+  int16_t length = 0;
+  uint32_t start = millis();
+  *buffer = '\0';
+  while (true)
+  {
+    if (!client.available())
+    {
+      if (!client.connected() || (uint32_t)(millis() - start) > UPNP_RESPONSE_TIMEOUT_MS) return -1;
+      yield();
+      continue;
+    }
+    char character = client.read();
+    if (character == '\r') continue;
+    if (character == '\n') return length;
+    if ((size_t)length < bufferSize - 1)
+    {
+      buffer[length++] = character;
+      buffer[length] = '\0';
+    }
+  }
+}
+
+bool SonosEvents::isHeader(const char *line, PGM_P name_P)
+{
+  return !strncasecmp_P(line, name_P, strlen_P(name_P));
+}
+
+void SonosEvents::parseEventReset()
+{
+  parseState = EVENT_PARSE_TEXT;
+  entityLength = 0;
+  hasTrack = false;
+  trackNumber = 0;
+  trackDuration = 0;
+  *trackURI = '\0';
+}
+
+void SonosEvents::parseEventChar(char character)
+{
+  // Decodes entities on the fly, so the escaped LastChange document is parsed
+  // as plain XML in the same pass as the property set around it
+  if (!entityLength)
+  {
+    if (character == '&') entityLength = 1;
+    else parseEventDecoded(character);
+    return;
+  }
+  if (character != ';')
+  {
+    if (entityLength < sizeof(entity))
+    {
+      entity[entityLength++ - 1] = character;
+      return;
+    }
+    // Not an entity after all, pass it on as is
+    parseEventDecoded('&');
+    for (uint8_t i = 0; i < entityLength - 1; i++) parseEventDecoded(entity[i]);
+    entityLength = 0;
+    parseEventChar(character);
+    return;
+  }
+  entity[entityLength - 1] = '\0';
+  entityLength = 0;
+  if (!strcmp(entity, "lt")) parseEventDecoded('<');
+  else if (!strcmp(entity, "gt")) parseEventDecoded('>');
+  else if (!strcmp(entity, "amp")) parseEventDecoded('&');
+  else if (!strcmp(entity, "quot")) parseEventDecoded('"');
+  else if (!strcmp(entity, "apos")) parseEventDecoded('\'');
+}
+
+void SonosEvents::parseEventDecoded(char character)
+{
+  switch (parseState)
+  {
+    case EVENT_PARSE_TEXT:
+      if (character == '<')
+      {
+        parseState = EVENT_PARSE_NAME;
+        nameLength = 0;
+        attributeLength = 0;
+        *value = '\0';
+        *channel = '\0';
+      }
+      return;
+    case EVENT_PARSE_NAME:
+      if (character != ' ' && character != '/' && character != '>' && character != '\n' && character != '\t')
+      {
+        if (nameLength < sizeof(name) - 1) name[nameLength++] = character;
+        return;
+      }
+      name[nameLength] = '\0';
+      parseState = EVENT_PARSE_TAG;
+      // The character ending the name may also end the tag
+      // fall through
+    case EVENT_PARSE_TAG:
+      if (character == '>')
+      {
+        parseEventTag();
+        parseState = EVENT_PARSE_TEXT;
+      }
+      else if (character == '"' || character == '\'')
+      {
+        attribute[attributeLength] = '\0';
+        valueTarget = EVENT_VALUE_NONE;
+        if (!strcmp_P(attribute, p_EventAttributeVal)) valueTarget = EVENT_VALUE_VAL;
+        else if (!strcmp_P(attribute, p_EventAttributeChannel)) valueTarget = EVENT_VALUE_CHANNEL;
+        quote = character;
+        valueLength = 0;
+        parseState = EVENT_PARSE_VALUE;
+      }
+      else if (character == ' ' || character == '/' || character == '\n' || character == '\t')
+      {
+        attributeLength = 0;
+      }
+      else if (character != '=' && attributeLength < sizeof(attribute) - 1)
+      {
+        attribute[attributeLength++] = character;
+      }
+      return;
+    case EVENT_PARSE_VALUE:
+      if (character == quote)
+      {
+        attributeLength = 0;
+        parseState = EVENT_PARSE_TAG;
+      }
+      else if (valueTarget == EVENT_VALUE_VAL && valueLength < sizeof(value) - 1)
+      {
+        value[valueLength++] = character;
+        value[valueLength] = '\0';
+      }
+      else if (valueTarget == EVENT_VALUE_CHANNEL && valueLength < sizeof(channel) - 1)
+      {
+        channel[valueLength++] = character;
+        channel[valueLength] = '\0';
+      }
+      return;
+  }
+}
+
+void SonosEvents::parseEventTag()
+{
+  bool master = !*channel || !strcmp(channel, SONOS_CHANNEL_MASTER);
+  if (!strcmp_P(name, p_EventTransportState))
+  {
+    if (!transportStateCallback) return;
+    uint8_t state = SONOS_STATE_STOPPED;
+    if (!strcmp(value, SONOS_STATE_PLAYING_VALUE)) state = SONOS_STATE_PLAYING;
+    else if (!strcmp(value, SONOS_STATE_PAUSED_VALUE)) state = SONOS_STATE_PAUSED;
+    transportStateCallback(eventIP, state);
+  }
+  else if (!strcmp_P(name, p_EventCurrentTrack))
+  {
+    trackNumber = atoi(value);
+    hasTrack = true;
+  }
+  else if (!strcmp_P(name, p_EventCurrentTrackDuration))
+  {
+    trackDuration = eventTimeInSeconds(value);
+    hasTrack = true;
+  }
+  else if (!strcmp_P(name, p_EventCurrentTrackURI))
+  {
+    eventUnescape(value);
+    strlcpy(trackURI, value, sizeof(trackURI));
+    hasTrack = true;
+  }
+  else if (!strcmp_P(name, p_EventVolume) && master)
+  {
+    if (volumeCallback) volumeCallback(eventIP, constrain(atoi(value), 0, 100));
+  }
+  else if (!strcmp_P(name, p_EventMute) && master)
+  {
+    if (muteCallback) muteCallback(eventIP, !strcmp(value, "1"));
+  }
+}
+
+void SonosEvents::parseEventEnd()
+{
+  if (hasTrack && trackCallback) trackCallback(eventIP, trackNumber, trackDuration, trackURI);
+}
+
+void SonosEvents::client_write_P(SonosClient &client, PGM_P data_P)
+{
+  char buffer[32];
+  uint16_t dataLen = strlen_P(data_P);
+  uint16_t dataPos = 0;
+  while (dataLen > dataPos)
+  {
+    strlcpy_P(buffer, data_P + dataPos, sizeof(buffer));
+    client.print(buffer);
+    dataPos += sizeof(buffer) - 1;
+  }
+}
@@ -0,0 +1,171 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#ifndef SonosEvents_h
+#define SonosEvents_h
+
+#include "SonosUPnP.h"
+
+// GENA requests:
+/*
+SUBSCRIBE /MediaRenderer/AVTransport/Event HTTP/1.1
+HOST: 192.168.0.201:1400
+CALLBACK: <http://192.168.0.123:3400/>
+NT: upnp:event
+TIMEOUT: Second-3600
+
+HTTP/1.1 200 OK
+SID: uuid:RINCON_000E58A0B2C601400_sub0000000123
+TIMEOUT: Second-3600
+*/
+#define GENA_SUBSCRIBE "SUBSCRIBE "
+#define GENA_UNSUBSCRIBE "UNSUBSCRIBE "
+#define GENA_HEADER_HOST "HOST: %d.%d.%d.%d:%d\n"
+#define GENA_HEADER_CALLBACK "CALLBACK: <http://%d.%d.%d.%d:%u/>\n"
+#define GENA_HEADER_NT "NT: upnp:event\n"
+#define GENA_HEADER_SID "SID: "
+#define GENA_HEADER_TIMEOUT "TIMEOUT: Second-%lu\n"
+#define GENA_HEADER_SID_NAME "sid:"
+#define GENA_HEADER_TIMEOUT_NAME "timeout:"
+#define GENA_HEADER_CONTENT_LENGTH_NAME "content-length:"
+#define GENA_NOTIFY_RESPONSE "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define GENA_SID_SIZE 48
+#define GENA_HEADER_LINE_SIZE 64
+#define GENA_TIMEOUT_S 3600
+#define GENA_RENEW_MARGIN_S 60
+#define GENA_DEFAULT_PORT 3400
+#define UPNP_AV_TRANSPORT_EVENT_ENDPOINT "/MediaRenderer/AVTransport/Event"
+#define UPNP_RENDERING_CONTROL_EVENT_ENDPOINT "/MediaRenderer/RenderingControl/Event"
+#define UPNP_ZONE_GROUP_TOPOLOGY_EVENT_ENDPOINT "/ZoneGroupTopology/Event"
+
+// LastChange event data, entity escaped inside the NOTIFY property set:
+/*
+<e:propertyset xmlns:e="urn:schemas-upnp-org:event-1-0">
+  <e:property>
+    <LastChange>
+      <Event xmlns="urn:schemas-upnp-org:metadata-1-0/AVT/">
+        <InstanceID val="0">
+          <TransportState val="PLAYING"/>
+          <CurrentTrack val="3"/>
+          <CurrentTrackURI val="x-file-cifs://server/music/track.mp3"/>
+          <CurrentTrackDuration val="0:03:21"/>
+        </InstanceID>
+      </Event>
+    </LastChange>
+  </e:property>
+</e:propertyset>
+<Volume channel="Master" val="25"/>
+<Mute channel="Master" val="0"/>
+*/
+#define SONOS_EVENT_TRANSPORT_STATE "TransportState"
+#define SONOS_EVENT_CURRENT_TRACK "CurrentTrack"
+#define SONOS_EVENT_CURRENT_TRACK_DURATION "CurrentTrackDuration"
+#define SONOS_EVENT_CURRENT_TRACK_URI "CurrentTrackURI"
+#define SONOS_EVENT_VOLUME "Volume"
+#define SONOS_EVENT_MUTE "Mute"
+#define SONOS_EVENT_ATTRIBUTE_VAL "val"
+#define SONOS_EVENT_ATTRIBUTE_CHANNEL "channel"
+#define SONOS_EVENT_NAME_SIZE 24
+#define SONOS_EVENT_ATTRIBUTE_SIZE 8
+#ifndef SONOS_EVENT_VALUE_SIZE
+#define SONOS_EVENT_VALUE_SIZE 64
+#endif
+#ifndef SONOS_EVENT_SUBSCRIPTIONS
+  #if (defined(__AVR__))
+    #define SONOS_EVENT_SUBSCRIPTIONS 4
+  #else
+    #define SONOS_EVENT_SUBSCRIPTIONS 16
+  #endif
+#endif
+
+class SonosEvents
+{
+
+  public:
+
+    SonosEvents(SonosClient client, uint16_t port);
+
+    void begin(IPAddress localIP);
+    bool subscribe(IPAddress speakerIP, uint8_t upnpMessageType);
+    bool unsubscribe(IPAddress speakerIP, uint8_t upnpMessageType);
+    void unsubscribeAll();
+    void poll();
+    void setTransportStateCallback(void (*callback)(IPAddress speakerIP, uint8_t state));
+    void setVolumeCallback(void (*callback)(IPAddress speakerIP, uint8_t volume));
+    void setMuteCallback(void (*callback)(IPAddress speakerIP, bool state));
+    void setTrackCallback(void (*callback)(IPAddress speakerIP, uint16_t number, uint32_t duration, const char *uri));
+    void setTopologyCallback(void (*callback)(IPAddress speakerIP));
+
+  private:
+
+    struct Subscription
+    {
+      IPAddress ip;
+      uint8_t upnpMessageType;
+      uint32_t renewAt;
+      char sid[GENA_SID_SIZE];
+    };
+
+    SonosClient ethClient;
+    SonosServer server;
+    IPAddress localIP;
+    uint16_t port;
+    Subscription subscriptions[SONOS_EVENT_SUBSCRIPTIONS];
+
+    void (*transportStateCallback)(IPAddress speakerIP, uint8_t state);
+    void (*volumeCallback)(IPAddress speakerIP, uint8_t volume);
+    void (*muteCallback)(IPAddress speakerIP, bool state);
+    void (*trackCallback)(IPAddress speakerIP, uint16_t number, uint32_t duration, const char *uri);
+    void (*topologyCallback)(IPAddress speakerIP);
+
+    // LastChange parser state
+    IPAddress eventIP;
+    uint8_t parseState;
+    uint8_t valueTarget;
+    uint8_t entityLength;
+    uint8_t nameLength;
+    uint8_t attributeLength;
+    uint8_t valueLength;
+    char quote;
+    char entity[6];
+    char name[SONOS_EVENT_NAME_SIZE];
+    char attribute[SONOS_EVENT_ATTRIBUTE_SIZE];
+    char channel[SONOS_EVENT_ATTRIBUTE_SIZE];
+    char value[SONOS_EVENT_VALUE_SIZE];
+    bool hasTrack;
+    uint16_t trackNumber;
+    uint32_t trackDuration;
+    char trackURI[SONOS_EVENT_VALUE_SIZE];
+
+    Subscription *findSubscription(IPAddress speakerIP, uint8_t upnpMessageType);
+    bool sendSubscribe(Subscription *subscription, bool renew);
+    void sendUnsubscribe(Subscription *subscription);
+    void writeRequestStart(PGM_P method_P, IPAddress speakerIP, uint8_t upnpMessageType, char *buffer, size_t bufferSize);
+    void handleNotify(SonosClient client);
+    int16_t readHeaderLine(SonosClient &client, char *buffer, size_t bufferSize);
+    bool isHeader(const char *line, PGM_P name_P);
+    void parseEventReset();
+    void parseEventChar(char character);
+    void parseEventDecoded(char character);
+    void parseEventTag();
+    void parseEventEnd();
+    void client_write_P(SonosClient &client, PGM_P data_P);
+};
+
+#endif
@@ -0,0 +1,247 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#include "SonosFade.h"
+
+#ifndef SONOS_WRITE_ONLY_MODE
+
+SonosFade::SonosFade(SonosUPnP *sonos)
+{
+  this->sonos = sonos;
+  this->stepInterval = SONOS_FADE_STEP_MS;
+  this->fadeCallback = 0;
+  for (uint8_t i = 0; i < SONOS_FADE_SPEAKERS; i++)
+  {
+    fades[i].ip = IPAddress(0, 0, 0, 0);
+    fades[i].active = false;
+    fades[i].handle = -1;
+    fades[i].latency = 0;
+  }
+}
+
+bool SonosFade::fadeVolume(IPAddress speakerIP, uint8_t volume, uint32_t duration, uint8_t curve)
+{
+  // Starts on the next update, from the volume the speaker has by then; a
+  // speaker that is already fading continues from where it got to. Returns
+  // false when all speakers that can fade at the same time are fading
+  Fade *fade = findFade(speakerIP);
+  if (!fade)
+  {
+    for (uint8_t i = 0; i < SONOS_FADE_SPEAKERS && !fade; i++)
+    {
+      if (!fades[i].active && fades[i].handle < 0) fade = &fades[i];
+    }
+    if (!fade) return false;
+    fade->ip = speakerIP;
+    fade->latency = 0;
+  }
+  // The volume may have been changed by others since the last fade
+  if (!fade->active && fade->handle < 0) fade->volume = -1;
+  fade->active = true;
+  fade->started = false;
+  fade->curve = curve;
+  fade->target = volume > 100 ? 100 : volume;
+  fade->duration = duration;
+  fade->failures = 0;
+  fade->waitFrom = millis();
+  fade->wait = 0;
+  return true;
+}
+
+bool SonosFade::cancel(IPAddress speakerIP)
+{
+  // Leaves the volume where it is; a step in flight is still collected
+  Fade *fade = findFade(speakerIP);
+  if (!fade || !fade->active) return false;
+  fade->active = false;
+  return true;
+}
+
+void SonosFade::setStepInterval(uint16_t stepInterval)
+{
+  this->stepInterval = stepInterval;
+}
+
+void SonosFade::setFadeCallback(void (*callback)(IPAddress speakerIP, bool success, uint8_t volume))
+{
+  this->fadeCallback = callback;
+}
+
+bool SonosFade::update()
+{
+  // Collects finished steps and sends the next ones that are due, each speaker
+  // on its own connection of the pool; returns true while any speaker fades
+  sonos->poll();
+  uint32_t now = millis();
+  bool fading = false;
+  for (uint8_t i = 0; i < SONOS_FADE_SPEAKERS; i++)
+  {
+    Fade *fade = &fades[i];
+    if (fade->handle >= 0) collect(fade, now);
+    if (fade->active && fade->handle < 0 && (uint32_t)(now - fade->waitFrom) >= fade->wait) step(fade, now);
+    fading |= fade->active;
+  }
+  sonos->poll();
+  return fading;
+}
+
+bool SonosFade::isFading(IPAddress speakerIP)
+{
+  Fade *fade = findFade(speakerIP);
+  return fade && fade->active;
+}
+
+uint16_t SonosFade::getLatency(IPAddress speakerIP)
+{
+  // Average round trip of the steps sent to the speaker, 0 when none was
+  Fade *fade = findFade(speakerIP);
+  return fade ? fade->latency : 0;
+}
+
+SonosFade::Fade *SonosFade::findFade(IPAddress speakerIP)
+{
+  // A finished fade keeps its speaker until the slot is taken by another one
+  for (uint8_t i = 0; i < SONOS_FADE_SPEAKERS; i++)
+  {
+    if (fades[i].ip == speakerIP) return &fades[i];
+  }
+  return 0;
+}
+
+void SonosFade::collect(Fade *fade, uint32_t now)
+{
+  // The round trip is averaged and sets how soon the next step may be sent
+  uint8_t status = sonos->getAsyncStatus(fade->handle);
+  if (status == SONOS_ASYNC_PENDING) return;
+  int32_t value = sonos->endAsync(fade->handle);
+  fade->handle = -1;
+  uint32_t latency = min((uint32_t)(now - fade->sentAt), (uint32_t)0xFFFF);
+  fade->latency = fade->latency ? ((uint32_t)fade->latency * 3 + latency) / 4 : latency;
+  fade->waitFrom = fade->sentAt;
+  fade->wait = getInterval(fade);
+  if (!fade->active) return;
+  if (status != SONOS_ASYNC_DONE)
+  {
+    // The volume is read again before the next step
+    fade->volume = -1;
+    if (++fade->failures >= SONOS_FADE_MAX_FAILURES) finish(fade, false);
+    return;
+  }
+  fade->failures = 0;
+  if (fade->request == SONOS_ASYNC_RAMP_TO_VOLUME)
+  {
+    // Done when the speaker says the ramp ends, unless a stepped fade replaced it
+    if (fade->curve < SONOS_FADE_RAMP_SLEEP_TIMER) return;
+    fade->started = true;
+    fade->waitFrom = now;
+    fade->wait = (uint32_t)value * 1000;
+    return;
+  }
+  fade->volume = value;
+  // The last step may not land on the target, e.g. when a volume limit is set
+  if (fade->request == SONOS_ASYNC_SET_RELATIVE_VOLUME && fade->started &&
+      (uint32_t)(fade->sentAt - fade->startedAt) >= fade->duration)
+  {
+    finish(fade, true);
+  }
+}
+
+void SonosFade::step(Fade *fade, uint32_t now)
+{
+  // Sends the change needed to get to the curve, nothing while the curve is
+  // still within the same volume step
+  if (fade->curve >= SONOS_FADE_RAMP_SLEEP_TIMER)
+  {
+    if (fade->started)
+    {
+      fade->volume = fade->target;
+      finish(fade, true);
+      return;
+    }
+    begin(fade, SONOS_ASYNC_RAMP_TO_VOLUME,
+      sonos->beginRampToVolume(fade->ip, fade->target, fade->curve - SONOS_FADE_RAMP_SLEEP_TIMER), now);
+    return;
+  }
+  if (fade->volume < 0)
+  {
+    begin(fade, SONOS_ASYNC_GET_VOLUME, sonos->beginGetVolume(fade->ip), now);
+    return;
+  }
+  if (!fade->started)
+  {
+    fade->from = fade->volume;
+    fade->startedAt = now;
+    fade->started = true;
+  }
+  uint8_t volume = volumeAt(fade, now);
+  if (volume != fade->volume)
+  {
+    begin(fade, SONOS_ASYNC_SET_RELATIVE_VOLUME,
+      sonos->beginSetRelativeVolume(fade->ip, (int16_t)volume - fade->volume), now);
+    return;
+  }
+  if (fade->from == fade->target || (uint32_t)(now - fade->startedAt) >= fade->duration)
+  {
+    finish(fade, true);
+    return;
+  }
+  fade->waitFrom = now;
+  fade->wait = getInterval(fade);
+}
+
+void SonosFade::begin(Fade *fade, uint8_t request, int8_t handle, uint32_t now)
+{
+  // Without a free connection the step is tried again on the next update; the
+  // result is collected by collect(), not by the async callback
+  if (handle < 0) return;
+  sonos->connections[handle].owned = true;
+  fade->handle = handle;
+  fade->request = request;
+  fade->sentAt = now;
+}
+
+void SonosFade::finish(Fade *fade, bool success)
+{
+  fade->active = false;
+  if (fadeCallback) fadeCallback(fade->ip, success, fade->volume < 0 ? 0 : fade->volume);
+}
+
+uint8_t SonosFade::volumeAt(Fade *fade, uint32_t now)
+{
+  // Progress through the fade in 256ths, shaped by the curve; the volume
+  // moves from the start towards the target and reaches it at the end
+  uint32_t elapsed = now - fade->startedAt;
+  if (elapsed >= fade->duration) return fade->target;
+  uint32_t progress = fade->duration > 0xFFFFFF ? elapsed / (fade->duration >> 8) : (elapsed << 8) / fade->duration;
+  if (progress > 255) progress = 255;
+  switch (fade->curve)
+  {
+    case SONOS_FADE_EASE_IN: progress = progress * progress >> 8; break;
+    case SONOS_FADE_EASE_OUT: progress = 256 - ((256 - progress) * (256 - progress) >> 8); break;
+  }
+  return fade->from + ((int16_t)fade->target - fade->from) * (int16_t)progress / 256;
+}
+
+uint32_t SonosFade::getInterval(Fade *fade)
+{
+  uint32_t interval = (uint32_t)fade->latency * SONOS_FADE_LATENCY_FACTOR;
+  return interval > stepInterval ? interval : stepInterval;
+}
+
+#endif
@@ -0,0 +1,105 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#ifndef SonosFade_h
+#define SonosFade_h
+
+#include "SonosUPnP.h"
+
+#ifndef SONOS_WRITE_ONLY_MODE
+
+// Fade defaults, times in milliseconds; steps are sent no more often than
+// every SONOS_FADE_STEP_MS, and at least SONOS_FADE_LATENCY_FACTOR average
+// round trips apart, so a slow speaker gets fewer and larger steps
+#define SONOS_FADE_STEP_MS 50
+#define SONOS_FADE_LATENCY_FACTOR 2
+// Failed requests in a row that end a fade
+#define SONOS_FADE_MAX_FAILURES 3
+// Curves, stepped with SetRelativeVolume over the given duration
+#define SONOS_FADE_LINEAR 0
+#define SONOS_FADE_EASE_IN 1
+#define SONOS_FADE_EASE_OUT 2
+// Curves run by the speaker itself with RampToVolume, which sets the duration
+#define SONOS_FADE_RAMP_SLEEP_TIMER 3
+#define SONOS_FADE_RAMP_ALARM 4
+#define SONOS_FADE_RAMP_AUTOPLAY 5
+#ifndef SONOS_FADE_SPEAKERS
+  #if (defined(__AVR__))
+    #define SONOS_FADE_SPEAKERS 2
+  #else
+    #define SONOS_FADE_SPEAKERS 8
+  #endif
+#endif
+
+class SonosFade
+{
+
+  public:
+
+    SonosFade(SonosUPnP *sonos);
+
+    bool fadeVolume(IPAddress speakerIP, uint8_t volume, uint32_t duration, uint8_t curve);
+    bool cancel(IPAddress speakerIP);
+    void setStepInterval(uint16_t stepInterval);
+    void setFadeCallback(void (*callback)(IPAddress speakerIP, bool success, uint8_t volume));
+    bool update();
+    bool isFading(IPAddress speakerIP);
+    uint16_t getLatency(IPAddress speakerIP);
+
+  private:
+
+    struct Fade
+    {
+      IPAddress ip;
+      bool active;
+      bool started;
+      uint8_t curve;
+      uint8_t from;
+      uint8_t target;
+      // Last volume the speaker reported, -1 when it has to be read
+      int8_t volume;
+      // Async handle and request in flight, one at a time per speaker
+      int8_t handle;
+      uint8_t request;
+      uint8_t failures;
+      uint16_t latency;
+      uint32_t duration;
+      uint32_t startedAt;
+      uint32_t sentAt;
+      uint32_t waitFrom;
+      uint32_t wait;
+    };
+
+    SonosUPnP *sonos;
+    uint16_t stepInterval;
+    Fade fades[SONOS_FADE_SPEAKERS];
+    void (*fadeCallback)(IPAddress speakerIP, bool success, uint8_t volume);
+
+    Fade *findFade(IPAddress speakerIP);
+    void collect(Fade *fade, uint32_t now);
+    void step(Fade *fade, uint32_t now);
+    void begin(Fade *fade, uint8_t request, int8_t handle, uint32_t now);
+    void finish(Fade *fade, bool success);
+    uint8_t volumeAt(Fade *fade, uint32_t now);
+    uint32_t getInterval(Fade *fade);
+};
+
+#endif
+
+#endif
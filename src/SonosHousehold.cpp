@@ -0,0 +1,487 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#include "SonosHousehold.h"
+
+#ifndef SONOS_WRITE_ONLY_MODE
+
+// Flight slot values for connections not serving a household speaker
+#define SONOS_HOUSEHOLD_FLIGHT_FREE -1
+#define SONOS_HOUSEHOLD_FLIGHT_REMOVED -2
+
+SonosHousehold::SonosHousehold(SonosUPnP *sonos)
+{
+  this->sonos = sonos;
+  this->freshness[fieldIndex(SONOS_HOUSEHOLD_STATE)] = SONOS_HOUSEHOLD_STATE_MS;
+  this->freshness[fieldIndex(SONOS_HOUSEHOLD_VOLUME)] = SONOS_HOUSEHOLD_VOLUME_MS;
+  this->freshness[fieldIndex(SONOS_HOUSEHOLD_MUTE)] = SONOS_HOUSEHOLD_VOLUME_MS;
+  this->freshness[fieldIndex(SONOS_HOUSEHOLD_POSITION)] = SONOS_HOUSEHOLD_POSITION_MS;
+  this->freshness[fieldIndex(SONOS_HOUSEHOLD_BASS)] = SONOS_HOUSEHOLD_EQ_MS;
+  this->freshness[fieldIndex(SONOS_HOUSEHOLD_TREBLE)] = SONOS_HOUSEHOLD_EQ_MS;
+  this->freshness[fieldIndex(SONOS_HOUSEHOLD_LOUDNESS)] = SONOS_HOUSEHOLD_EQ_MS;
+  this->refreshFields = SONOS_HOUSEHOLD_DEFAULT_FIELDS;
+  this->inFlightLimit = SONOS_HOUSEHOLD_IN_FLIGHT;
+  this->count = 0;
+  this->cursor = 0;
+  this->changed = false;
+  this->statusCallback = 0;
+  for (uint8_t i = 0; i < UPNP_MAX_CONNECTIONS; i++)
+  {
+    flights[i].slot = SONOS_HOUSEHOLD_FLIGHT_FREE;
+  }
+}
+
+int8_t SonosHousehold::addSpeaker(IPAddress speakerIP)
+{
+  // Returns the index of the speaker, or -1 when the table is full; its
+  // status is read on the next update
+  int8_t index = findSlot(speakerIP);
+  if (index >= 0) return index;
+  if (count >= SONOS_HOUSEHOLD_SPEAKERS) return -1;
+  Slot *slot = &slots[count];
+  slot->speaker.ip = speakerIP;
+  slot->speaker.state = 0;
+  slot->speaker.volume = 0;
+  slot->speaker.mute = false;
+  slot->speaker.position = 0;
+  slot->speaker.bass = 0;
+  slot->speaker.treble = 0;
+  slot->speaker.loudness = false;
+  slot->speaker.valid = 0;
+  slot->speaker.failures = 0;
+  slot->speaker.refreshedAt = 0;
+  for (uint8_t i = 0; i < SONOS_HOUSEHOLD_FIELDS; i++)
+  {
+    slot->readAt[i] = millis();
+    slot->backoff[i] = 0;
+  }
+  slot->pendingFields = refreshFields;
+  slot->requestedFields = 0;
+  slot->inFlight = 0;
+  slot->commandCount = 0;
+  return count++;
+}
+
+bool SonosHousehold::removeSpeaker(IPAddress speakerIP)
+{
+  // The last speaker takes the slot, requests still in flight for the removed
+  // one are collected and dropped
+  int8_t index = findSlot(speakerIP);
+  if (index < 0) return false;
+  count--;
+  for (uint8_t i = 0; i < UPNP_MAX_CONNECTIONS; i++)
+  {
+    if (flights[i].slot == index) flights[i].slot = SONOS_HOUSEHOLD_FLIGHT_REMOVED;
+    else if (flights[i].slot == count) flights[i].slot = index;
+  }
+  slots[index] = slots[count];
+  if (cursor >= count) cursor = 0;
+  return true;
+}
+
+void SonosHousehold::setRefreshInterval(uint32_t refreshInterval)
+{
+  // Same freshness for all fields, 0 turns periodic refreshes off when
+  // refresh() is called from e.g. an event callback instead
+  for (uint8_t i = 0; i < SONOS_HOUSEHOLD_FIELDS; i++)
+  {
+    freshness[i] = refreshInterval;
+  }
+}
+
+void SonosHousehold::setRefreshFields(uint8_t refreshFields)
+{
+  this->refreshFields = refreshFields & SONOS_HOUSEHOLD_ALL;
+}
+
+void SonosHousehold::setFreshness(uint8_t fields, uint32_t freshness)
+{
+  // Adds the fields to those refreshed, to be read again when older than
+  // freshness; 0 reads them on refresh() only
+  fields &= SONOS_HOUSEHOLD_ALL;
+  for (uint8_t i = 0; i < SONOS_HOUSEHOLD_FIELDS; i++)
+  {
+    if (fields & (1 << i)) this->freshness[i] = freshness;
+  }
+  refreshFields |= fields;
+}
+
+void SonosHousehold::setInFlightLimit(uint8_t inFlightLimit)
+{
+  this->inFlightLimit = inFlightLimit ? inFlightLimit : 1;
+}
+
+void SonosHousehold::setStatusCallback(void (*callback)(HouseholdSpeaker *speaker))
+{
+  this->statusCallback = callback;
+}
+
+bool SonosHousehold::update()
+{
+  // Collects finished requests and starts new ones on the free connections of
+  // the pool; returns true when the status of any speaker changed
+  changed = false;
+  sonos->poll();
+  collect();
+  if (schedule()) sonos->poll();
+  return changed;
+}
+
+void SonosHousehold::refresh()
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    slots[i].pendingFields |= refreshFields;
+    resetBackoff(&slots[i]);
+  }
+}
+
+void SonosHousehold::refresh(IPAddress speakerIP)
+{
+  // E.g. from an event callback, something changed so backed off fields are
+  // read at their freshness again
+  int8_t index = findSlot(speakerIP);
+  if (index < 0) return;
+  slots[index].pendingFields |= refreshFields;
+  resetBackoff(&slots[index]);
+}
+
+bool SonosHousehold::isIdle()
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (slots[i].pendingFields || slots[i].commandCount || slots[i].inFlight) return false;
+  }
+  return true;
+}
+
+uint8_t SonosHousehold::getCount()
+{
+  return count;
+}
+
+HouseholdSpeaker *SonosHousehold::getSpeaker(uint8_t index)
+{
+  if (index >= count) return 0;
+  return &slots[index].speaker;
+}
+
+HouseholdSpeaker *SonosHousehold::findSpeaker(IPAddress speakerIP)
+{
+  int8_t index = findSlot(speakerIP);
+  return index < 0 ? 0 : &slots[index].speaker;
+}
+
+bool SonosHousehold::play(IPAddress speakerIP)
+{
+  return queueCommand(speakerIP, SONOS_HOUSEHOLD_COMMAND_PLAY, 0);
+}
+
+bool SonosHousehold::pause(IPAddress speakerIP)
+{
+  return queueCommand(speakerIP, SONOS_HOUSEHOLD_COMMAND_PAUSE, 0);
+}
+
+bool SonosHousehold::stop(IPAddress speakerIP)
+{
+  return queueCommand(speakerIP, SONOS_HOUSEHOLD_COMMAND_STOP, 0);
+}
+
+bool SonosHousehold::setVolume(IPAddress speakerIP, uint8_t volume)
+{
+  return queueCommand(speakerIP, SONOS_HOUSEHOLD_COMMAND_VOLUME, volume);
+}
+
+bool SonosHousehold::setMute(IPAddress speakerIP, bool state)
+{
+  return queueCommand(speakerIP, SONOS_HOUSEHOLD_COMMAND_MUTE, state);
+}
+
+int8_t SonosHousehold::findSlot(IPAddress speakerIP)
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (slots[i].speaker.ip == speakerIP) return i;
+  }
+  return -1;
+}
+
+bool SonosHousehold::queueCommand(IPAddress speakerIP, uint8_t type, uint8_t value)
+{
+  // A queued command of the same kind is replaced, so turning a knob or
+  // toggling play and pause does not fill the queue; transport commands are
+  // one kind
+  int8_t index = findSlot(speakerIP);
+  if (index < 0) return false;
+  Slot *slot = &slots[index];
+  bool transport = type <= SONOS_HOUSEHOLD_COMMAND_STOP;
+  for (uint8_t i = 0; i < slot->commandCount; i++)
+  {
+    Command *command = &slot->commands[i];
+    if (command->type == type || (transport && command->type <= SONOS_HOUSEHOLD_COMMAND_STOP))
+    {
+      command->type = type;
+      command->value = value;
+      return true;
+    }
+  }
+  if (slot->commandCount >= SONOS_HOUSEHOLD_COMMANDS) return false;
+  slot->commands[slot->commandCount].type = type;
+  slot->commands[slot->commandCount].value = value;
+  slot->commandCount++;
+  return true;
+}
+
+void SonosHousehold::collect()
+{
+  // Handles are the connection indexes of the pool, so a finished flight is
+  // found by its handle without asking the speakers in turn
+  for (int8_t handle = 0; handle < UPNP_MAX_CONNECTIONS; handle++)
+  {
+    Flight *flight = &flights[handle];
+    if (flight->slot == SONOS_HOUSEHOLD_FLIGHT_FREE) continue;
+    uint8_t status = sonos->getAsyncStatus(handle);
+    if (status == SONOS_ASYNC_PENDING) continue;
+    int32_t value = sonos->endAsync(handle);
+    if (flight->slot != SONOS_HOUSEHOLD_FLIGHT_REMOVED) finish(flight, status == SONOS_ASYNC_DONE, value);
+    flight->slot = SONOS_HOUSEHOLD_FLIGHT_FREE;
+  }
+}
+
+void SonosHousehold::finish(Flight *flight, bool success, int32_t value)
+{
+  // Fields that failed are left until they are due again, commands that
+  // failed are dropped; both count as a failure of the speaker
+  Slot *slot = &slots[flight->slot];
+  slot->inFlight--;
+  if (flight->field)
+  {
+    slot->requestedFields &= ~flight->field;
+    slot->pendingFields &= ~flight->field;
+    if (success)
+    {
+      // A field read unchanged backs off, except the state while playing as
+      // the track may end; a state change is activity that resets them all
+      uint8_t index = fieldIndex(flight->field);
+      if (setStatus(slot, flight->field, value))
+      {
+        if (flight->field == SONOS_HOUSEHOLD_STATE) resetBackoff(slot);
+        else slot->backoff[index] = 0;
+      }
+      else if (slot->backoff[index] < SONOS_HOUSEHOLD_MAX_BACKOFF &&
+          (flight->field != SONOS_HOUSEHOLD_STATE || slot->speaker.state != SONOS_STATE_PLAYING))
+      {
+        slot->backoff[index]++;
+      }
+      slot->speaker.refreshedAt = millis();
+    }
+  }
+  else if (success)
+  {
+    switch (flight->command.type)
+    {
+      case SONOS_HOUSEHOLD_COMMAND_VOLUME: setStatus(slot, SONOS_HOUSEHOLD_VOLUME, flight->command.value); break;
+      case SONOS_HOUSEHOLD_COMMAND_MUTE: setStatus(slot, SONOS_HOUSEHOLD_MUTE, flight->command.value); break;
+      // The transport state is read back, the speaker may not have changed it
+      default: slot->pendingFields |= SONOS_HOUSEHOLD_STATE; break;
+    }
+    resetBackoff(slot);
+  }
+  if (success) slot->speaker.failures = 0;
+  else if (slot->speaker.failures < 0xFF) slot->speaker.failures++;
+}
+
+bool SonosHousehold::setStatus(Slot *slot, uint8_t field, int32_t value)
+{
+  // Returns true when the value differs from the last one read
+  HouseholdSpeaker *speaker = &slot->speaker;
+  bool fieldChanged = !(speaker->valid & field);
+  switch (field)
+  {
+    case SONOS_HOUSEHOLD_STATE:
+      fieldChanged |= speaker->state != value;
+      speaker->state = value;
+      break;
+    case SONOS_HOUSEHOLD_VOLUME:
+      fieldChanged |= speaker->volume != value;
+      speaker->volume = value;
+      break;
+    case SONOS_HOUSEHOLD_MUTE:
+      fieldChanged |= speaker->mute != (bool)value;
+      speaker->mute = value;
+      break;
+    case SONOS_HOUSEHOLD_POSITION:
+      fieldChanged |= speaker->position != (uint32_t)value;
+      speaker->position = value;
+      break;
+    case SONOS_HOUSEHOLD_BASS:
+      fieldChanged |= speaker->bass != value;
+      speaker->bass = value;
+      break;
+    case SONOS_HOUSEHOLD_TREBLE:
+      fieldChanged |= speaker->treble != value;
+      speaker->treble = value;
+      break;
+    case SONOS_HOUSEHOLD_LOUDNESS:
+      fieldChanged |= speaker->loudness != (bool)value;
+      speaker->loudness = value;
+      break;
+  }
+  speaker->valid |= field;
+  if (!fieldChanged) return false;
+  changed = true;
+  if (statusCallback) statusCallback(speaker);
+  return true;
+}
+
+void SonosHousehold::markDue(Slot *slot, uint32_t now)
+{
+  // A field is due when older than its freshness, doubled for every time it
+  // was read unchanged in a row
+  for (uint8_t i = 0; i < SONOS_HOUSEHOLD_FIELDS; i++)
+  {
+    uint8_t field = 1 << i;
+    if (!(refreshFields & field) || (slot->pendingFields & field) || !freshness[i]) continue;
+    // The position only moves while playing
+    if (field == SONOS_HOUSEHOLD_POSITION && (slot->speaker.valid & SONOS_HOUSEHOLD_STATE) &&
+        slot->speaker.state != SONOS_STATE_PLAYING) continue;
+    uint32_t interval = freshness[i] > (0xFFFFFFFFUL >> slot->backoff[i]) ? 0xFFFFFFFFUL : freshness[i] << slot->backoff[i];
+    if ((uint32_t)(now - slot->readAt[i]) >= interval) slot->pendingFields |= field;
+  }
+}
+
+void SonosHousehold::resetBackoff(Slot *slot)
+{
+  for (uint8_t i = 0; i < SONOS_HOUSEHOLD_FIELDS; i++)
+  {
+    slot->backoff[i] = 0;
+  }
+}
+
+uint8_t SonosHousehold::fieldIndex(uint8_t field)
+{
+  uint8_t index = 0;
+  while (field > 1)
+  {
+    field >>= 1;
+    index++;
+  }
+  return index;
+}
+
+bool SonosHousehold::schedule()
+{
+  // Round robin over the speakers, one request per speaker and turn starting
+  // after the last one served, until the pool is used up or nothing is left;
+  // returns true when any request was started
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < count; i++)
+  {
+    markDue(&slots[i], now);
+  }
+  bool startedAny = false;
+  bool started = true;
+  while (started)
+  {
+    started = false;
+    uint8_t start = cursor;
+    for (uint8_t n = 0; n < count; n++)
+    {
+      uint8_t index = (start + n) % count;
+      int8_t result = startNext(index);
+      if (result < 0) return startedAny;
+      if (!result) continue;
+      started = true;
+      startedAny = true;
+      cursor = (index + 1) % count;
+    }
+  }
+  return startedAny;
+}
+
+int8_t SonosHousehold::startNext(uint8_t index)
+{
+  // Returns 1 when a request was started, 0 when the speaker has nothing to
+  // start or is at its in-flight limit, -1 when no connection is free;
+  // commands go before status reads
+  Slot *slot = &slots[index];
+  if (slot->inFlight >= inFlightLimit) return 0;
+  Flight flight;
+  flight.slot = index;
+  flight.field = 0;
+  flight.command.type = 0;
+  int8_t handle;
+  if (slot->commandCount)
+  {
+    handle = beginCommand(slot);
+    if (handle < 0) return -1;
+    flight.command = slot->commands[0];
+    slot->commandCount--;
+    for (uint8_t i = 0; i < slot->commandCount; i++)
+    {
+      slot->commands[i] = slot->commands[i + 1];
+    }
+  }
+  else
+  {
+    uint8_t fields = slot->pendingFields & ~slot->requestedFields;
+    if (!fields) return 0;
+    flight.field = fields & (~fields + 1);
+    handle = beginField(slot, flight.field);
+    if (handle < 0) return -1;
+    slot->requestedFields |= flight.field;
+    slot->readAt[fieldIndex(flight.field)] = millis();
+  }
+  // Collected by collect(), not by the async callback
+  sonos->connections[handle].owned = true;
+  flights[handle] = flight;
+  slot->inFlight++;
+  return 1;
+}
+
+int8_t SonosHousehold::beginCommand(Slot *slot)
+{
+  Command *command = &slot->commands[0];
+  switch (command->type)
+  {
+    case SONOS_HOUSEHOLD_COMMAND_PLAY: return sonos->beginPlay(slot->speaker.ip);
+    case SONOS_HOUSEHOLD_COMMAND_PAUSE: return sonos->beginPause(slot->speaker.ip);
+    case SONOS_HOUSEHOLD_COMMAND_STOP: return sonos->beginStop(slot->speaker.ip);
+    case SONOS_HOUSEHOLD_COMMAND_VOLUME: return sonos->beginSetVolume(slot->speaker.ip, command->value);
+    case SONOS_HOUSEHOLD_COMMAND_MUTE: return sonos->beginSetMute(slot->speaker.ip, command->value);
+  }
+  return -1;
+}
+
+int8_t SonosHousehold::beginField(Slot *slot, uint8_t field)
+{
+  switch (field)
+  {
+    case SONOS_HOUSEHOLD_STATE: return sonos->beginGetState(slot->speaker.ip);
+    case SONOS_HOUSEHOLD_VOLUME: return sonos->beginGetVolume(slot->speaker.ip);
+    case SONOS_HOUSEHOLD_MUTE: return sonos->beginGetMute(slot->speaker.ip);
+    case SONOS_HOUSEHOLD_POSITION: return sonos->beginGetTrackPosition(slot->speaker.ip);
+    case SONOS_HOUSEHOLD_BASS: return sonos->beginGetBass(slot->speaker.ip);
+    case SONOS_HOUSEHOLD_TREBLE: return sonos->beginGetTreble(slot->speaker.ip);
+    case SONOS_HOUSEHOLD_LOUDNESS: return sonos->beginGetLoudness(slot->speaker.ip);
+  }
+  return -1;
+}
+
+#endif
@@ -0,0 +1,171 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#ifndef SonosHousehold_h
+#define SonosHousehold_h
+
+#include "SonosUPnP.h"
+
+#ifndef SONOS_WRITE_ONLY_MODE
+
+// Household defaults, times in milliseconds; each is how old a field may get
+// before it is read again, unless it backs off:
+#define SONOS_HOUSEHOLD_STATE_MS 5000
+#define SONOS_HOUSEHOLD_POSITION_MS 2000
+#define SONOS_HOUSEHOLD_VOLUME_MS 10000
+#define SONOS_HOUSEHOLD_EQ_MS 60000
+// Fields read unchanged are read up to 2^SONOS_HOUSEHOLD_MAX_BACKOFF times
+// less often; a change on the speaker reads them at their freshness again
+#define SONOS_HOUSEHOLD_MAX_BACKOFF 4
+// Requests one speaker may have in flight at the same time
+#define SONOS_HOUSEHOLD_IN_FLIGHT 1
+// Status fields
+#define SONOS_HOUSEHOLD_STATE 1
+#define SONOS_HOUSEHOLD_VOLUME 2
+#define SONOS_HOUSEHOLD_MUTE 4
+#define SONOS_HOUSEHOLD_POSITION 8
+#define SONOS_HOUSEHOLD_BASS 16
+#define SONOS_HOUSEHOLD_TREBLE 32
+#define SONOS_HOUSEHOLD_LOUDNESS 64
+#define SONOS_HOUSEHOLD_EQ 112
+#define SONOS_HOUSEHOLD_ALL 127
+#define SONOS_HOUSEHOLD_FIELDS 7
+#define SONOS_HOUSEHOLD_DEFAULT_FIELDS 7
+#define SONOS_HOUSEHOLD_COMMAND_PLAY 1
+#define SONOS_HOUSEHOLD_COMMAND_PAUSE 2
+#define SONOS_HOUSEHOLD_COMMAND_STOP 3
+#define SONOS_HOUSEHOLD_COMMAND_VOLUME 4
+#define SONOS_HOUSEHOLD_COMMAND_MUTE 5
+#ifndef SONOS_HOUSEHOLD_SPEAKERS
+  #if (defined(__AVR__))
+    #define SONOS_HOUSEHOLD_SPEAKERS 4
+  #else
+    #define SONOS_HOUSEHOLD_SPEAKERS 32
+  #endif
+#endif
+// Commands that can be queued per speaker; a command replaces a queued one
+// of the same kind
+#ifndef SONOS_HOUSEHOLD_COMMANDS
+  #if (defined(__AVR__))
+    #define SONOS_HOUSEHOLD_COMMANDS 2
+  #else
+    #define SONOS_HOUSEHOLD_COMMANDS 4
+  #endif
+#endif
+
+struct HouseholdSpeaker
+{
+  IPAddress ip;
+  uint8_t state;
+  uint8_t volume;
+  bool mute;
+  uint32_t position;
+  int8_t bass;
+  int8_t treble;
+  bool loudness;
+  // Status fields read at least once
+  uint8_t valid;
+  uint8_t failures;
+  uint32_t refreshedAt;
+};
+
+class SonosHousehold
+{
+
+  public:
+
+    SonosHousehold(SonosUPnP *sonos);
+
+    int8_t addSpeaker(IPAddress speakerIP);
+    bool removeSpeaker(IPAddress speakerIP);
+    void setRefreshInterval(uint32_t refreshInterval);
+    void setRefreshFields(uint8_t refreshFields);
+    void setFreshness(uint8_t fields, uint32_t freshness);
+    void setInFlightLimit(uint8_t inFlightLimit);
+    void setStatusCallback(void (*callback)(HouseholdSpeaker *speaker));
+    bool update();
+    void refresh();
+    void refresh(IPAddress speakerIP);
+    bool isIdle();
+    uint8_t getCount();
+    HouseholdSpeaker *getSpeaker(uint8_t index);
+    HouseholdSpeaker *findSpeaker(IPAddress speakerIP);
+    bool play(IPAddress speakerIP);
+    bool pause(IPAddress speakerIP);
+    bool stop(IPAddress speakerIP);
+    bool setVolume(IPAddress speakerIP, uint8_t volume);
+    bool setMute(IPAddress speakerIP, bool state);
+
+  private:
+
+    struct Command
+    {
+      uint8_t type;
+      uint8_t value;
+    };
+
+    struct Slot
+    {
+      HouseholdSpeaker speaker;
+      uint32_t readAt[SONOS_HOUSEHOLD_FIELDS];
+      uint8_t backoff[SONOS_HOUSEHOLD_FIELDS];
+      uint8_t pendingFields;
+      uint8_t requestedFields;
+      uint8_t inFlight;
+      uint8_t commandCount;
+      Command commands[SONOS_HOUSEHOLD_COMMANDS];
+    };
+
+    // What a connection of the SonosUPnP pool is doing for the household,
+    // indexed by its async handle
+    struct Flight
+    {
+      int8_t slot;
+      uint8_t field;
+      Command command;
+    };
+
+    SonosUPnP *sonos;
+    uint32_t freshness[SONOS_HOUSEHOLD_FIELDS];
+    uint8_t refreshFields;
+    uint8_t inFlightLimit;
+    uint8_t count;
+    uint8_t cursor;
+    bool changed;
+    Slot slots[SONOS_HOUSEHOLD_SPEAKERS];
+    Flight flights[UPNP_MAX_CONNECTIONS];
+    void (*statusCallback)(HouseholdSpeaker *speaker);
+
+    int8_t findSlot(IPAddress speakerIP);
+    bool queueCommand(IPAddress speakerIP, uint8_t type, uint8_t value);
+    void collect();
+    void finish(Flight *flight, bool success, int32_t value);
+    bool setStatus(Slot *slot, uint8_t field, int32_t value);
+    void markDue(Slot *slot, uint32_t now);
+    void resetBackoff(Slot *slot);
+    uint8_t fieldIndex(uint8_t field);
+    bool schedule();
+    int8_t startNext(uint8_t index);
+    int8_t beginCommand(Slot *slot);
+    int8_t beginField(Slot *slot, uint8_t field);
+};
+
+#endif
+
+#endif
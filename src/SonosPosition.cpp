@@ -0,0 +1,178 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#include "SonosPosition.h"
+
+#ifndef SONOS_WRITE_ONLY_MODE
+
+SonosPosition::SonosPosition(SonosUPnP *sonos, IPAddress speakerIP)
+{
+  this->sonos = sonos;
+  this->speakerIP = speakerIP;
+  this->checkInterval = SONOS_POSITION_CHECK_INTERVAL_MS;
+  this->driftThreshold = SONOS_POSITION_DRIFT_MS;
+  this->valid = false;
+  this->failed = false;
+  this->state = SONOS_STATE_STOPPED;
+  this->number = 0;
+  this->duration = 0;
+  this->position = 0;
+  this->anchoredAt = 0;
+  this->syncedAt = 0;
+  this->checkedAt = 0;
+}
+
+void SonosPosition::setCheckInterval(uint32_t checkInterval)
+{
+  // Drift checks in every state, so a resume from another controller is seen
+  // too; 0 turns them off when events keep the model in sync
+  this->checkInterval = checkInterval;
+}
+
+void SonosPosition::setDriftThreshold(uint16_t driftThreshold)
+{
+  this->driftThreshold = driftThreshold;
+}
+
+bool SonosPosition::update()
+{
+  // Only talks to the speaker when the model is stale: no snapshot yet, the
+  // track should have ended, or a drift check is due; returns true if it did;
+  // failed syncs are retried after a pause
+  if (!valid)
+  {
+    if (failed && (uint32_t)(millis() - syncedAt) < SONOS_POSITION_RETRY_MS) return false;
+    return sync();
+  }
+  if (state == SONOS_STATE_PLAYING && duration && getPositionMs() >= duration * 1000)
+  {
+    if ((uint32_t)(millis() - syncedAt) < SONOS_POSITION_MIN_SYNC_MS) return false;
+    return sync();
+  }
+  if (checkInterval && (uint32_t)(millis() - checkedAt) >= checkInterval) return check();
+  return false;
+}
+
+void SonosPosition::invalidate()
+{
+  // For track or state changes seen elsewhere, e.g. by SonosEvents
+  valid = false;
+  failed = false;
+}
+
+void SonosPosition::setState(uint8_t state)
+{
+  // A state change from an event, the position is frozen or resumed locally
+  anchor(getPositionMs());
+  this->state = state;
+}
+
+bool SonosPosition::isValid()
+{
+  return valid;
+}
+
+uint8_t SonosPosition::getState()
+{
+  return state;
+}
+
+uint16_t SonosPosition::getTrackNumber()
+{
+  return number;
+}
+
+uint32_t SonosPosition::getDuration()
+{
+  return duration;
+}
+
+uint32_t SonosPosition::getPosition()
+{
+  return getPositionMs() / 1000;
+}
+
+uint16_t SonosPosition::getPerMille()
+{
+  if (!duration) return 0;
+  return (uint64_t)getPositionMs() / duration;
+}
+
+uint32_t SonosPosition::getRemaining()
+{
+  uint32_t elapsed = getPosition();
+  return elapsed < duration ? duration - elapsed : 0;
+}
+
+bool SonosPosition::sync()
+{
+  // State and position snapshot, the model runs from it while playing
+  syncedAt = millis();
+  checkedAt = syncedAt;
+  TrackInfo trackInfo;
+  char uri[1];
+  uint8_t newState = sonos->getState(speakerIP);
+  if (!sonos->getPositionInfo(speakerIP, &trackInfo, uri, sizeof(uri)))
+  {
+    valid = false;
+    failed = true;
+    return true;
+  }
+  failed = false;
+  state = newState;
+  number = trackInfo.number;
+  duration = trackInfo.duration;
+  anchor(trackInfo.position * 1000);
+  valid = true;
+  return true;
+}
+
+bool SonosPosition::check()
+{
+  // The speaker reports whole seconds, so the model may be up to a second
+  // ahead of it; a larger difference or another track means a full sync
+  checkedAt = millis();
+  TrackInfo trackInfo;
+  char uri[1];
+  if (!sonos->getPositionInfo(speakerIP, &trackInfo, uri, sizeof(uri))) return sync();
+  uint32_t expected = getPositionMs();
+  uint32_t reported = trackInfo.position * 1000;
+  if (trackInfo.number != number || trackInfo.duration != duration ||
+      expected + driftThreshold < reported || reported + 1000 + driftThreshold < expected)
+  {
+    return sync();
+  }
+  return true;
+}
+
+uint32_t SonosPosition::getPositionMs()
+{
+  if (!valid || state != SONOS_STATE_PLAYING) return position;
+  uint32_t positionMs = position + (uint32_t)(millis() - anchoredAt);
+  if (duration && positionMs > duration * 1000) positionMs = duration * 1000;
+  return positionMs;
+}
+
+void SonosPosition::anchor(uint32_t positionMs)
+{
+  position = positionMs;
+  anchoredAt = millis();
+}
+
+#endif
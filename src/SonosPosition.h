@@ -0,0 +1,80 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#ifndef SonosPosition_h
+#define SonosPosition_h
+
+#include "SonosUPnP.h"
+
+#ifndef SONOS_WRITE_ONLY_MODE
+
+// Position model defaults, times in milliseconds:
+#define SONOS_POSITION_CHECK_INTERVAL_MS 30000
+#define SONOS_POSITION_DRIFT_MS 1500
+// Shortest time between two syncs, while a track that should have ended has
+// not yet been replaced by the next one
+#define SONOS_POSITION_MIN_SYNC_MS 1000
+// Pause before a failed sync is tried again
+#define SONOS_POSITION_RETRY_MS 5000
+
+class SonosPosition
+{
+
+  public:
+
+    SonosPosition(SonosUPnP *sonos, IPAddress speakerIP);
+
+    void setCheckInterval(uint32_t checkInterval);
+    void setDriftThreshold(uint16_t driftThreshold);
+    bool update();
+    void invalidate();
+    void setState(uint8_t state);
+    bool isValid();
+    uint8_t getState();
+    uint16_t getTrackNumber();
+    uint32_t getDuration();
+    uint32_t getPosition();
+    uint16_t getPerMille();
+    uint32_t getRemaining();
+
+  private:
+
+    SonosUPnP *sonos;
+    IPAddress speakerIP;
+    uint32_t checkInterval;
+    uint16_t driftThreshold;
+    bool valid;
+    bool failed;
+    uint8_t state;
+    uint16_t number;
+    uint32_t duration;
+    uint32_t position;
+    uint32_t anchoredAt;
+    uint32_t syncedAt;
+    uint32_t checkedAt;
+
+    bool sync();
+    bool check();
+    uint32_t getPositionMs();
+    void anchor(uint32_t positionMs);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,418 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#include "SonosTopology.h"
+
+#ifndef SONOS_WRITE_ONLY_MODE
+
+const char p_GetZoneGroupState[] PROGMEM = SONOS_TAG_GET_ZONE_GROUP_STATE;
+const char p_ZoneGroupState[] PROGMEM = SONOS_TAG_ZONE_GROUP_STATE;
+const char p_ZoneGroups[] PROGMEM = SONOS_TAG_ZONE_GROUPS;
+const char p_ZoneGroup[] PROGMEM = SONOS_TAG_ZONE_GROUP;
+const char p_ZoneGroupMember[] PROGMEM = SONOS_TAG_ZONE_GROUP_MEMBER;
+const char p_Coordinator[] PROGMEM = SONOS_ATTRIBUTE_COORDINATOR;
+const char p_Uuid[] PROGMEM = SONOS_ATTRIBUTE_UUID;
+const char p_Location[] PROGMEM = SONOS_ATTRIBUTE_LOCATION;
+const char p_ZoneName[] PROGMEM = SONOS_ATTRIBUTE_ZONE_NAME;
+const char p_Invisible[] PROGMEM = SONOS_ATTRIBUTE_INVISIBLE;
+
+SonosTopology::SonosTopology(SonosUPnP *sonos, IPAddress speakerIP)
+{
+  this->sonos = sonos;
+  this->speakerIP = speakerIP;
+  this->refreshInterval = SONOS_TOPOLOGY_REFRESH_INTERVAL_MS;
+  this->refreshedAt = 0;
+  this->hash = 0;
+  this->valid = false;
+  this->failed = false;
+  this->routable = false;
+  this->count = 0;
+  this->groupCount = 0;
+  buildIndexes();
+}
+
+void SonosTopology::setSpeaker(IPAddress speakerIP)
+{
+  // Any speaker answers for the whole household, e.g. another one when this
+  // one is switched off
+  this->speakerIP = speakerIP;
+  invalidate();
+}
+
+void SonosTopology::setRefreshInterval(uint32_t refreshInterval)
+{
+  // Periodic refreshes, 0 turns them off when topology events invalidate the table
+  this->refreshInterval = refreshInterval;
+}
+
+bool SonosTopology::refresh()
+{
+  // Returns true when the table changed; the lookup tables are only rebuilt
+  // when the hash of the zone group state differs from the last one
+  refreshedAt = millis();
+  for (uint8_t i = 0; i < count; i++)
+  {
+    seen[i] = false;
+  }
+  uint32_t stateHash = SONOS_TOPOLOGY_FNV_OFFSET;
+  bool complete = false;
+  bool posted = sonos->upnpPost(speakerIP, UPNP_ZONE_GROUP_TOPOLOGY, p_GetZoneGroupState, "", "", "", 0, 0, "");
+  if (posted) complete = parse(&stateHash);
+  sonos->ethClient_stop();
+  failed = !complete;
+  if (!posted) return false;
+  if (!complete)
+  {
+    // Members read before the response was cut off are updated; the others,
+    // and those of the group being read, have no known group until the next
+    // refresh, as their numbers would mix the old and the new ones
+    for (uint8_t i = 0; i < count; i++)
+    {
+      if (!seen[i] || members[i].group >= groupCount) members[i].group = SONOS_MAX_ZONE_MEMBERS;
+    }
+    valid = false;
+    routable = false;
+    buildIndexes();
+    return true;
+  }
+  removeUnseen();
+  bool changed = !valid || stateHash != hash;
+  hash = stateHash;
+  valid = true;
+  routable = true;
+  if (changed) buildIndexes();
+  return changed;
+}
+
+bool SonosTopology::update()
+{
+  // Refreshes when invalidated, e.g. from the SonosEvents topology callback,
+  // or when the refresh interval has passed; failed refreshes are retried after a pause
+  uint32_t elapsed = millis() - refreshedAt;
+  if (failed && elapsed < SONOS_TOPOLOGY_RETRY_MS) return false;
+  if (valid && !failed && (!refreshInterval || elapsed < refreshInterval)) return false;
+  return refresh();
+}
+
+void SonosTopology::invalidate()
+{
+  valid = false;
+  failed = false;
+  routable = false;
+}
+
+bool SonosTopology::isValid()
+{
+  return valid;
+}
+
+uint8_t SonosTopology::getCount()
+{
+  return count;
+}
+
+uint8_t SonosTopology::getGroupCount()
+{
+  return groupCount;
+}
+
+ZoneMember *SonosTopology::getMember(uint8_t index)
+{
+  if (index >= count) return 0;
+  return &members[index];
+}
+
+ZoneMember *SonosTopology::findMember(const char *roomName)
+{
+  uint8_t slot = hashName(roomName) & (SONOS_TOPOLOGY_INDEX_SIZE - 1);
+  while (roomIndex[slot])
+  {
+    ZoneMember *member = &members[roomIndex[slot] - 1];
+    if (!strcmp(member->roomName, roomName)) return member;
+    slot = (slot + 1) & (SONOS_TOPOLOGY_INDEX_SIZE - 1);
+  }
+  return 0;
+}
+
+ZoneMember *SonosTopology::findMember(IPAddress ip)
+{
+  uint8_t slot = hashIP(ip) & (SONOS_TOPOLOGY_INDEX_SIZE - 1);
+  while (ipIndex[slot])
+  {
+    ZoneMember *member = &members[ipIndex[slot] - 1];
+    if (member->ip == ip) return member;
+    slot = (slot + 1) & (SONOS_TOPOLOGY_INDEX_SIZE - 1);
+  }
+  return 0;
+}
+
+ZoneMember *SonosTopology::getCoordinator(ZoneMember *member)
+{
+  if (!member || member->group >= groupCount || !coordinators[member->group]) return 0;
+  return &members[coordinators[member->group] - 1];
+}
+
+IPAddress SonosTopology::getCoordinatorIP(IPAddress speakerIP)
+{
+  // Speakers that are not in the table are their own coordinators
+  ZoneMember *coordinator = getCoordinator(findMember(speakerIP));
+  return coordinator ? coordinator->ip : speakerIP;
+}
+
+void SonosTopology::detach(IPAddress speakerIP)
+{
+  // Until the next refresh, a member that left its group is taken as the
+  // coordinator of a group of its own; the table is otherwise still good
+  valid = false;
+  failed = false;
+  ZoneMember *member = findMember(speakerIP);
+  if (!member || member->coordinator || groupCount >= SONOS_MAX_ZONE_MEMBERS) return;
+  member->group = groupCount++;
+  member->coordinator = true;
+  coordinators[member->group] = member - members + 1;
+}
+
+bool SonosTopology::parse(uint32_t *stateHash)
+{
+  // The zone group state in <ZoneGroupState> is decoded on the fly and
+  // tokenized once more; members are written to their slots as they are read,
+  // returns true if the state was read to the end
+  SonosUPnP::MarkupParser outer;
+  SonosUPnP::MarkupParser inner;
+  sonos->markupBegin(&outer);
+  sonos->markupBegin(&inner);
+  clearMember();
+  *groupCoordinator = '\0';
+  groupMembers = 0;
+  groupCount = 0;
+  bool inState = false;
+  bool complete = false;
+  int character;
+  char decoded;
+  char output;
+  while ((character = sonos->ethClient_read()) >= 0)
+  {
+    uint8_t event = sonos->markupParse(&outer, character, &decoded);
+    if (event == SONOS_MARKUP_START || event == SONOS_MARKUP_END)
+    {
+      for (; event != SONOS_MARKUP_NONE; event = sonos->markupNext(&outer))
+      {
+        inState = event == SONOS_MARKUP_START && sonos->markupIs(&outer, p_ZoneGroupState);
+      }
+      if (!inState) sonos->ethClient_skipText();
+      continue;
+    }
+    if (event != SONOS_MARKUP_TEXT || !inState) continue;
+    *stateHash = hashStep(*stateHash, decoded);
+    event = sonos->markupParse(&inner, decoded, &output);
+    if (event == SONOS_MARKUP_ATTRIBUTE)
+    {
+      parseAttribute(&inner, output);
+    }
+    // Attributes come before the tag is complete, so the member is stored
+    // at its start tag and the group is closed at its end tag
+    for (; event == SONOS_MARKUP_START || event == SONOS_MARKUP_END; event = sonos->markupNext(&inner))
+    {
+      if (sonos->markupIs(&inner, p_ZoneGroupMember))
+      {
+        if (event == SONOS_MARKUP_START) storeMember();
+      }
+      else if (sonos->markupIs(&inner, p_ZoneGroup))
+      {
+        if (event == SONOS_MARKUP_END)
+        {
+          if (groupMembers) groupCount++;
+          groupMembers = 0;
+          *groupCoordinator = '\0';
+        }
+      }
+      else if (event == SONOS_MARKUP_END && sonos->markupIs(&inner, p_ZoneGroups))
+      {
+        complete = true;
+      }
+      clearMember();
+    }
+  }
+  return complete;
+}
+
+void SonosTopology::parseAttribute(SonosUPnP::MarkupParser *parser, char character)
+{
+  // Values arrive one character at a time, the position starts over whenever
+  // another attribute of interest begins
+  uint8_t current = SONOS_TOPOLOGY_FIELD_NONE;
+  if (sonos->markupIs(parser, p_ZoneGroup))
+  {
+    if (!strcmp_P(parser->attribute, p_Coordinator)) current = SONOS_TOPOLOGY_FIELD_COORDINATOR;
+  }
+  else if (sonos->markupIs(parser, p_ZoneGroupMember))
+  {
+    if (!strcmp_P(parser->attribute, p_Uuid)) current = SONOS_TOPOLOGY_FIELD_UUID;
+    else if (!strcmp_P(parser->attribute, p_Location)) current = SONOS_TOPOLOGY_FIELD_LOCATION;
+    else if (!strcmp_P(parser->attribute, p_ZoneName)) current = SONOS_TOPOLOGY_FIELD_ZONE_NAME;
+    else if (!strcmp_P(parser->attribute, p_Invisible)) current = SONOS_TOPOLOGY_FIELD_INVISIBLE;
+  }
+  if (current != field)
+  {
+    field = current;
+    fieldLength = 0;
+  }
+  switch (field)
+  {
+    case SONOS_TOPOLOGY_FIELD_COORDINATOR:
+    case SONOS_TOPOLOGY_FIELD_UUID:
+      // RINCON_000E58A0B2C601400 gives the ID 000E58A0B2C6, as in SonosDiscovery
+      if (fieldLength >= sizeof(SSDP_RINCON_PREFIX) - 1)
+      {
+        appendValue(
+          field == SONOS_TOPOLOGY_FIELD_UUID ? memberId : groupCoordinator, SONOS_ID_SIZE,
+          fieldLength - (sizeof(SSDP_RINCON_PREFIX) - 1), character);
+      }
+      break;
+    case SONOS_TOPOLOGY_FIELD_LOCATION:
+      appendValue(memberLocation, sizeof(memberLocation), fieldLength, character);
+      break;
+    case SONOS_TOPOLOGY_FIELD_ZONE_NAME:
+      appendValue(memberRoomName, sizeof(memberRoomName), fieldLength, character);
+      break;
+    case SONOS_TOPOLOGY_FIELD_INVISIBLE:
+      memberInvisible = character == '1';
+      break;
+  }
+  if (fieldLength < 0xFF) fieldLength++;
+}
+
+void SonosTopology::clearMember()
+{
+  field = SONOS_TOPOLOGY_FIELD_NONE;
+  fieldLength = 0;
+  memberInvisible = false;
+  *memberId = '\0';
+  *memberRoomName = '\0';
+  *memberLocation = '\0';
+}
+
+void SonosTopology::storeMember()
+{
+  // Members keep their slots across refreshes, matched by ID; hidden ones,
+  // like the second speaker of a stereo pair, are left out
+  if (memberInvisible || !*memberId) return;
+  uint8_t index = 0;
+  while (index < count && strcmp(members[index].id, memberId)) index++;
+  if (index == count)
+  {
+    if (count == SONOS_MAX_ZONE_MEMBERS) return;
+    count++;
+  }
+  ZoneMember *member = &members[index];
+  strcpy(member->id, memberId);
+  strcpy(member->roomName, memberRoomName);
+  member->ip = parseLocation(memberLocation);
+  member->group = groupCount;
+  member->coordinator = !strcmp(memberId, groupCoordinator);
+  seen[index] = true;
+  groupMembers++;
+}
+
+void SonosTopology::removeUnseen()
+{
+  // The last member takes the slot of a removed one, other slots don't move
+  uint8_t index = 0;
+  while (index < count)
+  {
+    if (seen[index])
+    {
+      index++;
+      continue;
+    }
+    count--;
+    members[index] = members[count];
+    seen[index] = seen[count];
+  }
+}
+
+void SonosTopology::buildIndexes()
+{
+  memset(coordinators, 0, sizeof(coordinators));
+  memset(roomIndex, 0, sizeof(roomIndex));
+  memset(ipIndex, 0, sizeof(ipIndex));
+  for (uint8_t i = 0; i < count; i++)
+  {
+    ZoneMember *member = &members[i];
+    indexInsert(roomIndex, hashName(member->roomName), i);
+    indexInsert(ipIndex, hashIP(member->ip), i);
+    if (member->coordinator && member->group < SONOS_MAX_ZONE_MEMBERS) coordinators[member->group] = i + 1;
+  }
+}
+
+void SonosTopology::indexInsert(uint8_t *index, uint32_t key, uint8_t member)
+{
+  // Open addressing with linear probing, the table is never more than half full
+  uint8_t slot = key & (SONOS_TOPOLOGY_INDEX_SIZE - 1);
+  while (index[slot]) slot = (slot + 1) & (SONOS_TOPOLOGY_INDEX_SIZE - 1);
+  index[slot] = member + 1;
+}
+
+IPAddress SonosTopology::parseLocation(const char *location)
+{
+  // http://192.168.0.201:1400/xml/device_description.xml
+  uint8_t octets[4] = { 0, 0, 0, 0 };
+  const char *host = strstr(location, "//");
+  if (host) host += 2;
+  for (uint8_t i = 0; i < 4 && host; i++)
+  {
+    octets[i] = atoi(host);
+    host = strchr(host, '.');
+    if (host) host++;
+  }
+  return IPAddress(octets[0], octets[1], octets[2], octets[3]);
+}
+
+void SonosTopology::appendValue(char *buffer, size_t bufferSize, uint8_t position, char character)
+{
+  // Values longer than the buffer are cut
+  if ((size_t)position + 1 >= bufferSize) return;
+  buffer[position] = character;
+  buffer[position + 1] = '\0';
+}
+
+uint32_t SonosTopology::hashStep(uint32_t hash, uint8_t data)
+{
+  // FNV-1a
+  return (hash ^ data) * SONOS_TOPOLOGY_FNV_PRIME;
+}
+
+uint32_t SonosTopology::hashName(const char *name)
+{
+  uint32_t hash = SONOS_TOPOLOGY_FNV_OFFSET;
+  while (*name) hash = hashStep(hash, *name++);
+  return hash;
+}
+
+uint32_t SonosTopology::hashIP(IPAddress ip)
+{
+  uint32_t hash = SONOS_TOPOLOGY_FNV_OFFSET;
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    hash = hashStep(hash, ip[i]);
+  }
+  return hash;
+}
+
+#endif
@@ -0,0 +1,170 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#ifndef SonosTopology_h
+#define SonosTopology_h
+
+#include "SonosUPnP.h"
+#include "SonosDiscovery.h"
+
+#ifndef SONOS_WRITE_ONLY_MODE
+
+// Zone group state, entity escaped inside the response:
+/*
+<u:GetZoneGroupStateResponse xmlns:u="urn:schemas-upnp-org:service:ZoneGroupTopology:1">
+  <ZoneGroupState>
+    &lt;ZoneGroupState&gt;&lt;ZoneGroups&gt;
+      &lt;ZoneGroup Coordinator="RINCON_000E58A0B2C601400" ID="RINCON_000E58A0B2C601400:58"&gt;
+        &lt;ZoneGroupMember UUID="RINCON_000E58A0B2C601400" Location="http://192.168.0.201:1400/xml/device_description.xml" ZoneName="Kitchen" .../&gt;
+        &lt;ZoneGroupMember UUID="RINCON_000E58B1C3D401400" Location="http://192.168.0.202:1400/xml/device_description.xml" ZoneName="Living Room" ...&gt;
+          &lt;Satellite UUID="RINCON_000E58C5E6F701400" ... Invisible="1"/&gt;
+        &lt;/ZoneGroupMember&gt;
+      &lt;/ZoneGroup&gt;
+    &lt;/ZoneGroups&gt;&lt;/ZoneGroupState&gt;
+  </ZoneGroupState>
+</u:GetZoneGroupStateResponse>
+*/
+#define SONOS_TAG_GET_ZONE_GROUP_STATE "GetZoneGroupState"
+#define SONOS_TAG_ZONE_GROUP_STATE "ZoneGroupState"
+#define SONOS_TAG_ZONE_GROUPS "ZoneGroups"
+#define SONOS_TAG_ZONE_GROUP "ZoneGroup"
+#define SONOS_TAG_ZONE_GROUP_MEMBER "ZoneGroupMember"
+#define SONOS_ATTRIBUTE_COORDINATOR "Coordinator"
+#define SONOS_ATTRIBUTE_UUID "UUID"
+#define SONOS_ATTRIBUTE_LOCATION "Location"
+#define SONOS_ATTRIBUTE_ZONE_NAME "ZoneName"
+#define SONOS_ATTRIBUTE_INVISIBLE "Invisible"
+#define SONOS_TOPOLOGY_FIELD_NONE 0
+#define SONOS_TOPOLOGY_FIELD_COORDINATOR 1
+#define SONOS_TOPOLOGY_FIELD_UUID 2
+#define SONOS_TOPOLOGY_FIELD_LOCATION 3
+#define SONOS_TOPOLOGY_FIELD_ZONE_NAME 4
+#define SONOS_TOPOLOGY_FIELD_INVISIBLE 5
+#define SONOS_TOPOLOGY_FNV_OFFSET 2166136261UL
+#define SONOS_TOPOLOGY_FNV_PRIME 16777619UL
+#define SONOS_TOPOLOGY_REFRESH_INTERVAL_MS 60000
+#define SONOS_TOPOLOGY_RETRY_MS 5000
+#define SONOS_TOPOLOGY_LOCATION_SIZE 24
+#ifndef SONOS_ROOM_NAME_SIZE
+  #if (defined(__AVR__))
+    #define SONOS_ROOM_NAME_SIZE 16
+  #else
+    #define SONOS_ROOM_NAME_SIZE 32
+  #endif
+#endif
+#ifndef SONOS_MAX_ZONE_MEMBERS
+  #if (defined(__AVR__))
+    #define SONOS_MAX_ZONE_MEMBERS 6
+  #else
+    #define SONOS_MAX_ZONE_MEMBERS 32
+  #endif
+#endif
+// Slots in the room name and IP lookup tables, a power of two of at least
+// twice SONOS_MAX_ZONE_MEMBERS
+#ifndef SONOS_TOPOLOGY_INDEX_SIZE
+  #if (defined(__AVR__))
+    #define SONOS_TOPOLOGY_INDEX_SIZE 16
+  #else
+    #define SONOS_TOPOLOGY_INDEX_SIZE 64
+  #endif
+#endif
+#if (SONOS_TOPOLOGY_INDEX_SIZE < 2 * SONOS_MAX_ZONE_MEMBERS)
+  #error SONOS_TOPOLOGY_INDEX_SIZE must be at least twice SONOS_MAX_ZONE_MEMBERS
+#endif
+
+struct ZoneMember
+{
+  IPAddress ip;
+  char id[SONOS_ID_SIZE];
+  char roomName[SONOS_ROOM_NAME_SIZE];
+  uint8_t group;
+  bool coordinator;
+};
+
+class SonosTopology
+{
+
+  public:
+
+    SonosTopology(SonosUPnP *sonos, IPAddress speakerIP);
+
+    void setSpeaker(IPAddress speakerIP);
+    void setRefreshInterval(uint32_t refreshInterval);
+    bool refresh();
+    bool update();
+    void invalidate();
+    bool isValid();
+    uint8_t getCount();
+    uint8_t getGroupCount();
+    ZoneMember *getMember(uint8_t index);
+    ZoneMember *findMember(const char *roomName);
+    ZoneMember *findMember(IPAddress ip);
+    ZoneMember *getCoordinator(ZoneMember *member);
+    IPAddress getCoordinatorIP(IPAddress speakerIP);
+
+  private:
+
+    friend class SonosUPnP;
+
+    SonosUPnP *sonos;
+    IPAddress speakerIP;
+    uint32_t refreshInterval;
+    uint32_t refreshedAt;
+    uint32_t hash;
+    bool valid;
+    bool failed;
+    // Read in full and since changed by detach() only, commands are routed by it
+    bool routable;
+    uint8_t count;
+    uint8_t groupCount;
+    ZoneMember members[SONOS_MAX_ZONE_MEMBERS];
+    bool seen[SONOS_MAX_ZONE_MEMBERS];
+    // Member index + 1 per group, and per slot of the lookup tables
+    uint8_t coordinators[SONOS_MAX_ZONE_MEMBERS];
+    uint8_t roomIndex[SONOS_TOPOLOGY_INDEX_SIZE];
+    uint8_t ipIndex[SONOS_TOPOLOGY_INDEX_SIZE];
+
+    // Parser state, attributes of the tag being read
+    uint8_t field;
+    uint8_t fieldLength;
+    uint8_t groupMembers;
+    bool memberInvisible;
+    char memberId[SONOS_ID_SIZE];
+    char memberRoomName[SONOS_ROOM_NAME_SIZE];
+    char memberLocation[SONOS_TOPOLOGY_LOCATION_SIZE];
+    char groupCoordinator[SONOS_ID_SIZE];
+
+    void detach(IPAddress speakerIP);
+    bool parse(uint32_t *stateHash);
+    void parseAttribute(SonosUPnP::MarkupParser *parser, char character);
+    void clearMember();
+    void storeMember();
+    void removeUnseen();
+    void buildIndexes();
+    void indexInsert(uint8_t *index, uint32_t key, uint8_t member);
+    IPAddress parseLocation(const char *location);
+    static void appendValue(char *buffer, size_t bufferSize, uint8_t position, char character);
+    static uint32_t hashStep(uint32_t hash, uint8_t data);
+    static uint32_t hashName(const char *name);
+    static uint32_t hashIP(IPAddress ip);
+};
+
+#endif
+
+#endif
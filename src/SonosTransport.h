@@ -0,0 +1,45 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#ifndef SonosTransport_h
+#define SonosTransport_h
+
+#include <Arduino.h>
+
+// The network transport is the Arduino Ethernet library, or POSIX sockets
+// when the library is built as a normal C++ library on a Linux host
+#if !defined(ARDUINO) && defined(__linux__) && !defined(SONOS_POSIX_TRANSPORT)
+  #define SONOS_POSIX_TRANSPORT
+#endif
+
+#ifdef SONOS_POSIX_TRANSPORT
+  #include "posix/PosixTransport.h"
+  typedef PosixClient SonosClient;
+  typedef PosixServer SonosServer;
+  typedef PosixUDP SonosUDP;
+#else
+  #include "../../Ethernet/src/EthernetClient.h"
+  #include "../../Ethernet/src/EthernetServer.h"
+  #include "../../Ethernet/src/EthernetUdp.h"
+  typedef EthernetClient SonosClient;
+  typedef EthernetServer SonosServer;
+  typedef EthernetUDP SonosUDP;
+#endif
+
+#endif
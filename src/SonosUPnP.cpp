@@ -18,28 +18,78 @@
 /************************************************************************/
 
 #include "SonosUPnP.h"
+#include "SonosBatch.h"
+#include "SonosTopology.h"
 
-const char p_HttpVersion[] PROGMEM = HTTP_VERSION;
-const char p_HeaderHost[] PROGMEM = HEADER_HOST;
-const char p_HeaderContentType[] PROGMEM = HEADER_CONTENT_TYPE;
-const char p_HeaderContentLength[] PROGMEM = HEADER_CONTENT_LENGTH;
-const char p_HeaderSoapAction[] PROGMEM = HEADER_SOAP_ACTION;
 const char p_HeaderConnection[] PROGMEM = HEADER_CONNECTION;
+const char p_HeaderConnectionKeepAlive[] PROGMEM = HEADER_CONNECTION_KEEP_ALIVE;
+const char p_HeaderContentLengthName[] PROGMEM = HEADER_CONTENT_LENGTH_NAME;
+const char p_HeaderConnectionCloseName[] PROGMEM = HEADER_CONNECTION_CLOSE_NAME;
 
-const char p_SoapEnvelopeStart[] PROGMEM = SOAP_ENVELOPE_START;
-const char p_SoapEnvelopeEnd[] PROGMEM = SOAP_ENVELOPE_END;
-const char p_SoapBodyStart[] PROGMEM = SOAP_BODY_START;
-const char p_SoapBodyEnd[] PROGMEM = SOAP_BODY_END;
 const char p_SoapEnvelope[] PROGMEM = SOAP_TAG_ENVELOPE;
 const char p_SoapBody[] PROGMEM = SOAP_TAG_BODY;
-
-const char p_UpnpUrnSchema[] PROGMEM = UPNP_URN_SCHEMA;
-const char p_UpnpAvTransportService[] PROGMEM = UPNP_AV_TRANSPORT_SERVICE;
-const char p_UpnpAvTransportEndpoint[] PROGMEM = UPNP_AV_TRANSPORT_ENDPOINT;
-const char p_UpnpRenderingControlService[] PROGMEM = UPNP_RENDERING_CONTROL_SERVICE;
-const char p_UpnpRenderingControlEndpoint[] PROGMEM = UPNP_RENDERING_CONTROL_ENDPOINT;
-const char p_UpnpDevicePropertiesService[] PROGMEM = UPNP_DEVICE_PROPERTIES_SERVICE;
-const char p_UpnpDevicePropertiesEndpoint[] PROGMEM = UPNP_DEVICE_PROPERTIES_ENDPOINT;
+const char p_SoapFault[] PROGMEM = SOAP_TAG_FAULT;
+const char p_SoapDetail[] PROGMEM = SOAP_TAG_DETAIL;
+const char p_UPnPError[] PROGMEM = SOAP_TAG_UPNP_ERROR;
+const char p_ErrorCode[] PROGMEM = SOAP_TAG_ERROR_CODE;
+
+const char p_RequestHeaderMid[] PROGMEM = UPNP_REQUEST_HEADER_MID;
+const char p_RequestHeaderEnd[] PROGMEM = UPNP_REQUEST_HEADER_END(HEADER_CONNECTION);
+const char p_RequestHeaderEndKeepAlive[] PROGMEM = UPNP_REQUEST_HEADER_END(HEADER_CONNECTION_KEEP_ALIVE);
+const char p_RequestEnd[] PROGMEM = UPNP_REQUEST_END;
+const char p_UpnpAvTransportStart[] PROGMEM = UPNP_REQUEST_START(UPNP_AV_TRANSPORT_ENDPOINT);
+const char p_UpnpAvTransportSoapAction[] PROGMEM = UPNP_REQUEST_SOAP_ACTION(UPNP_AV_TRANSPORT_SERVICE);
+const char p_UpnpAvTransportActionNs[] PROGMEM = UPNP_REQUEST_ACTION_NS(UPNP_AV_TRANSPORT_SERVICE);
+const char p_UpnpRenderingControlStart[] PROGMEM = UPNP_REQUEST_START(UPNP_RENDERING_CONTROL_ENDPOINT);
+const char p_UpnpRenderingControlSoapAction[] PROGMEM = UPNP_REQUEST_SOAP_ACTION(UPNP_RENDERING_CONTROL_SERVICE);
+const char p_UpnpRenderingControlActionNs[] PROGMEM = UPNP_REQUEST_ACTION_NS(UPNP_RENDERING_CONTROL_SERVICE);
+const char p_UpnpDevicePropertiesStart[] PROGMEM = UPNP_REQUEST_START(UPNP_DEVICE_PROPERTIES_ENDPOINT);
+const char p_UpnpDevicePropertiesSoapAction[] PROGMEM = UPNP_REQUEST_SOAP_ACTION(UPNP_DEVICE_PROPERTIES_SERVICE);
+const char p_UpnpDevicePropertiesActionNs[] PROGMEM = UPNP_REQUEST_ACTION_NS(UPNP_DEVICE_PROPERTIES_SERVICE);
+const char p_UpnpGroupRenderingControlStart[] PROGMEM = UPNP_REQUEST_START(UPNP_GROUP_RENDERING_CONTROL_ENDPOINT);
+const char p_UpnpGroupRenderingControlSoapAction[] PROGMEM = UPNP_REQUEST_SOAP_ACTION(UPNP_GROUP_RENDERING_CONTROL_SERVICE);
+const char p_UpnpGroupRenderingControlActionNs[] PROGMEM = UPNP_REQUEST_ACTION_NS(UPNP_GROUP_RENDERING_CONTROL_SERVICE);
+const char p_UpnpContentDirectoryStart[] PROGMEM = UPNP_REQUEST_START(UPNP_CONTENT_DIRECTORY_ENDPOINT);
+const char p_UpnpContentDirectorySoapAction[] PROGMEM = UPNP_REQUEST_SOAP_ACTION(UPNP_CONTENT_DIRECTORY_SERVICE);
+const char p_UpnpContentDirectoryActionNs[] PROGMEM = UPNP_REQUEST_SERVICE_NS(UPNP_CONTENT_DIRECTORY_SERVICE);
+const char p_UpnpZoneGroupTopologyStart[] PROGMEM = UPNP_REQUEST_START(UPNP_ZONE_GROUP_TOPOLOGY_ENDPOINT);
+const char p_UpnpZoneGroupTopologySoapAction[] PROGMEM = UPNP_REQUEST_SOAP_ACTION(UPNP_ZONE_GROUP_TOPOLOGY_SERVICE);
+const char p_UpnpZoneGroupTopologyActionNs[] PROGMEM = UPNP_REQUEST_SERVICE_NS(UPNP_ZONE_GROUP_TOPOLOGY_SERVICE);
+
+// Indexed by UPnP message type - 1
+const SonosUPnP::RequestTemplate SonosUPnP::requestTemplates[] PROGMEM =
+{
+  {
+    p_UpnpAvTransportStart, p_UpnpAvTransportSoapAction, p_UpnpAvTransportActionNs,
+    sizeof(p_UpnpAvTransportStart) - 1, sizeof(p_UpnpAvTransportSoapAction) - 1, sizeof(p_UpnpAvTransportActionNs) - 1,
+    UPNP_REQUEST_BODY_LEN(UPNP_AV_TRANSPORT_SERVICE)
+  },
+  {
+    p_UpnpRenderingControlStart, p_UpnpRenderingControlSoapAction, p_UpnpRenderingControlActionNs,
+    sizeof(p_UpnpRenderingControlStart) - 1, sizeof(p_UpnpRenderingControlSoapAction) - 1, sizeof(p_UpnpRenderingControlActionNs) - 1,
+    UPNP_REQUEST_BODY_LEN(UPNP_RENDERING_CONTROL_SERVICE)
+  },
+  {
+    p_UpnpDevicePropertiesStart, p_UpnpDevicePropertiesSoapAction, p_UpnpDevicePropertiesActionNs,
+    sizeof(p_UpnpDevicePropertiesStart) - 1, sizeof(p_UpnpDevicePropertiesSoapAction) - 1, sizeof(p_UpnpDevicePropertiesActionNs) - 1,
+    UPNP_REQUEST_BODY_LEN(UPNP_DEVICE_PROPERTIES_SERVICE)
+  },
+  {
+    p_UpnpGroupRenderingControlStart, p_UpnpGroupRenderingControlSoapAction, p_UpnpGroupRenderingControlActionNs,
+    sizeof(p_UpnpGroupRenderingControlStart) - 1, sizeof(p_UpnpGroupRenderingControlSoapAction) - 1, sizeof(p_UpnpGroupRenderingControlActionNs) - 1,
+    UPNP_REQUEST_BODY_LEN(UPNP_GROUP_RENDERING_CONTROL_SERVICE)
+  },
+  {
+    p_UpnpContentDirectoryStart, p_UpnpContentDirectorySoapAction, p_UpnpContentDirectoryActionNs,
+    sizeof(p_UpnpContentDirectoryStart) - 1, sizeof(p_UpnpContentDirectorySoapAction) - 1, sizeof(p_UpnpContentDirectoryActionNs) - 1,
+    UPNP_REQUEST_BODY_LEN_NS(UPNP_REQUEST_SERVICE_NS(UPNP_CONTENT_DIRECTORY_SERVICE))
+  },
+  {
+    p_UpnpZoneGroupTopologyStart, p_UpnpZoneGroupTopologySoapAction, p_UpnpZoneGroupTopologyActionNs,
+    sizeof(p_UpnpZoneGroupTopologyStart) - 1, sizeof(p_UpnpZoneGroupTopologySoapAction) - 1, sizeof(p_UpnpZoneGroupTopologyActionNs) - 1,
+    UPNP_REQUEST_BODY_LEN_NS(UPNP_REQUEST_SERVICE_NS(UPNP_ZONE_GROUP_TOPOLOGY_SERVICE))
+  }
+};
 
 const char p_Play[] PROGMEM = SONOS_TAG_PLAY;
 const char p_SourceRinconTemplate[] PROGMEM = SONOS_SOURCE_RINCON_TEMPLATE;
@@ -47,7 +97,6 @@ const char p_Stop[] PROGMEM = SONOS_TAG_STOP;
 const char p_Pause[] PROGMEM = SONOS_TAG_PAUSE;
 const char p_Previous[] PROGMEM = SONOS_TAG_PREVIOUS;
 const char p_Next[] PROGMEM = SONOS_TAG_NEXT;
-const char p_InstenceId0Tag[] PROGMEM = SONOS_INSTANCE_ID_0_TAG;
 const char p_Seek[] PROGMEM = SONOS_TAG_SEEK;
 const char p_SeekModeTagStart[] PROGMEM = SONOS_SEEK_MODE_TAG_START;
 const char p_SeekModeTagEnd[] PROGMEM = SONOS_SEEK_MODE_TAG_END;
@@ -55,8 +104,22 @@ const char p_TimeFormatTemplate[] PROGMEM = SONOS_TIME_FORMAT_TEMPLATE;
 const char p_SetAVTransportURI[] PROGMEM = SONOS_TAG_SET_AV_TRANSPORT_URI;
 const char p_UriMetaLightStart[] PROGMEM = SONOS_URI_META_LIGHT_START;
 const char p_UriMetaLightEnd[] PROGMEM = SONOS_URI_META_LIGHT_END;
-const char p_RadioMetaFullStart[] PROGMEM = SONOS_RADIO_META_FULL_START;
-const char p_RadioMetaFullEnd[] PROGMEM = SONOS_RADIO_META_FULL_END;
+const char p_MetaStart[] PROGMEM = SONOS_META_START;
+const char p_MetaEnd[] PROGMEM = SONOS_META_END;
+const char p_MetaTagOpen[] PROGMEM = SONOS_META_TAG_OPEN;
+const char p_MetaTagClose[] PROGMEM = SONOS_META_TAG_CLOSE;
+const char p_MetaTagEnd[] PROGMEM = SONOS_META_TAG_END;
+const char p_MetaTitle[] PROGMEM = SONOS_META_TITLE;
+const char p_MetaCreator[] PROGMEM = SONOS_META_CREATOR;
+const char p_MetaAlbum[] PROGMEM = SONOS_META_ALBUM;
+const char p_MetaAlbumArtURI[] PROGMEM = SONOS_META_ALBUM_ART_URI;
+const char p_MetaClass[] PROGMEM = SONOS_META_CLASS;
+const char p_MetaDesc[] PROGMEM = SONOS_META_DESC;
+const char p_MetaDescStart[] PROGMEM = SONOS_META_DESC_START;
+const char p_MetaEscapedAmp[] PROGMEM = SONOS_META_ESCAPED_AMP;
+const char p_MetaEscapedLt[] PROGMEM = SONOS_META_ESCAPED_LT;
+const char p_MetaEscapedGt[] PROGMEM = SONOS_META_ESCAPED_GT;
+const char p_MetaEscapedQuot[] PROGMEM = SONOS_META_ESCAPED_QUOT;
 const char p_BecomeCoordinatorOfStandaloneGroup[] PROGMEM = SONOS_TAG_BECOME_COORDINATOR_OF_STANDALONE_GROUP;
 const char p_SetLEDState[] PROGMEM = SONOS_TAG_SET_LED_STATE;
 
@@ -65,12 +128,15 @@ const char p_SavedQueues[] PROGMEM = SONOS_SAVED_QUEUES;
 const char p_RemoveAllTracksFromQueue[] PROGMEM = SONOS_TAG_REMOVE_ALL_TRACKS_FROM_QUEUE;
 const char p_PlaylistMetaLightStart[] PROGMEM = SONOS_PLAYLIST_META_LIGHT_START;
 const char p_PlaylistMetaLightEnd[] PROGMEM = SONOS_PLAYLIST_META_LIGHT_END;
+const char p_QueueMetaStart[] PROGMEM = SONOS_QUEUE_META_START;
+const char p_QueueMetaEnd[] PROGMEM = SONOS_QUEUE_META_END;
 
 const char p_GetPositionInfoA[] PROGMEM = SONOS_TAG_GET_POSITION_INFO;
 const char p_GetPositionInfoR[] PROGMEM = SONOS_TAG_GET_POSITION_INFO_RESPONSE;
 const char p_Track[] PROGMEM = SONOS_TAG_TRACK;
 const char p_TrackDuration[] PROGMEM = SONOS_TAG_TRACK_DURATION;
 const char p_TrackURI[] PROGMEM = SONOS_TAG_TRACK_URI;
+const char p_TrackMetaData[] PROGMEM = SONOS_TAG_TRACK_META_DATA;
 const char p_RelTime[] PROGMEM = SONOS_TAG_REL_TIME;
 
 const char p_GetMuteA[] PROGMEM = SONOS_TAG_GET_MUTE;
@@ -92,6 +158,22 @@ const char p_GetLoudnessA[] PROGMEM = SONOS_TAG_GET_LOUDNESS;
 const char p_GetLoudnessR[] PROGMEM = SONOS_TAG_GET_LOUDNESS_RESPONSE;
 const char p_CurrentLoudness[] PROGMEM = SONOS_TAG_CURRENT_LOUDNESS;
 
+const char p_Browse[] PROGMEM = SONOS_TAG_BROWSE;
+const char p_BrowseStart[] PROGMEM = SONOS_BROWSE_START;
+const char p_BrowseMid[] PROGMEM = SONOS_BROWSE_MID;
+const char p_BrowseEnd[] PROGMEM = SONOS_BROWSE_END;
+const char p_Result[] PROGMEM = SONOS_TAG_RESULT;
+const char p_TotalMatches[] PROGMEM = SONOS_TAG_TOTAL_MATCHES;
+const char p_DidlItem[] PROGMEM = SONOS_DIDL_ITEM;
+const char p_DidlContainer[] PROGMEM = SONOS_DIDL_CONTAINER;
+const char p_DidlId[] PROGMEM = SONOS_DIDL_ID;
+const char p_DidlTitle[] PROGMEM = SONOS_DIDL_TITLE;
+const char p_DidlCreator[] PROGMEM = SONOS_DIDL_CREATOR;
+const char p_DidlAlbum[] PROGMEM = SONOS_DIDL_ALBUM;
+const char p_DidlRes[] PROGMEM = SONOS_DIDL_RES;
+const char p_DidlAlbumArtURI[] PROGMEM = SONOS_DIDL_ALBUM_ART_URI;
+const char p_DidlStreamContent[] PROGMEM = SONOS_DIDL_STREAM_CONTENT;
+
 const char p_SetMute[] PROGMEM = SONOS_TAG_SET_MUTE;
 const char p_SetVolume[] PROGMEM = SONOS_TAG_SET_VOLUME;
 const char p_SetBass[] PROGMEM = SONOS_TAG_SET_BASS;
@@ -99,6 +181,16 @@ const char p_SetTreble[] PROGMEM = SONOS_TAG_SET_TREBLE;
 const char p_SetLoudness[] PROGMEM = SONOS_TAG_SET_LOUDNESS;
 const char p_ChannelTagStart[] PROGMEM = SONOS_CHANNEL_TAG_START;
 const char p_ChannelTagEnd[] PROGMEM = SONOS_CHANNEL_TAG_END;
+const char p_SetGroupVolume[] PROGMEM = SONOS_TAG_SET_GROUP_VOLUME;
+const char p_SetRelativeGroupVolume[] PROGMEM = SONOS_TAG_SET_RELATIVE_GROUP_VOLUME;
+const char p_SetRelativeVolume[] PROGMEM = SONOS_TAG_SET_RELATIVE_VOLUME;
+const char p_SetRelativeVolumeR[] PROGMEM = SONOS_TAG_SET_RELATIVE_VOLUME_RESPONSE;
+const char p_NewVolume[] PROGMEM = SONOS_TAG_NEW_VOLUME;
+const char p_RampToVolume[] PROGMEM = SONOS_TAG_RAMP_TO_VOLUME;
+const char p_RampToVolumeR[] PROGMEM = SONOS_TAG_RAMP_TO_VOLUME_RESPONSE;
+const char p_RampTime[] PROGMEM = SONOS_TAG_RAMP_TIME;
+const char p_RampTagStart[] PROGMEM = SONOS_RAMP_TAG_START;
+const char p_RampTagEnd[] PROGMEM = SONOS_RAMP_TAG_END;
 
 const char p_GetTransportSettingsA[] PROGMEM = SONOS_TAG_GET_TRANSPORT_SETTINGS;
 const char p_GetTransportSettingsR[] PROGMEM = SONOS_TAG_GET_TRANSPORT_SETTINGS_RESPONSE;
@@ -109,36 +201,299 @@ const char p_GetTransportInfoA[] PROGMEM = SONOS_TAG_GET_TRANSPORT_INFO;
 const char p_GetTransportInfoR[] PROGMEM = SONOS_TAG_GET_TRANSPORT_INFO_RESPONSE;
 const char p_CurrentTransportState[] PROGMEM = SONOS_TAG_CURRENT_TRANSPORT_STATE;
 
-SonosUPnP::SonosUPnP(EthernetClient client, void (*ethernetErrCallback)(void))
+SonosUPnP::SonosUPnP(SonosClient client, void (*ethernetErrCallback)(void))
 {
   #ifndef SONOS_WRITE_ONLY_MODE
   this->xPath = MicroXPath_P();
+  this->topology = 0;
+  for (uint8_t i = 0; i < SONOS_CACHE_FIELDS; i++)
+  {
+    this->cacheTTL[i] = 0;
+  }
+  clearCache();
+  resetCacheStats();
   #endif
-  this->ethClient = client;
+  for (uint8_t i = 0; i < UPNP_MAX_CONNECTIONS; i++)
+  {
+    this->connections[i].state = SONOS_ASYNC_IDLE;
+    this->connections[i].lastUsed = 0;
+    this->connections[i].owned = false;
+    this->connections[i].detached = false;
+  }
+  this->connections[0].client = client;
+  this->connection = 0;
+  this->ethClient = &connections[0].client;
+  this->keepAlive = false;
+  this->earlyAbort = false;
+  this->fireAndForget = false;
+  this->retries = 0;
+  this->retryBackoff = SONOS_RETRY_BACKOFF_MS;
+  this->lastResult.error = SONOS_ERROR_NONE;
+  this->lastResult.httpStatus = 0;
+  this->lastResult.upnpError = 0;
+  this->batch = 0;
+  this->meta = 0;
+  this->writeLength = 0;
+  this->readPosition = 0;
+  this->readLength = 0;
   this->ethernetErrCallback = ethernetErrCallback;
+  this->asyncCallback = 0;
+  #ifdef SONOS_STATS_MODE
+  this->traceCallback = 0;
+  resetStats();
+  #endif
+}
+
+void SonosUPnP::setKeepAlive(bool keepAlive)
+{
+  if (!keepAlive) closeConnections();
+  this->keepAlive = keepAlive;
+}
+
+void SonosUPnP::setEarlyAbort(bool earlyAbort)
+{
+  // Stop reading a response as soon as the wanted values are found; a kept
+  // connection skips the rest of the body when it is next used
+  this->earlyAbort = earlyAbort;
+}
+
+void SonosUPnP::setFireAndForget(bool fireAndForget)
+{
+  // Setters return as soon as the request is written; the response is read
+  // by poll() or by the next request and reported to the async callback
+  this->fireAndForget = fireAndForget;
+}
+
+void SonosUPnP::closeConnections()
+{
+  // Fire-and-forget requests are read to the end first, so their outcome still
+  // reaches the callback and their sockets are freed; begin* requests are left
+  for (int8_t handle = 0; handle < UPNP_MAX_CONNECTIONS; handle++)
+  {
+    while (connections[handle].detached && getAsyncStatus(handle) == SONOS_ASYNC_PENDING)
+    {
+      pollAsync(handle);
+      yield();
+    }
+    if (connections[handle].state == SONOS_ASYNC_IDLE && connections[handle].client) connections[handle].client.stop();
+  }
+}
+
+void SonosUPnP::setRetry(uint8_t retries, uint16_t backoff)
+{
+  // Failed requests are sent again up to retries times, waiting backoff ms
+  // before the first retry and twice as long before each next one
+  this->retries = min(retries, (uint8_t)SONOS_RETRY_MAX);
+  this->retryBackoff = backoff;
+}
+
+const SonosResult *SonosUPnP::getLastResult()
+{
+  // Outcome of the last blocking request: a SONOS_ERROR_*, the HTTP status
+  // and the UPnP error code of a SOAP fault, 0 when there was none
+  return &lastResult;
+}
+
+uint8_t SonosUPnP::getLastError()
+{
+  return lastResult.error;
+}
+
+void SonosUPnP::setAsyncCallback(void (*asyncCallback)(int8_t handle, IPAddress speakerIP, uint8_t request, bool success, int32_t value))
+{
+  this->asyncCallback = asyncCallback;
+}
+
+bool SonosUPnP::poll()
+{
+  bool pending = false;
+  for (int8_t handle = 0; handle < UPNP_MAX_CONNECTIONS; handle++)
+  {
+    if (getAsyncStatus(handle) == SONOS_ASYNC_PENDING)
+    {
+      pollAsync(handle);
+      pending |= getAsyncStatus(handle) == SONOS_ASYNC_PENDING;
+    }
+  }
+  return pending;
+}
+
+uint8_t SonosUPnP::getAsyncStatus(int8_t handle)
+{
+  if (handle < 0 || handle >= UPNP_MAX_CONNECTIONS) return SONOS_ASYNC_IDLE;
+  uint8_t state = connections[handle].state;
+  return state > SONOS_ASYNC_FAILED ? SONOS_ASYNC_PENDING : state;
+}
+
+int32_t SonosUPnP::endAsync(int8_t handle)
+{
+  // Returns the result of a finished request and frees its connection
+  uint8_t status = getAsyncStatus(handle);
+  if (status != SONOS_ASYNC_DONE && status != SONOS_ASYNC_FAILED) return 0;
+  int32_t value = status == SONOS_ASYNC_DONE ? convertAsyncResult(&connections[handle]) : 0;
+  connections[handle].state = SONOS_ASYNC_IDLE;
+  return value;
+}
+
+const SonosResult *SonosUPnP::getAsyncResult(int8_t handle)
+{
+  // Stays valid until the connection is used for another request
+  if (handle < 0 || handle >= UPNP_MAX_CONNECTIONS) return 0;
+  return &connections[handle].requestResult;
+}
+
+int8_t SonosUPnP::beginPlay(IPAddress speakerIP)
+{
+  return beginAsync(speakerIP, SONOS_ASYNC_SET, UPNP_AV_TRANSPORT, p_Play, SONOS_TAG_SPEED, "1", 0, 0, "", 0, 0);
+}
+
+int8_t SonosUPnP::beginPause(IPAddress speakerIP)
+{
+  return beginAsync(speakerIP, SONOS_ASYNC_SET, UPNP_AV_TRANSPORT, p_Pause, "", "", 0, 0, "", 0, 0);
+}
+
+int8_t SonosUPnP::beginStop(IPAddress speakerIP)
+{
+  return beginAsync(speakerIP, SONOS_ASYNC_SET, UPNP_AV_TRANSPORT, p_Stop, "", "", 0, 0, "", 0, 0);
+}
+
+int8_t SonosUPnP::beginSkip(IPAddress speakerIP, uint8_t direction)
+{
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_SET, UPNP_AV_TRANSPORT, direction == SONOS_DIRECTION_FORWARD ? p_Next : p_Previous,
+    "", "", 0, 0, "", 0, 0);
+}
+
+int8_t SonosUPnP::beginSetMute(IPAddress speakerIP, bool state)
+{
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_SET, UPNP_RENDERING_CONTROL, p_SetMute,
+    SONOS_TAG_DESIRED_MUTE, state ? "1" : "0", p_ChannelTagStart, p_ChannelTagEnd, SONOS_CHANNEL_MASTER, 0, 0);
+}
+
+int8_t SonosUPnP::beginSetVolume(IPAddress speakerIP, uint8_t volume)
+{
+  if (volume > 100) volume = 100;
+  char volumeChar[4];
+  itoa(volume, volumeChar, 10);
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_SET, UPNP_RENDERING_CONTROL, p_SetVolume,
+    SONOS_TAG_DESIRED_VOLUME, volumeChar, p_ChannelTagStart, p_ChannelTagEnd, SONOS_CHANNEL_MASTER, 0, 0);
+}
+
+int8_t SonosUPnP::beginSetBass(IPAddress speakerIP, int8_t bass)
+{
+  bass = constrain(bass, -10, 10);
+  char bassChar[4];
+  itoa(bass, bassChar, 10);
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_SET, UPNP_RENDERING_CONTROL, p_SetBass,
+    SONOS_TAG_DESIRED_BASS, bassChar, 0, 0, "", 0, 0);
+}
+
+int8_t SonosUPnP::beginSetTreble(IPAddress speakerIP, int8_t treble)
+{
+  treble = constrain(treble, -10, 10);
+  char trebleChar[4];
+  itoa(treble, trebleChar, 10);
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_SET, UPNP_RENDERING_CONTROL, p_SetTreble,
+    SONOS_TAG_DESIRED_TREBLE, trebleChar, 0, 0, "", 0, 0);
+}
+
+int8_t SonosUPnP::beginSetLoudness(IPAddress speakerIP, bool state)
+{
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_SET, UPNP_RENDERING_CONTROL, p_SetLoudness,
+    SONOS_TAG_DESIRED_LOUDNESS, state ? "1" : "0", p_ChannelTagStart, p_ChannelTagEnd, SONOS_CHANNEL_MASTER, 0, 0);
+}
+
+int8_t SonosUPnP::beginSetRelativeVolume(IPAddress speakerIP, int8_t adjustment)
+{
+  // Ends with the new volume as result
+  adjustment = constrain(adjustment, -100, 100);
+  char adjustmentChar[5];
+  itoa(adjustment, adjustmentChar, 10);
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_SET_RELATIVE_VOLUME, UPNP_RENDERING_CONTROL, p_SetRelativeVolume,
+    SONOS_TAG_ADJUSTMENT, adjustmentChar, p_ChannelTagStart, p_ChannelTagEnd, SONOS_CHANNEL_MASTER,
+    p_SetRelativeVolumeR, p_NewVolume);
+}
+
+int8_t SonosUPnP::beginRampToVolume(IPAddress speakerIP, uint8_t volume, uint8_t rampType)
+{
+  // Ends with the number of seconds the speaker will take to ramp as result
+  if (volume > 100) volume = 100;
+  char volumeChar[4];
+  itoa(volume, volumeChar, 10);
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_RAMP_TO_VOLUME, UPNP_RENDERING_CONTROL, p_RampToVolume,
+    SONOS_TAG_DESIRED_VOLUME, volumeChar, p_RampTagStart, p_RampTagEnd, getRampTypeValue(rampType),
+    p_RampToVolumeR, p_RampTime);
+}
+
+uint8_t SonosUPnP::playMany(const IPAddress *speakerIPs, uint8_t count, bool *results)
+{
+  return fanOut(speakerIPs, count, results, UPNP_AV_TRANSPORT, p_Play, SONOS_TAG_SPEED, "1", 0, 0, "");
+}
+
+uint8_t SonosUPnP::pauseMany(const IPAddress *speakerIPs, uint8_t count, bool *results)
+{
+  return fanOut(speakerIPs, count, results, UPNP_AV_TRANSPORT, p_Pause, "", "", 0, 0, "");
+}
+
+uint8_t SonosUPnP::stopMany(const IPAddress *speakerIPs, uint8_t count, bool *results)
+{
+  return fanOut(speakerIPs, count, results, UPNP_AV_TRANSPORT, p_Stop, "", "", 0, 0, "");
+}
+
+uint8_t SonosUPnP::setMuteMany(const IPAddress *speakerIPs, uint8_t count, bool state, bool *results)
+{
+  return fanOut(
+    speakerIPs, count, results, UPNP_RENDERING_CONTROL, p_SetMute,
+    SONOS_TAG_DESIRED_MUTE, state ? "1" : "0", p_ChannelTagStart, p_ChannelTagEnd, SONOS_CHANNEL_MASTER);
+}
+
+uint8_t SonosUPnP::setVolumeMany(const IPAddress *speakerIPs, uint8_t count, uint8_t volume, bool *results)
+{
+  if (volume > 100) volume = 100;
+  char volumeChar[4];
+  itoa(volume, volumeChar, 10);
+  return fanOut(
+    speakerIPs, count, results, UPNP_RENDERING_CONTROL, p_SetVolume,
+    SONOS_TAG_DESIRED_VOLUME, volumeChar, p_ChannelTagStart, p_ChannelTagEnd, SONOS_CHANNEL_MASTER);
 }
 
 
-void SonosUPnP::setAVTransportURI(IPAddress speakerIP, const char *scheme, const char *address)
+bool SonosUPnP::setAVTransportURI(IPAddress speakerIP, const char *scheme, const char *address)
+{
+  return setAVTransportURI(speakerIP, scheme, address, p_UriMetaLightStart, p_UriMetaLightEnd, "");
+}
+
+bool SonosUPnP::setAVTransportURI(IPAddress speakerIP, const char *scheme, const char *address, const MetaData *meta)
 {
-  setAVTransportURI(speakerIP, scheme, address, p_UriMetaLightStart, p_UriMetaLightEnd, "");
+  // Title, artist and art for the player, written escaped as DIDL-Lite
+  this->meta = meta;
+  bool success = setAVTransportURI(speakerIP, scheme, address, p_UriMetaLightStart, p_UriMetaLightEnd, "");
+  this->meta = 0;
+  return success;
 }
 
-void SonosUPnP::seekTrack(IPAddress speakerIP, uint16_t index)
+bool SonosUPnP::seekTrack(IPAddress speakerIP, uint16_t index)
 {
   char indexChar[6];
   itoa(index, indexChar, 10);
-  seek(speakerIP, SONOS_SEEK_MODE_TRACK_NR, indexChar);
+  return seek(speakerIP, SONOS_SEEK_MODE_TRACK_NR, indexChar);
 }
 
-void SonosUPnP::seekTime(IPAddress speakerIP, uint8_t hour, uint8_t minute, uint8_t second)
+bool SonosUPnP::seekTime(IPAddress speakerIP, uint8_t hour, uint8_t minute, uint8_t second)
 {
   char time[11];
   sprintf_P(time, p_TimeFormatTemplate, hour, minute, second);
-  seek(speakerIP, SONOS_SEEK_MODE_REL_TIME, time);
+  return seek(speakerIP, SONOS_SEEK_MODE_REL_TIME, time);
 }
 
-void SonosUPnP::setPlayMode(IPAddress speakerIP, uint8_t playMode)
+bool SonosUPnP::setPlayMode(IPAddress speakerIP, uint8_t playMode)
 {
   const char *playModeValue;
   switch (playMode)
@@ -156,220 +511,279 @@ void SonosUPnP::setPlayMode(IPAddress speakerIP, uint8_t playMode)
       playModeValue = SONOS_PLAY_MODE_NORMAL_VALUE;
       break;
   }
-  upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_SetPlayMode, SONOS_TAG_NEW_PLAY_MODE, playModeValue);
+  return upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_SetPlayMode, SONOS_TAG_NEW_PLAY_MODE, playModeValue);
 }
 
-void SonosUPnP::play(IPAddress speakerIP)
+bool SonosUPnP::play(IPAddress speakerIP)
 {
-  upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_Play, SONOS_TAG_SPEED, "1");
+  return upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_Play, SONOS_TAG_SPEED, "1");
 }
 
-void SonosUPnP::playFile(IPAddress speakerIP, const char *path)
+bool SonosUPnP::playFile(IPAddress speakerIP, const char *path)
 {
-  setAVTransportURI(speakerIP, SONOS_SOURCE_FILE_SCHEME, path);
-  play(speakerIP);
+  return setAVTransportURI(speakerIP, SONOS_SOURCE_FILE_SCHEME, path) && play(speakerIP);
 }
 
-void SonosUPnP::playHttp(IPAddress speakerIP, const char *address)
+bool SonosUPnP::playHttp(IPAddress speakerIP, const char *address)
 {
-  setAVTransportURI(speakerIP, SONOS_SOURCE_HTTP_SCHEME, address);
-  play(speakerIP);
+  return setAVTransportURI(speakerIP, SONOS_SOURCE_HTTP_SCHEME, address) && play(speakerIP);
 }
 
-void SonosUPnP::playRadio(IPAddress speakerIP, const char *address, const char *title)
+bool SonosUPnP::playRadio(IPAddress speakerIP, const char *address, const char *title)
 {
-  setAVTransportURI(speakerIP, SONOS_SOURCE_RADIO_SCHEME, address, p_RadioMetaFullStart, p_RadioMetaFullEnd, title);
-  play(speakerIP);
+  MetaData radioMeta = { title, 0, 0, 0, SONOS_META_CLASS_RADIO, SONOS_META_DESC_RADIO };
+  return setAVTransportURI(speakerIP, SONOS_SOURCE_RADIO_SCHEME, address, &radioMeta) && play(speakerIP);
 }
 
-void SonosUPnP::playLineIn(IPAddress speakerIP, const char *speakerID)
+bool SonosUPnP::playLineIn(IPAddress speakerIP, const char *speakerID)
 {
   char address[30];
   sprintf_P(address, p_SourceRinconTemplate, speakerID, UPNP_PORT, "");
-  setAVTransportURI(speakerIP, SONOS_SOURCE_LINEIN_SCHEME, address);
-  play(speakerIP);
+  return setAVTransportURI(speakerIP, SONOS_SOURCE_LINEIN_SCHEME, address) && play(speakerIP);
 }
 
-void SonosUPnP::playQueue(IPAddress speakerIP, const char *speakerID)
+bool SonosUPnP::playQueue(IPAddress speakerIP, const char *speakerID)
 {
   char address[30];
   sprintf_P(address, p_SourceRinconTemplate, speakerID, UPNP_PORT, "#0");
-  setAVTransportURI(speakerIP, SONOS_SOURCE_QUEUE_SCHEME, address);
-  play(speakerIP);
+  return setAVTransportURI(speakerIP, SONOS_SOURCE_QUEUE_SCHEME, address) && play(speakerIP);
 }
 
-void SonosUPnP::playConnectToMaster(IPAddress speakerIP, const char *masterSpeakerID)
+bool SonosUPnP::playConnectToMaster(IPAddress speakerIP, const char *masterSpeakerID)
 {
   char address[30];
   sprintf_P(address, p_SourceRinconTemplate, masterSpeakerID, UPNP_PORT, "");
-  setAVTransportURI(speakerIP, SONOS_SOURCE_MASTER_SCHEME, address);
+  return setAVTransportURI(speakerIP, SONOS_SOURCE_MASTER_SCHEME, address);
 }
 
-void SonosUPnP::disconnectFromMaster(IPAddress speakerIP)
+bool SonosUPnP::disconnectFromMaster(IPAddress speakerIP)
 {
-  upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_BecomeCoordinatorOfStandaloneGroup);
+  return upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_BecomeCoordinatorOfStandaloneGroup);
 }
 
-void SonosUPnP::stop(IPAddress speakerIP)
+bool SonosUPnP::stop(IPAddress speakerIP)
 {
-  upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_Stop);
+  return upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_Stop);
 }
 
-void SonosUPnP::pause(IPAddress speakerIP)
+bool SonosUPnP::pause(IPAddress speakerIP)
 {
-  upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_Pause);
+  return upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_Pause);
 }
 
-void SonosUPnP::skip(IPAddress speakerIP, uint8_t direction)
+bool SonosUPnP::skip(IPAddress speakerIP, uint8_t direction)
 {
-  upnpSet(
+  return upnpSet(
     speakerIP, UPNP_AV_TRANSPORT, direction == SONOS_DIRECTION_FORWARD ? p_Next : p_Previous);
 }
 
-void SonosUPnP::setMute(IPAddress speakerIP, bool state)
+bool SonosUPnP::setMute(IPAddress speakerIP, bool state)
 {
-  upnpSet(
+  return upnpSet(
     speakerIP, UPNP_RENDERING_CONTROL, p_SetMute,
     SONOS_TAG_DESIRED_MUTE, state ? "1" : "0", "", p_ChannelTagStart, p_ChannelTagEnd, SONOS_CHANNEL_MASTER);
 }
 
-void SonosUPnP::setVolume(IPAddress speakerIP, uint8_t volume)
+bool SonosUPnP::setVolume(IPAddress speakerIP, uint8_t volume)
 {
-  setVolume(speakerIP, volume, SONOS_CHANNEL_MASTER);
+  return setVolume(speakerIP, volume, SONOS_CHANNEL_MASTER);
 }
 
-void SonosUPnP::setVolume(IPAddress speakerIP, uint8_t volume, const char *channel)
+bool SonosUPnP::setVolume(IPAddress speakerIP, uint8_t volume, const char *channel)
 {
   if (volume > 100) volume = 100;
   char volumeChar[4];
   itoa(volume, volumeChar, 10);
-  upnpSet(
+  return upnpSet(
     speakerIP, UPNP_RENDERING_CONTROL, p_SetVolume,
     SONOS_TAG_DESIRED_VOLUME, volumeChar, "", p_ChannelTagStart, p_ChannelTagEnd, channel);
 }
 
-void SonosUPnP::setBass(IPAddress speakerIP, int8_t bass)
+bool SonosUPnP::setBass(IPAddress speakerIP, int8_t bass)
 {
   bass = constrain(bass, -10, 10);
   char bassChar[4];
   itoa(bass, bassChar, 10);
-  upnpSet(
+  return upnpSet(
     speakerIP, UPNP_RENDERING_CONTROL, p_SetBass,
     SONOS_TAG_DESIRED_BASS, bassChar);
 }
 
-void SonosUPnP::setTreble(IPAddress speakerIP, int8_t treble)
+bool SonosUPnP::setTreble(IPAddress speakerIP, int8_t treble)
 {
   treble = constrain(treble, -10, 10);
   char trebleChar[4];
   itoa(treble, trebleChar, 10);
-  upnpSet(
+  return upnpSet(
     speakerIP, UPNP_RENDERING_CONTROL, p_SetTreble,
     SONOS_TAG_DESIRED_TREBLE, trebleChar);
 }
 
-void SonosUPnP::setLoudness(IPAddress speakerIP, bool state)
+bool SonosUPnP::setLoudness(IPAddress speakerIP, bool state)
 {
-  upnpSet(
+  return upnpSet(
     speakerIP, UPNP_RENDERING_CONTROL, p_SetLoudness,
     SONOS_TAG_DESIRED_LOUDNESS, state ? "1" : "0", "", p_ChannelTagStart, p_ChannelTagEnd, SONOS_CHANNEL_MASTER);
 }
 
-void SonosUPnP::setStatusLight(IPAddress speakerIP, bool state)
+bool SonosUPnP::setGroupVolume(IPAddress coordinatorIP, uint8_t volume)
+{
+  if (volume > 100) volume = 100;
+  char volumeChar[4];
+  itoa(volume, volumeChar, 10);
+  return upnpSet(
+    coordinatorIP, UPNP_GROUP_RENDERING_CONTROL, p_SetGroupVolume,
+    SONOS_TAG_DESIRED_VOLUME, volumeChar);
+}
+
+bool SonosUPnP::setRelativeGroupVolume(IPAddress coordinatorIP, int8_t adjustment)
+{
+  adjustment = constrain(adjustment, -100, 100);
+  char adjustmentChar[5];
+  itoa(adjustment, adjustmentChar, 10);
+  return upnpSet(
+    coordinatorIP, UPNP_GROUP_RENDERING_CONTROL, p_SetRelativeGroupVolume,
+    SONOS_TAG_ADJUSTMENT, adjustmentChar);
+}
+
+bool SonosUPnP::setRelativeVolume(IPAddress speakerIP, int8_t adjustment)
+{
+  adjustment = constrain(adjustment, -100, 100);
+  char adjustmentChar[5];
+  itoa(adjustment, adjustmentChar, 10);
+  return upnpSet(
+    speakerIP, UPNP_RENDERING_CONTROL, p_SetRelativeVolume,
+    SONOS_TAG_ADJUSTMENT, adjustmentChar, "", p_ChannelTagStart, p_ChannelTagEnd, SONOS_CHANNEL_MASTER);
+}
+
+bool SonosUPnP::rampToVolume(IPAddress speakerIP, uint8_t volume, uint8_t rampType)
+{
+  // The speaker ramps on its own, the call returns when the ramp has started
+  if (volume > 100) volume = 100;
+  char volumeChar[4];
+  itoa(volume, volumeChar, 10);
+  return upnpSet(
+    speakerIP, UPNP_RENDERING_CONTROL, p_RampToVolume,
+    SONOS_TAG_DESIRED_VOLUME, volumeChar, "", p_RampTagStart, p_RampTagEnd, getRampTypeValue(rampType));
+}
+
+bool SonosUPnP::setStatusLight(IPAddress speakerIP, bool state)
 {
-  upnpSet(
+  return upnpSet(
     speakerIP, UPNP_DEVICE_PROPERTIES, p_SetLEDState,
     SONOS_TAG_DESIRED_LED_STATE, state ? "On" : "Off");
 }
 
-void SonosUPnP::addPlaylistToQueue(IPAddress speakerIP, uint16_t playlistIndex)
+bool SonosUPnP::addPlaylistToQueue(IPAddress speakerIP, uint16_t playlistIndex)
 {
   char path[45];
   sprintf_P(path, p_SavedQueues, playlistIndex);
-  addTrackToQueue(speakerIP, "", path);
+  return addTrackToQueue(speakerIP, "", path);
 }
 
-void SonosUPnP::addTrackToQueue(IPAddress speakerIP, const char *scheme, const char *address)
+bool SonosUPnP::addTrackToQueue(IPAddress speakerIP, const char *scheme, const char *address)
 {
-  upnpSet(
+  return upnpSet(
     speakerIP, UPNP_AV_TRANSPORT, p_AddURIToQueue,
     SONOS_TAG_ENQUEUED_URI, scheme, address, p_PlaylistMetaLightStart, p_PlaylistMetaLightEnd, "");
 }
 
-void SonosUPnP::removeAllTracksFromQueue(IPAddress speakerIP)
+bool SonosUPnP::addTrackToQueue(IPAddress speakerIP, const char *scheme, const char *address, const MetaData *meta)
+{
+  this->meta = meta;
+  bool success = upnpSet(
+    speakerIP, UPNP_AV_TRANSPORT, p_AddURIToQueue,
+    SONOS_TAG_ENQUEUED_URI, scheme, address, p_QueueMetaStart, p_QueueMetaEnd, "");
+  this->meta = 0;
+  return success;
+}
+
+bool SonosUPnP::removeAllTracksFromQueue(IPAddress speakerIP)
 {
-  upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_RemoveAllTracksFromQueue);
+  return upnpSet(speakerIP, UPNP_AV_TRANSPORT, p_RemoveAllTracksFromQueue);
 }
 
 
 #ifndef SONOS_WRITE_ONLY_MODE
 
-void SonosUPnP::setRepeat(IPAddress speakerIP, bool repeat)
+bool SonosUPnP::setRepeat(IPAddress speakerIP, bool repeat)
 {
-  bool current = getRepeat(speakerIP);
-  if (repeat != current)
+  uint8_t playMode = getPlayMode(speakerIP);
+  if (repeat != (bool)(playMode & SONOS_PLAY_MODE_REPEAT))
   {
-    setPlayMode(speakerIP, current ^ SONOS_PLAY_MODE_REPEAT);
+    return setPlayMode(speakerIP, playMode ^ SONOS_PLAY_MODE_REPEAT);
   }
+  return true;
 }
 
-void SonosUPnP::setShuffle(IPAddress speakerIP, bool shuffle)
+bool SonosUPnP::setShuffle(IPAddress speakerIP, bool shuffle)
 {
-  bool current = getShuffle(speakerIP);
-  if (shuffle != current)
+  uint8_t playMode = getPlayMode(speakerIP);
+  if (shuffle != (bool)(playMode & SONOS_PLAY_MODE_SHUFFLE))
   {
-    setPlayMode(speakerIP, current ^ SONOS_PLAY_MODE_SHUFFLE);
+    return setPlayMode(speakerIP, playMode ^ SONOS_PLAY_MODE_SHUFFLE);
   }
+  return true;
 }
 
-void SonosUPnP::toggleRepeat(IPAddress speakerIP)
+bool SonosUPnP::toggleRepeat(IPAddress speakerIP)
 {
-  setPlayMode(speakerIP, getPlayMode(speakerIP) ^ SONOS_PLAY_MODE_REPEAT);
+  return setPlayMode(speakerIP, getPlayMode(speakerIP) ^ SONOS_PLAY_MODE_REPEAT);
 }
 
-void SonosUPnP::toggleShuffle(IPAddress speakerIP)
+bool SonosUPnP::toggleShuffle(IPAddress speakerIP)
 {
-  setPlayMode(speakerIP, getPlayMode(speakerIP) ^ SONOS_PLAY_MODE_SHUFFLE);
+  return setPlayMode(speakerIP, getPlayMode(speakerIP) ^ SONOS_PLAY_MODE_SHUFFLE);
 }
 
-void SonosUPnP::togglePause(IPAddress speakerIP)
+bool SonosUPnP::togglePause(IPAddress speakerIP)
 {
+  // Returns false when stopped, there is nothing to toggle
   uint8_t state = getState(speakerIP);
   if (state == SONOS_STATE_PLAYING)
   {
-    pause(speakerIP);
+    return pause(speakerIP);
   }
   else if (state == SONOS_STATE_PAUSED)
   {
-    play(speakerIP);
+    return play(speakerIP);
   }
+  return false;
 }
 
-void SonosUPnP::toggleMute(IPAddress speakerIP)
+bool SonosUPnP::toggleMute(IPAddress speakerIP)
 {
-  setMute(speakerIP, !getMute(speakerIP));
+  return setMute(speakerIP, !getMute(speakerIP));
 }
 
-void SonosUPnP::toggleLoudness(IPAddress speakerIP)
+bool SonosUPnP::toggleLoudness(IPAddress speakerIP)
 {
-  setLoudness(speakerIP, !getLoudness(speakerIP));
+  return setLoudness(speakerIP, !getLoudness(speakerIP));
 }
 
 uint8_t SonosUPnP::getState(IPAddress speakerIP)
 {
+  int8_t cached;
+  if (cacheGet(speakerIP, SONOS_CACHE_STATE, &cached)) return cached;
   PGM_P path[] = { p_SoapEnvelope, p_SoapBody, p_GetTransportInfoR, p_CurrentTransportState };
   //             { p_SoapEnvelope, p_SoapBody, p_GetTransportInfoR, p_CurrentSpeed };
   char result[sizeof(SONOS_STATE_PAUSED_VALUE)] = "";
-  upnpGetString(speakerIP, UPNP_AV_TRANSPORT, p_GetTransportInfoA, "", "", path, 4, result, sizeof(result));
-  return convertState(result);
+  bool found = upnpGetString(speakerIP, UPNP_AV_TRANSPORT, p_GetTransportInfoA, "", "", path, 4, result, sizeof(result));
+  uint8_t state = convertState(result);
+  if (found) cacheSet(speakerIP, SONOS_CACHE_STATE, state);
+  return state;
 }
 
 uint8_t SonosUPnP::getPlayMode(IPAddress speakerIP)
 {
+  int8_t cached;
+  if (cacheGet(speakerIP, SONOS_CACHE_PLAY_MODE, &cached)) return cached;
   PGM_P path[] = { p_SoapEnvelope, p_SoapBody, p_GetTransportSettingsR, p_PlayMode };
   char result[sizeof(SONOS_PLAY_MODE_SHUFFLE_VALUE)] = "";
-  upnpGetString(speakerIP, UPNP_AV_TRANSPORT, p_GetTransportSettingsA, "", "", path, 4, result, sizeof(result));
-  return convertPlayMode(result);
+  bool found = upnpGetString(speakerIP, UPNP_AV_TRANSPORT, p_GetTransportSettingsA, "", "", path, 4, result, sizeof(result));
+  uint8_t playMode = convertPlayMode(result);
+  if (found) cacheSet(speakerIP, SONOS_CACHE_PLAY_MODE, playMode);
+  return playMode;
 }
 
 bool SonosUPnP::getRepeat(IPAddress speakerIP)
@@ -384,30 +798,48 @@ bool SonosUPnP::getShuffle(IPAddress speakerIP)
 
 TrackInfo SonosUPnP::getTrackInfo(IPAddress speakerIP, char *uriBuffer, size_t uriBufferSize)
 {
-  TrackInfo trackInfo;
-  if (upnpPost(speakerIP, UPNP_AV_TRANSPORT, p_GetPositionInfoA, "", "", "", 0, 0, ""))
+  return getTrackInfo(speakerIP, uriBuffer, uriBufferSize, 0);
+}
+
+TrackInfo SonosUPnP::getTrackInfo(IPAddress speakerIP, char *uriBuffer, size_t uriBufferSize, TrackMetaData *trackMetaData)
+{
+  TrackInfo trackInfo = { 0, 0, 0, uriBuffer };
+  if (uriBufferSize) *uriBuffer = '\0';
+  getPositionInfo(speakerIP, &trackInfo, uriBuffer, uriBufferSize, trackMetaData);
+  return trackInfo;
+}
+
+bool SonosUPnP::getPositionInfo(IPAddress speakerIP, TrackInfo *trackInfo, char *uriBuffer, size_t uriBufferSize)
+{
+  return getPositionInfo(speakerIP, trackInfo, uriBuffer, uriBufferSize, 0);
+}
+
+bool SonosUPnP::getPositionInfo(IPAddress speakerIP, TrackInfo *trackInfo, char *uriBuffer, size_t uriBufferSize, TrackMetaData *trackMetaData)
+{
+  if (trackMetaData) trackMetaClear(trackMetaData);
+  bool success = upnpPost(speakerIP, UPNP_AV_TRANSPORT, p_GetPositionInfoA, "", "", "", 0, 0, "");
+  if (success)
   {
-    xPath.reset();
-    char infoBuffer[20] = "";
-    // Track number
+    // Track number, duration, URI, position and the requested meta data
+    // fields from one pass over the response
+    char numberBuffer[6] = "0";
+    char durationBuffer[20] = "";
+    char positionBuffer[20] = "";
     PGM_P npath[] = { p_SoapEnvelope, p_SoapBody, p_GetPositionInfoR, p_Track };
-    ethClient_xPath(npath, 4, infoBuffer, sizeof(infoBuffer));
-    trackInfo.number = atoi(infoBuffer);
-    // Track duration
     PGM_P dpath[] = { p_SoapEnvelope, p_SoapBody, p_GetPositionInfoR, p_TrackDuration };
-    ethClient_xPath(dpath, 4, infoBuffer, sizeof(infoBuffer));
-    trackInfo.duration = getTimeInSeconds(infoBuffer);
-    // Track URI
     PGM_P upath[] = { p_SoapEnvelope, p_SoapBody, p_GetPositionInfoR, p_TrackURI };
-    ethClient_xPath(upath, 4, uriBuffer, uriBufferSize);
-    trackInfo.uri = uriBuffer;
-    // Track position
     PGM_P ppath[] = { p_SoapEnvelope, p_SoapBody, p_GetPositionInfoR, p_RelTime };
-    ethClient_xPath(ppath, 4, infoBuffer, sizeof(infoBuffer));
-    trackInfo.position = getTimeInSeconds(infoBuffer);
+    PGM_P *paths[] = { npath, dpath, upath, ppath };
+    char *results[] = { numberBuffer, durationBuffer, uriBuffer, positionBuffer };
+    size_t resultSizes[] = { sizeof(numberBuffer), sizeof(durationBuffer), uriBufferSize, sizeof(positionBuffer) };
+    ethClient_xPath(paths, 4, results, resultSizes, 4, trackMetaData);
+    trackInfo->number = atoi(numberBuffer);
+    trackInfo->duration = getTimeInSeconds(durationBuffer);
+    trackInfo->position = getTimeInSeconds(positionBuffer);
+    trackInfo->uri = uriBuffer;
   }
   ethClient_stop();
-  return trackInfo;
+  return success;
 }
 
 uint16_t SonosUPnP::getTrackNumber(IPAddress speakerIP)
@@ -481,14 +913,16 @@ uint16_t SonosUPnP::getTrackPositionPerMille(IPAddress speakerIP)
   uint16_t perMille = 0;
   if (upnpPost(speakerIP, UPNP_AV_TRANSPORT, p_GetPositionInfoA, "", "", "", 0, 0, ""))
   {
-    char result[20];
-    xPath.reset();
+    char durationBuffer[20] = "";
+    char positionBuffer[20] = "";
     PGM_P dpath[] = { p_SoapEnvelope, p_SoapBody, p_GetPositionInfoR, p_TrackDuration };
-    ethClient_xPath(dpath, 4, result, sizeof(result));
-    uint32_t duration = getTimeInSeconds(result);
     PGM_P ppath[] = { p_SoapEnvelope, p_SoapBody, p_GetPositionInfoR, p_RelTime };
-    ethClient_xPath(ppath, 4, result, sizeof(result));
-    uint32_t position = getTimeInSeconds(result);
+    PGM_P *paths[] = { dpath, ppath };
+    char *results[] = { durationBuffer, positionBuffer };
+    size_t resultSizes[] = { sizeof(durationBuffer), sizeof(positionBuffer) };
+    ethClient_xPath(paths, 4, results, resultSizes, 2);
+    uint32_t duration = getTimeInSeconds(durationBuffer);
+    uint32_t position = getTimeInSeconds(positionBuffer);
     if (duration && position)
     {
       perMille = (position * 1000) / duration;
@@ -500,12 +934,16 @@ uint16_t SonosUPnP::getTrackPositionPerMille(IPAddress speakerIP)
 
 bool SonosUPnP::getMute(IPAddress speakerIP)
 {
+  int8_t cached;
+  if (cacheGet(speakerIP, SONOS_CACHE_MUTE, &cached)) return cached;
   PGM_P path[] = { p_SoapEnvelope, p_SoapBody, p_GetMuteR, p_CurrentMute };
   char result[3] = "0";
-  upnpGetString(
+  bool found = upnpGetString(
     speakerIP, UPNP_RENDERING_CONTROL, p_GetMuteA,
     SONOS_TAG_CHANNEL, SONOS_CHANNEL_MASTER, path, 4, result, sizeof(result));
-  return strcmp(result, "1") == 0;
+  bool mute = strcmp(result, "1") == 0;
+  if (found) cacheSet(speakerIP, SONOS_CACHE_MUTE, mute);
+  return mute;
 }
 
 uint8_t SonosUPnP::getVolume(IPAddress speakerIP)
@@ -515,12 +953,18 @@ uint8_t SonosUPnP::getVolume(IPAddress speakerIP)
 
 uint8_t SonosUPnP::getVolume(IPAddress speakerIP, const char *channel)
 {
+  // Only the master volume is cached
+  bool master = strcmp(channel, SONOS_CHANNEL_MASTER) == 0;
+  int8_t cached;
+  if (master && cacheGet(speakerIP, SONOS_CACHE_VOLUME, &cached)) return cached;
   PGM_P path[] = { p_SoapEnvelope, p_SoapBody, p_GetVolumeR, p_CurrentVolume };
   char result[5] = "0";
-  upnpGetString(
+  bool found = upnpGetString(
     speakerIP, UPNP_RENDERING_CONTROL, p_GetVolumeA,
     SONOS_TAG_CHANNEL, channel, path, 4, result, sizeof(result));
-  return constrain(atoi(result), 0, 100);
+  uint8_t volume = constrain(atoi(result), 0, 100);
+  if (master && found) cacheSet(speakerIP, SONOS_CACHE_VOLUME, volume);
+  return volume;
 }
 
 bool SonosUPnP::getOutputFixed(IPAddress speakerIP)
@@ -533,237 +977,1867 @@ bool SonosUPnP::getOutputFixed(IPAddress speakerIP)
 
 int8_t SonosUPnP::getBass(IPAddress speakerIP)
 {
+  int8_t cached;
+  if (cacheGet(speakerIP, SONOS_CACHE_BASS, &cached)) return cached;
   PGM_P path[] = { p_SoapEnvelope, p_SoapBody, p_GetBassR, p_CurrentBass };
   char result[5] = "0";
-  upnpGetString(
+  bool found = upnpGetString(
     speakerIP, UPNP_RENDERING_CONTROL, p_GetBassA,
     SONOS_TAG_CHANNEL, SONOS_CHANNEL_MASTER, path, 4, result, sizeof(result));
-  return constrain(atoi(result), -10, 10);
+  int8_t bass = constrain(atoi(result), -10, 10);
+  if (found) cacheSet(speakerIP, SONOS_CACHE_BASS, bass);
+  return bass;
 }
 
 int8_t SonosUPnP::getTreble(IPAddress speakerIP)
 {
+  int8_t cached;
+  if (cacheGet(speakerIP, SONOS_CACHE_TREBLE, &cached)) return cached;
   PGM_P path[] = { p_SoapEnvelope, p_SoapBody, p_GetTrebleR, p_CurrentTreble };
   char result[5] = "0";
-  upnpGetString(
+  bool found = upnpGetString(
     speakerIP, UPNP_RENDERING_CONTROL, p_GetTrebleA,
     SONOS_TAG_CHANNEL, SONOS_CHANNEL_MASTER, path, 4, result, sizeof(result));
-  return constrain(atoi(result), -10, 10);
+  int8_t treble = constrain(atoi(result), -10, 10);
+  if (found) cacheSet(speakerIP, SONOS_CACHE_TREBLE, treble);
+  return treble;
 }
 
 bool SonosUPnP::getLoudness(IPAddress speakerIP)
 {
+  int8_t cached;
+  if (cacheGet(speakerIP, SONOS_CACHE_LOUDNESS, &cached)) return cached;
   PGM_P path[] = { p_SoapEnvelope, p_SoapBody, p_GetLoudnessR, p_CurrentLoudness };
   char result[3] = "0";
-  upnpGetString(
+  bool found = upnpGetString(
     speakerIP, UPNP_RENDERING_CONTROL, p_GetLoudnessA,
     SONOS_TAG_CHANNEL, SONOS_CHANNEL_MASTER, path, 4, result, sizeof(result));
-  return strcmp(result, "1") == 0;
+  bool loudness = strcmp(result, "1") == 0;
+  if (found) cacheSet(speakerIP, SONOS_CACHE_LOUDNESS, loudness);
+  return loudness;
+}
+
+uint16_t SonosUPnP::browse(IPAddress speakerIP, const char *objectID, uint16_t start, uint16_t count, BrowseItem *item, void (*itemCallback)(uint16_t index, BrowseItem *item), uint16_t *totalMatches)
+{
+  // One page of at most count items from start; the items are passed to the
+  // callback one by one, so a page of any size needs only the item buffers
+  char paging[sizeof(SONOS_BROWSE_MID) + 10];
+  utoa(start, paging, 10);
+  strcpy_P(paging + strlen(paging), p_BrowseMid);
+  utoa(count, paging + strlen(paging), 10);
+  if (totalMatches) *totalMatches = 0;
+  uint16_t returned = 0;
+  if (upnpPost(speakerIP, UPNP_CONTENT_DIRECTORY, p_Browse, SONOS_TAG_OBJECT_ID, objectID, "", p_BrowseStart, p_BrowseEnd, paging))
+  {
+    returned = ethClient_browse(start, item, itemCallback, totalMatches);
+  }
+  ethClient_stop();
+  return returned;
 }
 
-#endif
-
-
-void SonosUPnP::seek(IPAddress speakerIP, const char *mode, const char *data)
+uint16_t SonosUPnP::browseQueue(IPAddress speakerIP, uint16_t start, uint16_t count, BrowseItem *item, void (*itemCallback)(uint16_t index, BrowseItem *item), uint16_t *totalMatches)
 {
-  upnpSet(
-    speakerIP, UPNP_AV_TRANSPORT, p_Seek,
-    SONOS_TAG_TARGET, data, "", p_SeekModeTagStart, p_SeekModeTagEnd, mode);
+  return browse(speakerIP, SONOS_BROWSE_QUEUE, start, count, item, itemCallback, totalMatches);
 }
 
-void SonosUPnP::setAVTransportURI(IPAddress speakerIP, const char *scheme, const char *address, PGM_P metaStart_P, PGM_P metaEnd_P, const char *metaValue)
+uint16_t SonosUPnP::browseSavedQueues(IPAddress speakerIP, uint16_t start, uint16_t count, BrowseItem *item, void (*itemCallback)(uint16_t index, BrowseItem *item), uint16_t *totalMatches)
 {
-  // Info to show in player, in DIDL format, can be added as META data
-  upnpSet(
-    speakerIP, UPNP_AV_TRANSPORT, p_SetAVTransportURI,
-    SONOS_TAG_CURRENT_URI, scheme, address, metaStart_P, metaEnd_P, metaValue);
+  // Items are the saved queues, an id like "SQ:3" browses the tracks of one
+  return browse(speakerIP, SONOS_BROWSE_SAVED_QUEUES, start, count, item, itemCallback, totalMatches);
 }
 
-void SonosUPnP::upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P)
+int8_t SonosUPnP::beginGetState(IPAddress speakerIP)
 {
-  upnpSet(ip, upnpMessageType, action_P, "", "");
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_GET_STATE, UPNP_AV_TRANSPORT, p_GetTransportInfoA,
+    "", "", 0, 0, "", p_GetTransportInfoR, p_CurrentTransportState);
 }
 
-void SonosUPnP::upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value)
+int8_t SonosUPnP::beginGetPlayMode(IPAddress speakerIP)
 {
-  upnpSet(ip, upnpMessageType, action_P, field, value, "", 0, 0, "");
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_GET_PLAY_MODE, UPNP_AV_TRANSPORT, p_GetTransportSettingsA,
+    "", "", 0, 0, "", p_GetTransportSettingsR, p_PlayMode);
 }
 
-void SonosUPnP::upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue)
+int8_t SonosUPnP::beginGetTrackNumber(IPAddress speakerIP)
 {
-  upnpPost(ip, upnpMessageType, action_P, field, valueA, valueB, extraStart_P, extraEnd_P, extraValue);
-  ethClient_stop();
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_GET_TRACK_NUMBER, UPNP_AV_TRANSPORT, p_GetPositionInfoA,
+    "", "", 0, 0, "", p_GetPositionInfoR, p_Track);
 }
 
-bool SonosUPnP::upnpPost(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue)
+int8_t SonosUPnP::beginGetTrackDuration(IPAddress speakerIP)
 {
-  if (!ethClient.connect(ip, UPNP_PORT)) return false;
-  
-  // Get UPnP service name
-  PGM_P upnpService = getUpnpService(upnpMessageType);
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_GET_TRACK_DURATION, UPNP_AV_TRANSPORT, p_GetPositionInfoA,
+    "", "", 0, 0, "", p_GetPositionInfoR, p_TrackDuration);
+}
 
-  // Get HTTP content/body length
-  uint16_t contentLength =
-    sizeof(SOAP_ENVELOPE_START) - 1 +
-    sizeof(SOAP_BODY_START) - 1 +
-    SOAP_ACTION_TAG_LEN +
-    (strlen_P(action_P) * 2) +
-    sizeof(UPNP_URN_SCHEMA) - 1 +
-    strlen_P(upnpService) +
-    sizeof(SONOS_INSTANCE_ID_0_TAG) - 1 +
-    sizeof(SOAP_BODY_END) - 1 +
-    sizeof(SOAP_ENVELOPE_END) - 1;
+int8_t SonosUPnP::beginGetTrackPosition(IPAddress speakerIP)
+{
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_GET_TRACK_POSITION, UPNP_AV_TRANSPORT, p_GetPositionInfoA,
+    "", "", 0, 0, "", p_GetPositionInfoR, p_RelTime);
+}
 
-  // Get length of field
-  uint8_t fieldLength = strlen(field);
-  if (fieldLength)
-  {
-    contentLength +=
-      SOAP_TAG_LEN +
-      (fieldLength * 2) +
-      strlen(valueA) +
-      strlen(valueB);
-  }
+int8_t SonosUPnP::beginGetMute(IPAddress speakerIP)
+{
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_GET_MUTE, UPNP_RENDERING_CONTROL, p_GetMuteA,
+    SONOS_TAG_CHANNEL, SONOS_CHANNEL_MASTER, 0, 0, "", p_GetMuteR, p_CurrentMute);
+}
 
-  // Get length of extra field data (e.g. meta data fields)
-  if (extraStart_P)
-  {
-    contentLength +=
-      strlen_P(extraStart_P) +
-      strlen(extraValue) +
-      strlen_P(extraEnd_P);
-  }
+int8_t SonosUPnP::beginGetVolume(IPAddress speakerIP)
+{
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_GET_VOLUME, UPNP_RENDERING_CONTROL, p_GetVolumeA,
+    SONOS_TAG_CHANNEL, SONOS_CHANNEL_MASTER, 0, 0, "", p_GetVolumeR, p_CurrentVolume);
+}
 
-  char buffer[50];
+int8_t SonosUPnP::beginGetBass(IPAddress speakerIP)
+{
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_GET_BASS, UPNP_RENDERING_CONTROL, p_GetBassA,
+    SONOS_TAG_CHANNEL, SONOS_CHANNEL_MASTER, 0, 0, "", p_GetBassR, p_CurrentBass);
+}
 
-  // Write HTTP start
-  ethClient_write("POST ");
-  ethClient_write_P(getUpnpEndpoint(upnpMessageType), buffer, sizeof(buffer));
-  ethClient_write_P(p_HttpVersion, buffer, sizeof(buffer));
+int8_t SonosUPnP::beginGetTreble(IPAddress speakerIP)
+{
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_GET_TREBLE, UPNP_RENDERING_CONTROL, p_GetTrebleA,
+    SONOS_TAG_CHANNEL, SONOS_CHANNEL_MASTER, 0, 0, "", p_GetTrebleR, p_CurrentTreble);
+}
 
-  // Write HTTP header
-  sprintf_P(buffer, p_HeaderHost, ip[0], ip[1], ip[2], ip[3], UPNP_PORT); // 29 bytes max
-  ethClient_write(buffer);
-  ethClient_write_P(p_HeaderContentType, buffer, sizeof(buffer));
-  sprintf_P(buffer, p_HeaderContentLength, contentLength); // 23 bytes max
-  ethClient_write(buffer);
-  ethClient_write_P(p_HeaderSoapAction, buffer, sizeof(buffer));
-  ethClient_write_P(p_UpnpUrnSchema, buffer, sizeof(buffer));
-  ethClient_write_P(upnpService, buffer, sizeof(buffer));
-  ethClient_write("#");
-  ethClient_write_P(action_P, buffer, sizeof(buffer));
-  ethClient_write(HEADER_SOAP_ACTION_END);
-  ethClient_write_P(p_HeaderConnection, buffer, sizeof(buffer));
-  ethClient_write("\n");
+int8_t SonosUPnP::beginGetLoudness(IPAddress speakerIP)
+{
+  return beginAsync(
+    speakerIP, SONOS_ASYNC_GET_LOUDNESS, UPNP_RENDERING_CONTROL, p_GetLoudnessA,
+    SONOS_TAG_CHANNEL, SONOS_CHANNEL_MASTER, 0, 0, "", p_GetLoudnessR, p_CurrentLoudness);
+}
 
-  // Write HTTP body
-  ethClient_write_P(p_SoapEnvelopeStart, buffer, sizeof(buffer));
-  ethClient_write_P(p_SoapBodyStart, buffer, sizeof(buffer));
-  ethClient_write(SOAP_ACTION_START_TAG_START);
-  ethClient_write_P(action_P, buffer, sizeof(buffer));
-  ethClient_write(SOAP_ACTION_START_TAG_NS);
-  ethClient_write_P(p_UpnpUrnSchema, buffer, sizeof(buffer));
-  ethClient_write_P(upnpService, buffer, sizeof(buffer));
-  ethClient_write(SOAP_ACTION_START_TAG_END);
-  ethClient_write_P(p_InstenceId0Tag, buffer, sizeof(buffer));
-  if (fieldLength)
-  {
-    sprintf(buffer, SOAP_TAG_START, field); // 18 bytes
-    ethClient_write(buffer);
-    ethClient_write(valueA);
-    ethClient_write(valueB);
-    sprintf(buffer, SOAP_TAG_END, field); // 19 bytes
-    ethClient_write(buffer);
-  }
-  if (extraStart_P)
-  {
-    ethClient_write_P(extraStart_P, buffer, sizeof(buffer)); // 390 bytes
-    ethClient_write(extraValue);
-    ethClient_write_P(extraEnd_P, buffer, sizeof(buffer)); // 271 bytes
-  }
-  ethClient_write(SOAP_ACTION_END_TAG_START);
-  ethClient_write_P(action_P, buffer, sizeof(buffer)); // 35 bytes
-  ethClient_write(SOAP_ACTION_END_TAG_END);
-  ethClient_write_P(p_SoapBodyEnd, buffer, sizeof(buffer)); // 10 bytes
-  ethClient_write_P(p_SoapEnvelopeEnd, buffer, sizeof(buffer)); // 14 bytes
+void SonosUPnP::setTopology(SonosTopology *topology)
+{
+  // Routes commands for grouped speakers to their coordinators, 0 turns it off
+  this->topology = topology;
+}
 
-  uint32_t start = millis();
-  while (!ethClient.available())
+void SonosUPnP::setCacheTTL(uint8_t field, uint16_t ttl)
+{
+  // TTL in milliseconds, 0 disables caching of the field
+  if (field >= SONOS_CACHE_FIELDS) return;
+  cacheTTL[field] = ttl;
+  if (!ttl)
   {
-    if (millis() > (start + UPNP_RESPONSE_TIMEOUT_MS))
+    for (uint8_t i = 0; i < SONOS_CACHE_SPEAKERS; i++)
     {
-      if (ethernetErrCallback) ethernetErrCallback();
-      return false;
+      cacheEntries[i].valid &= ~(1 << field);
     }
   }
-  return true;
 }
 
-PGM_P SonosUPnP::getUpnpService(uint8_t upnpMessageType)
+void SonosUPnP::clearCache()
 {
-  switch (upnpMessageType)
+  for (uint8_t i = 0; i < SONOS_CACHE_SPEAKERS; i++)
   {
-    case UPNP_AV_TRANSPORT: return p_UpnpAvTransportService;
-    case UPNP_RENDERING_CONTROL: return p_UpnpRenderingControlService;
-    case UPNP_DEVICE_PROPERTIES: return p_UpnpDevicePropertiesService;
+    cacheEntries[i].ip = IPAddress(0, 0, 0, 0);
+    cacheEntries[i].valid = 0;
   }
 }
 
-PGM_P SonosUPnP::getUpnpEndpoint(uint8_t upnpMessageType)
+void SonosUPnP::clearCache(IPAddress speakerIP)
+{
+  CacheEntry *entry = cacheFind(speakerIP, false);
+  if (entry) entry->valid = 0;
+}
+
+uint32_t SonosUPnP::getCacheHits(uint8_t field)
+{
+  return field < SONOS_CACHE_FIELDS ? cacheHits[field] : 0;
+}
+
+uint32_t SonosUPnP::getCacheMisses(uint8_t field)
+{
+  return field < SONOS_CACHE_FIELDS ? cacheMisses[field] : 0;
+}
+
+void SonosUPnP::resetCacheStats()
 {
-  switch (upnpMessageType)
+  for (uint8_t i = 0; i < SONOS_CACHE_FIELDS; i++)
   {
-    case UPNP_AV_TRANSPORT: return p_UpnpAvTransportEndpoint;
-    case UPNP_RENDERING_CONTROL: return p_UpnpRenderingControlEndpoint;
-    case UPNP_DEVICE_PROPERTIES: return p_UpnpDevicePropertiesEndpoint;
+    cacheHits[i] = 0;
+    cacheMisses[i] = 0;
   }
 }
 
-void SonosUPnP::ethClient_write(const char *data)
+#endif
+
+#ifdef SONOS_STATS_MODE
+
+// Upper bounds of the time histogram buckets in microseconds
+const uint32_t p_StatsBucketLimits[SONOS_STATS_BUCKETS - 1] PROGMEM =
+  { 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000 };
+
+void SonosUPnP::setTraceCallback(void (*traceCallback)(IPAddress speakerIP, PGM_P action_P, uint8_t error, uint32_t time))
+{
+  // Called at the end of every request with its SONOS_ERROR_* and total time in
+  // microseconds; the action name, e.g. "SetVolume", is a PROGMEM string
+  this->traceCallback = traceCallback;
+}
+
+const SonosStats *SonosUPnP::getStats()
 {
-  //Serial.print(data);
-  ethClient.print(data);
+  return &statsTotal;
 }
 
-void SonosUPnP::ethClient_write_P(PGM_P data_P, char *buffer, size_t bufferSize)
+const SonosStats *SonosUPnP::getSpeakerStats(IPAddress speakerIP)
 {
-  uint16_t dataLen = strlen_P(data_P);
-  uint16_t dataPos = 0;
-  while (dataLen > dataPos)
+  for (uint8_t i = 0; i < SONOS_STATS_SPEAKERS; i++)
   {
-    strlcpy_P(buffer, data_P + dataPos, bufferSize);
-    //Serial.print(buffer);
-    ethClient.print(buffer);
-    dataPos += bufferSize - 1;
+    if (statsSpeakers[i].ip == speakerIP) return &statsSpeakers[i].stats;
   }
+  return 0;
 }
 
-void SonosUPnP::ethClient_stop()
+const SonosStats *SonosUPnP::getActionStats(const char *action)
 {
-  if (ethClient)
+  for (uint8_t i = 0; i < SONOS_STATS_ACTIONS && statsActions[i].action_P; i++)
   {
-    while (ethClient.available()) ethClient.read();
-    ethClient.stop();
+    if (!strcmp_P(action, statsActions[i].action_P)) return &statsActions[i].stats;
   }
+  return 0;
 }
 
-
-#ifndef SONOS_WRITE_ONLY_MODE
-
-void SonosUPnP::ethClient_xPath(PGM_P *path, uint8_t pathSize, char *resultBuffer, size_t resultBufferSize)
+const SonosStats *SonosUPnP::getActionStats(uint8_t index, PGM_P *action_P)
 {
-  xPath.setPath(path, pathSize);
-  while (ethClient.available() && !xPath.getValue(ethClient.read(), resultBuffer, resultBufferSize));
+  // Actions in the order they were first seen, 0 past the last one
+  if (index >= SONOS_STATS_ACTIONS || !statsActions[index].action_P) return 0;
+  *action_P = statsActions[index].action_P;
+  return &statsActions[index].stats;
 }
 
-void SonosUPnP::upnpGetString(IPAddress speakerIP, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value, PGM_P *path, uint8_t pathSize, char *resultBuffer, size_t resultBufferSize)
+void SonosUPnP::resetStats()
 {
-  if (upnpPost(speakerIP, upnpMessageType, action_P, field, value, "", 0, 0, ""))
+  memset(&statsTotal, 0, sizeof(SonosStats));
+  for (uint8_t i = 0; i < SONOS_STATS_SPEAKERS; i++)
   {
-    xPath.reset();
-    ethClient_xPath(path, pathSize, resultBuffer, resultBufferSize);
+    statsSpeakers[i].ip = IPAddress(0, 0, 0, 0);
+    memset(&statsSpeakers[i].stats, 0, sizeof(SonosStats));
   }
-  ethClient_stop();
+  for (uint8_t i = 0; i < SONOS_STATS_ACTIONS; i++)
+  {
+    statsActions[i].action_P = 0;
+    memset(&statsActions[i].stats, 0, sizeof(SonosStats));
+  }
+}
+
+uint32_t SonosUPnP::getStatsBucketLimit(uint8_t bucket)
+{
+  if (bucket >= SONOS_STATS_BUCKETS - 1) return 0xFFFFFFFF;
+  return pgm_read_dword(&p_StatsBucketLimits[bucket]);
+}
+
+#endif
+
+
+bool SonosUPnP::seek(IPAddress speakerIP, const char *mode, const char *data)
+{
+  return upnpSet(
+    speakerIP, UPNP_AV_TRANSPORT, p_Seek,
+    SONOS_TAG_TARGET, data, "", p_SeekModeTagStart, p_SeekModeTagEnd, mode);
+}
+
+bool SonosUPnP::setAVTransportURI(IPAddress speakerIP, const char *scheme, const char *address, PGM_P metaStart_P, PGM_P metaEnd_P, const char *metaValue)
+{
+  // Info to show in player, in DIDL format, can be added as META data
+  return upnpSet(
+    speakerIP, UPNP_AV_TRANSPORT, p_SetAVTransportURI,
+    SONOS_TAG_CURRENT_URI, scheme, address, metaStart_P, metaEnd_P, metaValue);
+}
+
+bool SonosUPnP::upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P)
+{
+  return upnpSet(ip, upnpMessageType, action_P, "", "");
+}
+
+bool SonosUPnP::upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value)
+{
+  return upnpSet(ip, upnpMessageType, action_P, field, value, "", 0, 0, "");
+}
+
+bool SonosUPnP::upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue)
+{
+  // Recorded rather than sent while a batch for the speaker is being built
+  if (batch && batch->record(ip, upnpMessageType, action_P, field, valueA, valueB, extraStart_P, extraEnd_P, extraValue)) return true;
+  bool success = fireAndForget ?
+    upnpSend(ip, upnpMessageType, action_P, field, valueA, valueB, extraStart_P, extraEnd_P, extraValue) :
+    upnpPost(ip, upnpMessageType, action_P, field, valueA, valueB, extraStart_P, extraEnd_P, extraValue);
+  ethClient_stop();
+  cacheWriteThrough(ip, action_P, valueA, extraStart_P, extraValue, success);
+  return success;
+}
+
+bool SonosUPnP::upnpPost(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue)
+{
+  // Returns true with the stream at the start of a successful response body;
+  // retries wait a random time in the last half of their backoff, so speakers
+  // that failed together are not all asked again at the same time
+  ip = routeRequest(ip, upnpMessageType, action_P);
+  for (uint8_t retry = 0; ; retry++)
+  {
+    if (upnpAttempt(ip, upnpMessageType, action_P, field, valueA, valueB, extraStart_P, extraEnd_P, extraValue)) return true;
+    if (retry >= retries || !retryable(action_P)) return false;
+    ethClient_stop();
+    uint32_t backoff = (uint32_t)retryBackoff << retry;
+    delay(backoff - random(backoff / 2 + 1));
+  }
+}
+
+bool SonosUPnP::upnpAttempt(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue)
+{
+  // A kept-alive socket may have been dropped by the speaker while idle,
+  // in that case the request is sent once more on a fresh connection; not
+  // after a timeout or a partial response, as the speaker may have acted on it
+  for (uint8_t attempt = 0; attempt < 2; attempt++)
+  {
+    uint8_t connectState = ethClient_connect(ip, action_P);
+    if (!connectState) return false;
+    upnpWriteRequest(ip, upnpMessageType, action_P, field, valueA, valueB, extraStart_P, extraEnd_P, extraValue);
+    if (ethClient_readHeaders()) return ethClient_checkStatus();
+    bool closed = connection->requestResult.error == SONOS_ERROR_NONE && !readLength;
+    requestFail(SONOS_ERROR_CLOSED);
+    connection->reusable = false;
+    if (connectState == 1 || !closed) break;
+    ethClient->stop();
+  }
+  if (ethernetErrCallback) ethernetErrCallback();
+  return false;
+}
+
+bool SonosUPnP::upnpSend(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue)
+{
+  // Leaves the response to be read like that of an asynchronous request; only
+  // the value is kept, the caller's strings are gone by the time it arrives,
+  // and a failure then only invalidates what the cache was given on sending
+  ip = routeRequest(ip, upnpMessageType, action_P);
+  if (!ethClient_connect(ip, action_P)) return false;
+  upnpWriteRequest(ip, upnpMessageType, action_P, field, valueA, valueB, extraStart_P, extraEnd_P, extraValue);
+  ethClient_resetHeader();
+  connection->state = UPNP_ASYNC_HEADER;
+  connection->request = SONOS_ASYNC_SET;
+  connection->action_P = action_P;
+  strlcpy(connection->value, valueA, sizeof(connection->value));
+  connection->extraStart_P = 0;
+  connection->extraValue = "";
+  connection->reused = false;
+  connection->owned = false;
+  connection->detached = true;
+  connection->lastUsed = millis();
+  lastResult = connection->requestResult;
+  connection = 0;
+  return true;
+}
+
+bool SonosUPnP::retryable(PGM_P action_P)
+{
+  // Requests that never reached the speaker, or that it answered with an
+  // HTTP error but no UPnP error, were not carried out; after a timeout or a
+  // dropped connection they may have been, so only reads are sent again
+  uint8_t error = connection ? connection->requestResult.error : SONOS_ERROR_NO_CONNECTION;
+  switch (error)
+  {
+    case SONOS_ERROR_CONNECT:
+    case SONOS_ERROR_HTTP:
+      return true;
+    case SONOS_ERROR_TIMEOUT:
+    case SONOS_ERROR_CLOSED:
+      return !strncmp_P("Get", action_P, 3);
+  }
+  return false;
+}
+
+int8_t SonosUPnP::beginAsync(IPAddress ip, uint8_t request, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue, PGM_P response_P, PGM_P result_P)
+{
+  // Only reserves a connection, the request is sent by poll(); field and extra
+  // value are not copied and must be string literals or outlive the request
+  ip = routeRequest(ip, upnpMessageType, action_P);
+  Connection *asyncConnection = findConnection(ip);
+  if (!asyncConnection) return -1;
+  asyncConnection->reused = keepAlive && asyncConnection->ip == ip && asyncConnection->client.connected();
+  asyncConnection->ip = ip;
+  asyncConnection->state = UPNP_ASYNC_CONNECT;
+  asyncConnection->request = request;
+  asyncConnection->upnpMessageType = upnpMessageType;
+  asyncConnection->action_P = action_P;
+  asyncConnection->field = field;
+  strlcpy(asyncConnection->value, value, sizeof(asyncConnection->value));
+  asyncConnection->extraStart_P = extraStart_P;
+  asyncConnection->extraEnd_P = extraEnd_P;
+  asyncConnection->extraValue = extraValue;
+  asyncConnection->found = false;
+  asyncConnection->owned = false;
+  asyncConnection->detached = false;
+  #ifndef SONOS_WRITE_ONLY_MODE
+  asyncConnection->path[0] = p_SoapEnvelope;
+  asyncConnection->path[1] = p_SoapBody;
+  asyncConnection->path[2] = response_P;
+  asyncConnection->path[3] = result_P;
+  *asyncConnection->result = '\0';
+  #else
+  (void)response_P;
+  (void)result_P;
+  #endif
+  return asyncConnection - connections;
+}
+
+void SonosUPnP::pollAsync(int8_t handle)
+{
+  connection = &connections[handle];
+  ethClient = &connection->client;
+  if (connection->state == UPNP_ASYNC_CONNECT)
+  {
+    if (connection->reused && connection->bodyLeft > 0)
+    {
+      // Rest of a response left unread by an early abort, skipped without waiting
+      readPosition = 0;
+      readLength = 0;
+      ethClient_discard(false);
+      if (connection->bodyLeft > 0)
+      {
+        if ((uint32_t)(millis() - connection->lastUsed) <= UPNP_RESPONSE_TIMEOUT_MS) return;
+        connection->reused = false;
+      }
+    }
+    requestBegin(connection, connection->action_P);
+    if (!connection->reused)
+    {
+      if (*ethClient) ethClient->stop();
+      ethClient->setConnectionTimeout(UPNP_ASYNC_CONNECT_TIMEOUT_MS);
+      bool connected = ethClient->connect(connection->ip, UPNP_PORT);
+      statsConnect(connected);
+      if (!connected)
+      {
+        completeAsync(handle, SONOS_ASYNC_FAILED);
+        return;
+      }
+    }
+    upnpWriteRequest(
+      connection->ip, connection->upnpMessageType, connection->action_P, connection->field, connection->value, "",
+      connection->extraStart_P, connection->extraEnd_P, connection->extraValue);
+    ethClient_resetHeader();
+    #ifndef SONOS_WRITE_ONLY_MODE
+    connection->xPath.reset();
+    connection->xPath.setPath(connection->path, 4);
+    #endif
+    connection->lastUsed = millis();
+    connection->state = UPNP_ASYNC_HEADER;
+    return;
+  }
+  // Consume whatever has arrived, without waiting for more; one response per
+  // connection, so nothing past the body is lost by reading a full block
+  readPosition = 0;
+  readLength = 0;
+  while (readPosition < readLength || (ethClient->available() && ethClient_fill()))
+  {
+    char character = readBuffer[readPosition++];
+    connection->lastUsed = millis();
+    if (connection->state == UPNP_ASYNC_HEADER)
+    {
+      if (!ethClient_parseHeader(character)) continue;
+      connection->state = UPNP_ASYNC_BODY;
+      if (connection->requestResult.httpStatus >= HTTP_STATUS_ERROR)
+      {
+        #ifndef SONOS_WRITE_ONLY_MODE
+        // The fault is read on like a response, for its UPnP error code
+        connection->path[0] = p_SoapEnvelope;
+        connection->path[1] = p_SoapBody;
+        connection->path[2] = p_SoapFault;
+        connection->path[3] = p_SoapDetail;
+        connection->path[4] = p_UPnPError;
+        connection->path[5] = p_ErrorCode;
+        connection->xPath.reset();
+        connection->xPath.setPath(connection->path, 6);
+        connection->found = false;
+        *connection->result = '\0';
+        #else
+        // The fault is not read, only its status is kept
+        requestFail(SONOS_ERROR_HTTP);
+        connection->reusable = false;
+        completeAsync(handle, SONOS_ASYNC_FAILED);
+        return;
+        #endif
+      }
+    }
+    else
+    {
+      if (connection->bodyLeft > 0) connection->bodyLeft--;
+      #ifndef SONOS_WRITE_ONLY_MODE
+      bool fault = connection->requestResult.httpStatus >= HTTP_STATUS_ERROR;
+      if ((connection->request != SONOS_ASYNC_SET || fault) && !connection->found &&
+          connection->xPath.getValue(character, connection->result, sizeof(connection->result)))
+      {
+        connection->found = true;
+        // No need to read the rest when the connection is not kept
+        if (!connection->reusable || earlyAbort) break;
+      }
+      #endif
+    }
+    if (!connection->bodyLeft) break;
+  }
+  if (connection->found && earlyAbort && connection->reusable && connection->bodyLeft > 0)
+  {
+    // Rest of the block is part of the body, the remainder is skipped on reuse
+    ethClient_discard(false);
+  }
+  if (connection->state == UPNP_ASYNC_BODY &&
+      (!connection->bodyLeft || !ethClient->connected() || (connection->found && (!connection->reusable || earlyAbort))))
+  {
+    #ifndef SONOS_WRITE_ONLY_MODE
+    bool success = connection->request == SONOS_ASYNC_SET || connection->found;
+    if (connection->requestResult.httpStatus >= HTTP_STATUS_ERROR)
+    {
+      if (connection->found) connection->requestResult.upnpError = atoi(connection->result);
+      requestFail(connection->requestResult.upnpError ? SONOS_ERROR_UPNP : SONOS_ERROR_HTTP);
+      success = false;
+    }
+    #else
+    // Results are not read, a setter with one has succeeded like any other
+    bool success = true;
+    #endif
+    if (!success) requestFail(SONOS_ERROR_NO_VALUE);
+    completeAsync(handle, success ? SONOS_ASYNC_DONE : SONOS_ASYNC_FAILED);
+  }
+  else if (connection->state == UPNP_ASYNC_HEADER && connection->reused && !ethClient->connected())
+  {
+    // Kept connection was dropped by the speaker while idle, send again on a new one
+    connection->reused = false;
+    connection->state = UPNP_ASYNC_CONNECT;
+  }
+  else if (!ethClient->connected() || (uint32_t)(millis() - connection->lastUsed) > UPNP_RESPONSE_TIMEOUT_MS)
+  {
+    requestFail(ethClient->connected() ? SONOS_ERROR_TIMEOUT : SONOS_ERROR_CLOSED);
+    completeAsync(handle, SONOS_ASYNC_FAILED);
+  }
+}
+
+void SonosUPnP::completeAsync(int8_t handle, uint8_t state)
+{
+  Connection *asyncConnection = &connections[handle];
+  if (state != SONOS_ASYNC_DONE || !asyncConnection->reusable || (asyncConnection->bodyLeft && !earlyAbort))
+  {
+    asyncConnection->client.stop();
+  }
+  asyncConnection->state = state;
+  statsEnd(asyncConnection);
+  #ifndef SONOS_WRITE_ONLY_MODE
+  if (asyncConnection->request == SONOS_ASYNC_SET)
+  {
+    // A fire-and-forget request was written through when it was sent
+    if (!asyncConnection->detached || state != SONOS_ASYNC_DONE) cacheWriteThrough(
+      asyncConnection->ip, asyncConnection->action_P, asyncConnection->value,
+      asyncConnection->extraStart_P, asyncConnection->extraValue, state == SONOS_ASYNC_DONE);
+  }
+  else if (asyncConnection->request == SONOS_ASYNC_RAMP_TO_VOLUME ||
+           (asyncConnection->request == SONOS_ASYNC_SET_RELATIVE_VOLUME && state != SONOS_ASYNC_DONE))
+  {
+    // The volume is still changing, or it is not known whether it changed
+    cacheInvalidate(asyncConnection->ip, SONOS_CACHE_VOLUME);
+  }
+  else if (state == SONOS_ASYNC_DONE)
+  {
+    // Results of asynchronous reads are cached like those of the blocking getters
+    uint8_t field = 0xFF;
+    switch (asyncConnection->request)
+    {
+      case SONOS_ASYNC_GET_STATE: field = SONOS_CACHE_STATE; break;
+      case SONOS_ASYNC_GET_PLAY_MODE: field = SONOS_CACHE_PLAY_MODE; break;
+      case SONOS_ASYNC_GET_MUTE: field = SONOS_CACHE_MUTE; break;
+      case SONOS_ASYNC_GET_VOLUME:
+      case SONOS_ASYNC_SET_RELATIVE_VOLUME: field = SONOS_CACHE_VOLUME; break;
+      case SONOS_ASYNC_GET_BASS: field = SONOS_CACHE_BASS; break;
+      case SONOS_ASYNC_GET_TREBLE: field = SONOS_CACHE_TREBLE; break;
+      case SONOS_ASYNC_GET_LOUDNESS: field = SONOS_CACHE_LOUDNESS; break;
+    }
+    if (field != 0xFF) cacheSet(asyncConnection->ip, field, convertAsyncResult(asyncConnection));
+  }
+  #endif
+  bool detached = asyncConnection->detached;
+  asyncConnection->detached = false;
+  if (detached && !asyncCallback) asyncConnection->state = SONOS_ASYNC_IDLE;
+  // Requests the library collects itself never go to the callback
+  if (!asyncCallback || asyncConnection->owned) return;
+  uint8_t request = asyncConnection->request;
+  int32_t value = endAsync(handle);
+  asyncCallback(handle, asyncConnection->ip, request, state == SONOS_ASYNC_DONE, value);
+}
+
+int32_t SonosUPnP::convertAsyncResult(Connection *asyncConnection)
+{
+  #ifndef SONOS_WRITE_ONLY_MODE
+  const char *result = asyncConnection->result;
+  switch (asyncConnection->request)
+  {
+    case SONOS_ASYNC_GET_STATE: return convertState(result);
+    case SONOS_ASYNC_GET_PLAY_MODE: return convertPlayMode(result);
+    case SONOS_ASYNC_GET_TRACK_NUMBER: return atoi(result);
+    case SONOS_ASYNC_GET_TRACK_DURATION:
+    case SONOS_ASYNC_GET_TRACK_POSITION: return getTimeInSeconds(result);
+    case SONOS_ASYNC_GET_MUTE:
+    case SONOS_ASYNC_GET_LOUDNESS: return strcmp(result, "1") == 0;
+    case SONOS_ASYNC_GET_VOLUME:
+    case SONOS_ASYNC_SET_RELATIVE_VOLUME: return constrain(atoi(result), 0, 100);
+    case SONOS_ASYNC_RAMP_TO_VOLUME: return atoi(result);
+    case SONOS_ASYNC_GET_BASS:
+    case SONOS_ASYNC_GET_TREBLE: return constrain(atoi(result), -10, 10);
+  }
+  #else
+  (void)asyncConnection;
+  #endif
+  return 0;
+}
+
+const char *SonosUPnP::getRampTypeValue(uint8_t rampType)
+{
+  switch (rampType)
+  {
+    case SONOS_RAMP_ALARM: return SONOS_RAMP_ALARM_VALUE;
+    case SONOS_RAMP_AUTOPLAY: return SONOS_RAMP_AUTOPLAY_VALUE;
+  }
+  return SONOS_RAMP_SLEEP_TIMER_VALUE;
+}
+
+uint8_t SonosUPnP::fanOut(const IPAddress *speakerIPs, uint8_t count, bool *results, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue)
+{
+  // Every request is sent before any response is waited for; with more
+  // speakers than connections the rest are started as connections free up
+  int16_t targets[UPNP_MAX_CONNECTIONS];
+  for (uint8_t i = 0; i < UPNP_MAX_CONNECTIONS; i++)
+  {
+    targets[i] = -1;
+  }
+  uint8_t next = 0;
+  uint8_t inFlight = 0;
+  uint8_t succeeded = 0;
+  while (next < count || inFlight)
+  {
+    while (next < count)
+    {
+      int8_t handle = beginAsync(
+        speakerIPs[next], SONOS_ASYNC_SET, upnpMessageType, action_P, field, value,
+        extraStart_P, extraEnd_P, extraValue, 0, 0);
+      if (handle < 0) break;
+      connections[handle].owned = true;
+      targets[handle] = next++;
+      inFlight++;
+    }
+    if (!inFlight)
+    {
+      // All connections are held by other asynchronous requests
+      while (next < count)
+      {
+        if (results) results[next] = false;
+        next++;
+      }
+      break;
+    }
+    poll();
+    for (int8_t handle = 0; handle < UPNP_MAX_CONNECTIONS; handle++)
+    {
+      if (targets[handle] < 0 || getAsyncStatus(handle) == SONOS_ASYNC_PENDING) continue;
+      bool success = getAsyncStatus(handle) == SONOS_ASYNC_DONE;
+      endAsync(handle);
+      if (results) results[targets[handle]] = success;
+      if (success) succeeded++;
+      targets[handle] = -1;
+      inFlight--;
+    }
+  }
+  return succeeded;
+}
+
+void SonosUPnP::cacheWriteThrough(IPAddress ip, PGM_P action_P, const char *value, PGM_P extraStart_P, const char *extraValue, bool success)
+{
+  #ifndef SONOS_WRITE_ONLY_MODE
+  // A speaker given a source of its own has left its group; one given another
+  // speaker as its source has joined that group, which the next refresh shows
+  if (success && topology && isGroupChange(action_P))
+  {
+    if (action_P == p_SetAVTransportURI &&
+        !strncmp(SONOS_SOURCE_MASTER_SCHEME, value, sizeof(SONOS_SOURCE_MASTER_SCHEME) - 1))
+    {
+      topology->invalidate();
+    }
+    else topology->detach(ip);
+  }
+  // Only master channel values are cached
+  if (extraStart_P == p_ChannelTagStart && strcmp(extraValue, SONOS_CHANNEL_MASTER)) return;
+  uint8_t field;
+  int8_t fieldValue;
+  if (action_P == p_SetVolume) { field = SONOS_CACHE_VOLUME; fieldValue = atoi(value); }
+  else if (action_P == p_SetMute) { field = SONOS_CACHE_MUTE; fieldValue = *value == '1'; }
+  else if (action_P == p_SetBass) { field = SONOS_CACHE_BASS; fieldValue = atoi(value); }
+  else if (action_P == p_SetTreble) { field = SONOS_CACHE_TREBLE; fieldValue = atoi(value); }
+  else if (action_P == p_SetLoudness) { field = SONOS_CACHE_LOUDNESS; fieldValue = *value == '1'; }
+  else if (action_P == p_SetPlayMode) { field = SONOS_CACHE_PLAY_MODE; fieldValue = convertPlayMode(value); }
+  else if (action_P == p_Play) { field = SONOS_CACHE_STATE; fieldValue = SONOS_STATE_PLAYING; }
+  else if (action_P == p_Pause) { field = SONOS_CACHE_STATE; fieldValue = SONOS_STATE_PAUSED; }
+  else if (action_P == p_Stop) { field = SONOS_CACHE_STATE; fieldValue = SONOS_STATE_STOPPED; }
+  else if (action_P == p_SetRelativeVolume || action_P == p_RampToVolume)
+  {
+    cacheInvalidate(ip, SONOS_CACHE_VOLUME);
+    return;
+  }
+  else if (action_P == p_SetGroupVolume || action_P == p_SetRelativeGroupVolume)
+  {
+    // Changes the volume of every group member, and the members are not known here
+    for (uint8_t i = 0; i < SONOS_CACHE_SPEAKERS; i++)
+    {
+      cacheEntries[i].valid &= ~(1 << SONOS_CACHE_VOLUME);
+    }
+    return;
+  }
+  else
+  {
+    // Other transport actions, e.g. a new URI or a group change, may change the state
+    cacheInvalidate(ip, SONOS_CACHE_STATE);
+    return;
+  }
+  if (success) cacheSet(ip, field, fieldValue);
+  else cacheInvalidate(ip, field);
+  #else
+  // Nothing is cached or routed
+  (void)ip;
+  (void)action_P;
+  (void)value;
+  (void)extraStart_P;
+  (void)extraValue;
+  (void)success;
+  #endif
+}
+
+void SonosUPnP::upnpWriteRequest(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue)
+{
+  // Fixed parts of the request and their lengths are precomputed per service
+  RequestTemplate requestTemplate;
+  getUpnpTemplate(upnpMessageType, &requestTemplate);
+  uint8_t actionLength = strlen_P(action_P);
+
+  // Get HTTP content/body length
+  uint16_t contentLength = requestTemplate.bodyLength + actionLength * 2;
+
+  // Get length of field
+  uint8_t fieldLength = strlen(field);
+  if (fieldLength)
+  {
+    contentLength +=
+      SOAP_TAG_LEN +
+      (fieldLength * 2) +
+      strlen(valueA) +
+      strlen(valueB);
+  }
+
+  // Get length of extra field data (e.g. meta data fields), DIDL-Lite meta
+  // data is measured in a dry run of its writer instead of being built
+  if (extraStart_P)
+  {
+    contentLength +=
+      strlen_P(extraStart_P) +
+      strlen(extraValue) +
+      strlen_P(extraEnd_P);
+    if (meta) contentLength += metaWrite(meta, false, 0);
+  }
+
+  char buffer[22];
+  char *position;
+
+  // Write HTTP header, runtime values spliced in between the templates
+  ethClient_write_P(requestTemplate.start_P, requestTemplate.startLength);
+  position = buffer;
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    utoa(ip[i], position, 10);
+    position += strlen(position);
+    *position++ = i < 3 ? '.' : ':';
+  }
+  utoa(UPNP_PORT, position, 10);
+  ethClient_write(buffer);
+  ethClient_write_P(p_RequestHeaderMid, sizeof(p_RequestHeaderMid) - 1);
+  utoa(contentLength, buffer, 10);
+  ethClient_write(buffer);
+  ethClient_write_P(requestTemplate.soapAction_P, requestTemplate.soapActionLength);
+  ethClient_write_P(action_P, actionLength);
+  if (keepAlive) ethClient_write_P(p_RequestHeaderEndKeepAlive, sizeof(p_RequestHeaderEndKeepAlive) - 1);
+  else ethClient_write_P(p_RequestHeaderEnd, sizeof(p_RequestHeaderEnd) - 1);
+
+  // Write HTTP body
+  ethClient_write_P(action_P, actionLength);
+  ethClient_write_P(requestTemplate.actionNs_P, requestTemplate.actionNsLength);
+  if (fieldLength)
+  {
+    ethClient_write("<", 1);
+    ethClient_write(field, fieldLength);
+    ethClient_write(">", 1);
+    ethClient_write(valueA);
+    ethClient_write(valueB);
+    ethClient_write("</", 2);
+    ethClient_write(field, fieldLength);
+    ethClient_write(">", 1);
+  }
+  if (extraStart_P)
+  {
+    ethClient_write_P(extraStart_P);
+    if (meta) metaWrite(meta, true, 0);
+    ethClient_write(extraValue);
+    ethClient_write_P(extraEnd_P);
+  }
+  ethClient_write(SOAP_ACTION_END_TAG_START);
+  ethClient_write_P(action_P, actionLength);
+  ethClient_write_P(p_RequestEnd, sizeof(p_RequestEnd) - 1);
+  ethClient_flush();
+}
+
+void SonosUPnP::getUpnpTemplate(uint8_t upnpMessageType, RequestTemplate *requestTemplate)
+{
+  memcpy_P(requestTemplate, &requestTemplates[upnpMessageType - 1], sizeof(RequestTemplate));
+}
+
+uint16_t SonosUPnP::metaWrite(const MetaData *meta, bool send, char *buffer)
+{
+  // Sends the escaped DIDL-Lite, copies it to buffer, or with neither only
+  // counts it; returns the length, which is the same in every mode
+  MetaWriter writer = { send, buffer, 0 };
+  metaWrite_P(&writer, p_MetaStart);
+  metaWriteElement(&writer, p_MetaTitle, meta->title);
+  metaWriteElement(&writer, p_MetaCreator, meta->artist);
+  metaWriteElement(&writer, p_MetaAlbum, meta->album);
+  metaWriteElement(&writer, p_MetaAlbumArtURI, meta->albumArtURI);
+  metaWriteElement(&writer, p_MetaClass, meta->itemClass ? meta->itemClass : SONOS_META_CLASS_TRACK);
+  if (meta->desc && *meta->desc)
+  {
+    metaWrite_P(&writer, p_MetaDescStart);
+    metaWriteEscaped(&writer, meta->desc);
+    metaWrite_P(&writer, p_MetaTagClose);
+    metaWrite_P(&writer, p_MetaDesc);
+    metaWrite_P(&writer, p_MetaTagEnd);
+  }
+  metaWrite_P(&writer, p_MetaEnd);
+  if (buffer) buffer[writer.length] = '\0';
+  return writer.length;
+}
+
+void SonosUPnP::metaWriteElement(MetaWriter *writer, PGM_P name_P, const char *value)
+{
+  if (!value || !*value) return;
+  metaWrite_P(writer, p_MetaTagOpen);
+  metaWrite_P(writer, name_P);
+  metaWrite_P(writer, p_MetaTagEnd);
+  metaWriteEscaped(writer, value);
+  metaWrite_P(writer, p_MetaTagClose);
+  metaWrite_P(writer, name_P);
+  metaWrite_P(writer, p_MetaTagEnd);
+}
+
+void SonosUPnP::metaWriteEscaped(MetaWriter *writer, const char *value)
+{
+  // Runs without markup characters are written as they are
+  while (*value)
+  {
+    size_t length = strcspn(value, "&<>\"");
+    if (length) metaWrite(writer, value, length);
+    value += length;
+    if (!*value) return;
+    if (*value == '&') metaWrite_P(writer, p_MetaEscapedAmp);
+    else if (*value == '<') metaWrite_P(writer, p_MetaEscapedLt);
+    else if (*value == '>') metaWrite_P(writer, p_MetaEscapedGt);
+    else metaWrite_P(writer, p_MetaEscapedQuot);
+    value++;
+  }
+}
+
+void SonosUPnP::metaWrite_P(MetaWriter *writer, PGM_P data_P)
+{
+  size_t length = strlen_P(data_P);
+  if (writer->send) ethClient_write_P(data_P, length);
+  else if (writer->buffer) memcpy_P(writer->buffer + writer->length, data_P, length);
+  writer->length += length;
+}
+
+void SonosUPnP::metaWrite(MetaWriter *writer, const char *data, size_t length)
+{
+  if (writer->send) ethClient_write(data, length);
+  else if (writer->buffer) memcpy(writer->buffer + writer->length, data, length);
+  writer->length += length;
+}
+
+IPAddress SonosUPnP::routeRequest(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P)
+{
+  #ifndef SONOS_WRITE_ONLY_MODE
+  // Transport and group commands for a grouped speaker are sent straight to its
+  // coordinator, except the ones that move the speaker itself to a new group
+  // and the queue edits, as the queue played after leaving is its own. While
+  // the table is out of date they go to the speaker itself
+  if (!topology || !topology->routable) return ip;
+  if (upnpMessageType != UPNP_AV_TRANSPORT && upnpMessageType != UPNP_GROUP_RENDERING_CONTROL) return ip;
+  if (isGroupChange(action_P)) return ip;
+  if (action_P == p_AddURIToQueue || action_P == p_RemoveAllTracksFromQueue) return ip;
+  return topology->getCoordinatorIP(ip);
+  #else
+  (void)upnpMessageType;
+  (void)action_P;
+  return ip;
+  #endif
+}
+
+bool SonosUPnP::isGroupChange(PGM_P action_P)
+{
+  // Moves the speaker to a group of its own or another's, which changes where
+  // its later transport commands are routed
+  return action_P == p_SetAVTransportURI || action_P == p_BecomeCoordinatorOfStandaloneGroup;
+}
+
+SonosUPnP::Connection *SonosUPnP::findConnection(IPAddress ip)
+{
+  // Prefers a kept connection to the same speaker, then an unused connection,
+  // then the least recently used one; connections serving a request are skipped
+  Connection *found = 0;
+  for (uint8_t i = 0; i < UPNP_MAX_CONNECTIONS; i++)
+  {
+    Connection *candidate = &connections[i];
+    if (candidate->state != SONOS_ASYNC_IDLE) continue;
+    bool open = candidate->client.connected();
+    if (keepAlive && open && candidate->ip == ip) return candidate;
+    if (!found || (found->client.connected() &&
+        (!open || (uint32_t)(millis() - candidate->lastUsed) > (uint32_t)(millis() - found->lastUsed))))
+    {
+      found = candidate;
+    }
+  }
+  return found;
+}
+
+void SonosUPnP::collectDetached(IPAddress ip)
+{
+  // Reads the responses of fire-and-forget requests that have arrived; waits
+  // for those to the same speaker, so it carries out requests in the order
+  // they were given, and for any of them when no connection is free
+  for (;;)
+  {
+    bool idle = false;
+    bool pending = false;
+    bool sameSpeaker = false;
+    for (int8_t handle = 0; handle < UPNP_MAX_CONNECTIONS; handle++)
+    {
+      Connection *candidate = &connections[handle];
+      if (candidate->detached && getAsyncStatus(handle) == SONOS_ASYNC_PENDING) pollAsync(handle);
+      if (candidate->state == SONOS_ASYNC_IDLE) idle = true;
+      else if (candidate->detached)
+      {
+        pending = true;
+        sameSpeaker |= candidate->ip == ip;
+      }
+    }
+    if (!sameSpeaker && (idle || !pending)) return;
+    yield();
+  }
+}
+
+uint8_t SonosUPnP::ethClient_connect(IPAddress ip, PGM_P action_P)
+{
+  // Returns 2 when an open connection is reused, 1 when a new one is made
+  collectDetached(ip);
+  connection = findConnection(ip);
+  if (!connection)
+  {
+    lastResult.error = SONOS_ERROR_NO_CONNECTION;
+    lastResult.httpStatus = 0;
+    lastResult.upnpError = 0;
+    if (action_P) statsRecord(ip, action_P, SONOS_ERROR_NO_CONNECTION, 0, 0);
+    return 0;
+  }
+  ethClient = &connection->client;
+  connection->lastUsed = millis();
+  readPosition = 0;
+  readLength = 0;
+  if (keepAlive && connection->ip == ip && ethClient->connected())
+  {
+    // Rest of a response left unread by an early abort
+    ethClient_discard(true);
+    if (connection->bodyLeft <= 0)
+    {
+      readPosition = 0;
+      readLength = 0;
+      requestBegin(connection, action_P);
+      return 2;
+    }
+  }
+  if (*ethClient) ethClient->stop();
+  connection->ip = ip;
+  requestBegin(connection, action_P);
+  ethClient->setConnectionTimeout(UPNP_CONNECT_TIMEOUT_MS);
+  bool connected = ethClient->connect(ip, UPNP_PORT);
+  statsConnect(connected);
+  return connected ? 1 : 0;
+}
+
+void SonosUPnP::ethClient_resetHeader()
+{
+  connection->bodyLeft = -1;
+  connection->reusable = keepAlive;
+  connection->headerLineLength = 0;
+  connection->headerLengthPos = 0;
+  connection->headerClosePos = 0;
+  connection->headerStatusPos = 0;
+  connection->requestResult.httpStatus = 0;
+}
+
+bool SonosUPnP::ethClient_readHeaders()
+{
+  // Reads the HTTP response header and leaves the stream at the start of the body
+  ethClient_resetHeader();
+  while (ethClient_fill())
+  {
+    if (ethClient_parseHeader(readBuffer[readPosition++])) return true;
+  }
+  return false;
+}
+
+bool SonosUPnP::ethClient_parseHeader(char character)
+{
+  // Returns true at the empty line ending the header, picks up the status,
+  // Content-Length and "Connection: close" on the way
+  if (character == '\r') return false;
+  if (connection->headerStatusPos < UPNP_HEADER_STATUS_DONE)
+  {
+    // Status line, the code is the three digits after the first space
+    if (character == '\n' || (connection->headerStatusPos && (character < '0' || character > '9')))
+    {
+      connection->headerStatusPos = UPNP_HEADER_STATUS_DONE;
+    }
+    else if (connection->headerStatusPos)
+    {
+      connection->requestResult.httpStatus = connection->requestResult.httpStatus * 10 + character - '0';
+      connection->headerStatusPos++;
+    }
+    else if (character == ' ')
+    {
+      connection->headerStatusPos = 1;
+    }
+    if (character == '\n' || connection->headerStatusPos < UPNP_HEADER_STATUS_DONE) return false;
+  }
+  if (character == '\n')
+  {
+    if (!connection->headerLineLength) return true;
+    if (connection->headerClosePos == sizeof(HEADER_CONNECTION_CLOSE_NAME) - 1) connection->reusable = false;
+    connection->headerLineLength = 0;
+    connection->headerLengthPos = 0;
+    connection->headerClosePos = 0;
+    return false;
+  }
+  uint8_t position = connection->headerLineLength;
+  if (connection->headerLineLength < 255) connection->headerLineLength++;
+  if (connection->headerLengthPos == sizeof(HEADER_CONTENT_LENGTH_NAME) - 1)
+  {
+    if (character >= '0' && character <= '9')
+    {
+      if (connection->bodyLeft < 0) connection->bodyLeft = 0;
+      connection->bodyLeft = connection->bodyLeft * 10 + character - '0';
+    }
+    return false;
+  }
+  if (character >= 'A' && character <= 'Z') character += 'a' - 'A';
+  if (connection->headerLengthPos == position &&
+      character == (char)pgm_read_byte(p_HeaderContentLengthName + position))
+  {
+    connection->headerLengthPos++;
+  }
+  if (connection->headerClosePos == position && position < sizeof(HEADER_CONNECTION_CLOSE_NAME) - 1 &&
+      character == (char)pgm_read_byte(p_HeaderConnectionCloseName + position))
+  {
+    connection->headerClosePos++;
+  }
+  return false;
+}
+
+bool SonosUPnP::ethClient_checkStatus()
+{
+  // An error status fails the request, with the UPnP error code of the SOAP
+  // fault in the body when there is one
+  if (connection->requestResult.httpStatus < HTTP_STATUS_ERROR) return true;
+  #ifndef SONOS_WRITE_ONLY_MODE
+  PGM_P path[] = { p_SoapEnvelope, p_SoapBody, p_SoapFault, p_SoapDetail, p_UPnPError, p_ErrorCode };
+  char code[6] = "";
+  xPath.reset();
+  if (ethClient_xPath(path, 6, code, sizeof(code))) connection->requestResult.upnpError = atoi(code);
+  #endif
+  requestFail(connection->requestResult.upnpError ? SONOS_ERROR_UPNP : SONOS_ERROR_HTTP);
+  return false;
+}
+
+bool SonosUPnP::ethClient_waitAvailable()
+{
+  uint32_t start = millis();
+  while (!ethClient->available())
+  {
+    if (!ethClient->connected())
+    {
+      // Only an error when more of the body was expected
+      if (connection->bodyLeft > 0) requestFail(SONOS_ERROR_CLOSED);
+      return false;
+    }
+    if ((uint32_t)(millis() - start) > UPNP_RESPONSE_TIMEOUT_MS)
+    {
+      requestFail(SONOS_ERROR_TIMEOUT);
+      return false;
+    }
+    yield();
+  }
+  return true;
+}
+
+bool SonosUPnP::ethClient_fill()
+{
+  // Refills the read buffer with whatever has arrived, in a single read
+  if (readPosition < readLength) return true;
+  if (!ethClient_waitAvailable()) return false;
+  int length = ethClient->read(readBuffer, sizeof(readBuffer));
+  if (length <= 0) return false;
+  statsReceive(length);
+  readPosition = 0;
+  readLength = length;
+  return true;
+}
+
+int SonosUPnP::ethClient_read()
+{
+  // Returns -1 at the end of the response body, as given by Content-Length
+  // or by the speaker closing the connection
+  if (!connection->bodyLeft || !ethClient_fill()) return -1;
+  if (connection->bodyLeft > 0) connection->bodyLeft--;
+  return readBuffer[readPosition++];
+}
+
+void SonosUPnP::ethClient_skipText()
+{
+  // Consumes the body up to the next tag, or to its end
+  while (connection->bodyLeft && ethClient_fill())
+  {
+    size_t length = readLength - readPosition;
+    if (connection->bodyLeft > 0 && (int32_t)length > connection->bodyLeft) length = connection->bodyLeft;
+    const uint8_t *tag = (const uint8_t *)memchr(readBuffer + readPosition, '<', length);
+    if (tag) length = tag - (readBuffer + readPosition);
+    readPosition += length;
+    if (connection->bodyLeft > 0) connection->bodyLeft -= length;
+    if (tag) return;
+  }
+}
+
+void SonosUPnP::ethClient_write(const char *data)
+{
+  ethClient_write(data, strlen(data));
+}
+
+void SonosUPnP::ethClient_write(const char *data, size_t length)
+{
+  // Gathered in the write buffer, which is sent whenever it fills up
+  while (length)
+  {
+    size_t chunkLength = min(length, (size_t)(UPNP_WRITE_BUFFER_SIZE - writeLength));
+    memcpy(writeBuffer + writeLength, data, chunkLength);
+    writeLength += chunkLength;
+    data += chunkLength;
+    length -= chunkLength;
+    if (writeLength == UPNP_WRITE_BUFFER_SIZE) ethClient_flush();
+  }
+}
+
+void SonosUPnP::ethClient_write_P(PGM_P data_P)
+{
+  ethClient_write_P(data_P, strlen_P(data_P));
+}
+
+void SonosUPnP::ethClient_write_P(PGM_P data_P, size_t length)
+{
+  while (length)
+  {
+    size_t chunkLength = min(length, (size_t)(UPNP_WRITE_BUFFER_SIZE - writeLength));
+    memcpy_P(writeBuffer + writeLength, data_P, chunkLength);
+    writeLength += chunkLength;
+    data_P += chunkLength;
+    length -= chunkLength;
+    if (writeLength == UPNP_WRITE_BUFFER_SIZE) ethClient_flush();
+  }
+}
+
+void SonosUPnP::ethClient_flush()
+{
+  //Serial.write(writeBuffer, writeLength);
+  if (writeLength) ethClient->write((const uint8_t *)writeBuffer, writeLength);
+  statsSend(writeLength);
+  writeLength = 0;
+}
+
+void SonosUPnP::ethClient_stop()
+{
+  if (connection) lastResult = connection->requestResult;
+  if (connection && *ethClient)
+  {
+    // Keep the connection open when the rest of the body has a known length
+    if (connection->reusable && connection->bodyLeft >= 0)
+    {
+      ethClient_discard(!earlyAbort);
+      if (!connection->bodyLeft || earlyAbort)
+      {
+        statsEnd(connection);
+        connection = 0;
+        return;
+      }
+    }
+    if (!earlyAbort)
+    {
+      while (ethClient->available()) ethClient->read(readBuffer, sizeof(readBuffer));
+    }
+    ethClient->stop();
+  }
+  if (connection) statsEnd(connection);
+  connection = 0;
+}
+
+void SonosUPnP::ethClient_discard(bool wait)
+{
+  // Consumes the rest of a body with a known length, either all of it or only
+  // what is buffered or has arrived so far
+  while (connection->bodyLeft > 0 &&
+         (readPosition < readLength || ((wait || ethClient->available()) && ethClient_fill())))
+  {
+    uint16_t length = readLength - readPosition;
+    if (length > connection->bodyLeft) length = connection->bodyLeft;
+    readPosition += length;
+    connection->bodyLeft -= length;
+  }
+}
+
+void SonosUPnP::requestBegin(Connection *requestConnection, PGM_P action_P)
+{
+  requestConnection->requestResult.error = SONOS_ERROR_NONE;
+  requestConnection->requestResult.httpStatus = 0;
+  requestConnection->requestResult.upnpError = 0;
+  statsBegin(requestConnection, action_P);
+}
+
+void SonosUPnP::requestFail(uint8_t error)
+{
+  // Only the first error of a request is kept, later ones follow from it
+  if (connection->requestResult.error == SONOS_ERROR_NONE) connection->requestResult.error = error;
+}
+
+void SonosUPnP::statsConnect(bool connected)
+{
+  if (!connected) requestFail(SONOS_ERROR_CONNECT);
+  #ifdef SONOS_STATS_MODE
+  connection->statsConnectTime = (uint32_t)(micros() - connection->statsStart);
+  connection->statsConnected = true;
+  #endif
+}
+
+#ifdef SONOS_STATS_MODE
+
+void SonosUPnP::statsBegin(Connection *statsConnection, PGM_P action_P)
+{
+  // Starts timing a request, requests without an action are not recorded
+  statsConnection->statsAction_P = action_P;
+  statsConnection->statsStart = micros();
+  statsConnection->statsConnectTime = 0;
+  statsConnection->statsFirstByteTime = 0;
+  statsConnection->statsSent = 0;
+  statsConnection->statsReceived = 0;
+  statsConnection->statsConnected = false;
+  statsConnection->statsFirstByte = false;
+}
+
+void SonosUPnP::statsSend(uint16_t length)
+{
+  if (connection) connection->statsSent += length;
+}
+
+void SonosUPnP::statsReceive(uint16_t length)
+{
+  if (!connection->statsFirstByte)
+  {
+    connection->statsFirstByteTime = (uint32_t)(micros() - connection->statsStart);
+    connection->statsFirstByte = true;
+  }
+  connection->statsReceived += length;
+}
+
+void SonosUPnP::statsEnd(Connection *statsConnection)
+{
+  if (!statsConnection->statsAction_P) return;
+  statsRecord(
+    statsConnection->ip, statsConnection->statsAction_P, statsConnection->requestResult.error,
+    (uint32_t)(micros() - statsConnection->statsStart), statsConnection);
+  statsConnection->statsAction_P = 0;
+}
+
+void SonosUPnP::statsRecord(IPAddress ip, PGM_P action_P, uint8_t error, uint32_t time, Connection *statsConnection)
+{
+  // Added to the totals and to the entries of the speaker and the action;
+  // speakers and actions beyond the table sizes are only in the totals
+  statsAdd(&statsTotal, error, time, statsConnection);
+  SonosStats *speakerStats = statsFind(ip);
+  if (speakerStats) statsAdd(speakerStats, error, time, statsConnection);
+  SonosStats *actionStats = statsFind(action_P);
+  if (actionStats) statsAdd(actionStats, error, time, statsConnection);
+  if (traceCallback) traceCallback(ip, action_P, error, time);
+}
+
+SonosStats *SonosUPnP::statsFind(IPAddress ip)
+{
+  for (uint8_t i = 0; i < SONOS_STATS_SPEAKERS; i++)
+  {
+    if (statsSpeakers[i].ip == ip) return &statsSpeakers[i].stats;
+    if (statsSpeakers[i].ip == IPAddress(0, 0, 0, 0))
+    {
+      statsSpeakers[i].ip = ip;
+      return &statsSpeakers[i].stats;
+    }
+  }
+  return 0;
+}
+
+SonosStats *SonosUPnP::statsFind(PGM_P action_P)
+{
+  for (uint8_t i = 0; i < SONOS_STATS_ACTIONS; i++)
+  {
+    if (statsActions[i].action_P == action_P) return &statsActions[i].stats;
+    if (!statsActions[i].action_P)
+    {
+      statsActions[i].action_P = action_P;
+      return &statsActions[i].stats;
+    }
+  }
+  return 0;
+}
+
+void SonosUPnP::statsAdd(SonosStats *stats, uint8_t error, uint32_t time, Connection *statsConnection)
+{
+  stats->requests++;
+  if (error != SONOS_ERROR_NONE) stats->failures++;
+  if (error == SONOS_ERROR_CONNECT) stats->connectFailures++;
+  if (error == SONOS_ERROR_TIMEOUT) stats->timeouts++;
+  if (error == SONOS_ERROR_NO_CONNECTION) return;
+  statsCount(stats->totalTime, time);
+  if (!statsConnection) return;
+  stats->bytesSent += statsConnection->statsSent;
+  stats->bytesReceived += statsConnection->statsReceived;
+  if (statsConnection->statsConnected) statsCount(stats->connectTime, statsConnection->statsConnectTime);
+  if (statsConnection->statsFirstByte) statsCount(stats->firstByteTime, statsConnection->statsFirstByteTime);
+}
+
+void SonosUPnP::statsCount(uint16_t *histogram, uint32_t time)
+{
+  uint8_t bucket = 0;
+  while (bucket < SONOS_STATS_BUCKETS - 1 && time > pgm_read_dword(&p_StatsBucketLimits[bucket])) bucket++;
+  if (histogram[bucket] < 0xFFFF) histogram[bucket]++;
+}
+
+#endif
+
+
+#ifndef SONOS_WRITE_ONLY_MODE
+
+bool SonosUPnP::ethClient_xPath(PGM_P *path, uint8_t pathSize, char *resultBuffer, size_t resultBufferSize)
+{
+  xPath.setPath(path, pathSize);
+  TextFilter filter;
+  textFilterBegin(&filter, &path, pathSize, 1);
+  int character;
+  while ((character = ethClient_read()) >= 0)
+  {
+    if (xPath.getValue(character, resultBuffer, resultBufferSize)) return true;
+    if (textFilterSkip(&filter, character)) ethClient_skipText();
+  }
+  return false;
+}
+
+void SonosUPnP::ethClient_xPath(PGM_P **paths, uint8_t pathSize, char **resultBuffers, size_t *resultBufferSizes, uint8_t resultCount)
+{
+  ethClient_xPath(paths, pathSize, resultBuffers, resultBufferSizes, resultCount, 0);
+}
+
+void SonosUPnP::ethClient_xPath(PGM_P **paths, uint8_t pathSize, char **resultBuffers, size_t *resultBufferSizes, uint8_t resultCount, TrackMetaData *trackMetaData)
+{
+  // Each path gets its own matcher, so values are found in any document order
+  // and a missing value does not prevent the others from being found
+  MicroXPath_P xPaths[UPNP_MAX_XPATHS];
+  uint8_t maxCount = trackMetaData ? UPNP_MAX_XPATHS - 1 : UPNP_MAX_XPATHS;
+  if (resultCount > maxCount) resultCount = maxCount;
+  TextFilter filter;
+  textFilterBegin(&filter, paths, pathSize, resultCount);
+  for (uint8_t i = 0; i < resultCount; i++)
+  {
+    xPaths[i].reset();
+    xPaths[i].setPath(paths[i], pathSize);
+  }
+  // The meta data takes the filter slot after the paths, so its text is not
+  // skipped and the pass ends once both the values and the meta data are read
+  TrackMetaParser metaParser;
+  uint8_t metaBit = 1 << resultCount;
+  if (trackMetaData)
+  {
+    filter.names[resultCount] = p_TrackMetaData;
+    filter.pending |= metaBit;
+    markupBegin(&metaParser.outer);
+    markupBegin(&metaParser.inner);
+    metaParser.inMetaData = false;
+    metaParser.inItem = false;
+    metaParser.value = 0;
+  }
+  int character;
+  while (filter.pending && (character = ethClient_read()) >= 0)
+  {
+    for (uint8_t i = 0; i < resultCount; i++)
+    {
+      if ((filter.pending & (1 << i)) && xPaths[i].getValue(character, resultBuffers[i], resultBufferSizes[i]))
+      {
+        filter.pending &= ~(1 << i);
+      }
+    }
+    if ((filter.pending & metaBit) && trackMetaParse(&metaParser, trackMetaData, character))
+    {
+      filter.pending &= ~metaBit;
+    }
+    if (textFilterSkip(&filter, character)) ethClient_skipText();
+  }
+}
+
+bool SonosUPnP::trackMetaParse(TrackMetaParser *parser, TrackMetaData *trackMetaData, char character)
+{
+  // The escaped DIDL-Lite is decoded by the outer tokenizer and tokenized once
+  // more, which also decodes the values; returns true after </TrackMetaData>
+  char decoded;
+  char output;
+  uint8_t event = markupParse(&parser->outer, character, &decoded);
+  if (event == SONOS_MARKUP_START || event == SONOS_MARKUP_END)
+  {
+    bool ended = false;
+    for (; event != SONOS_MARKUP_NONE; event = markupNext(&parser->outer))
+    {
+      bool isMetaData = markupIs(&parser->outer, p_TrackMetaData);
+      parser->inMetaData = event == SONOS_MARKUP_START && isMetaData;
+      ended |= event == SONOS_MARKUP_END && isMetaData;
+    }
+    return ended;
+  }
+  if (event != SONOS_MARKUP_TEXT || !parser->inMetaData) return false;
+  event = markupParse(&parser->inner, decoded, &output);
+  if (event == SONOS_MARKUP_TEXT)
+  {
+    if (parser->value && parser->valueLength + 1 < parser->valueSize)
+    {
+      parser->value[parser->valueLength++] = output;
+      parser->value[parser->valueLength] = '\0';
+    }
+  }
+  else if (event == SONOS_MARKUP_START || event == SONOS_MARKUP_END)
+  {
+    for (; event != SONOS_MARKUP_NONE; event = markupNext(&parser->inner))
+    {
+      parser->value = 0;
+      if (markupIs(&parser->inner, p_DidlItem))
+      {
+        parser->inItem = event == SONOS_MARKUP_START;
+      }
+      else if (event == SONOS_MARKUP_START && parser->inItem)
+      {
+        TrackMetaData *meta = trackMetaData;
+        if (markupIs(&parser->inner, p_DidlTitle)) { parser->value = meta->title; parser->valueSize = meta->titleSize; }
+        else if (markupIs(&parser->inner, p_DidlCreator)) { parser->value = meta->artist; parser->valueSize = meta->artistSize; }
+        else if (markupIs(&parser->inner, p_DidlAlbum)) { parser->value = meta->album; parser->valueSize = meta->albumSize; }
+        else if (markupIs(&parser->inner, p_DidlAlbumArtURI)) { parser->value = meta->albumArtURI; parser->valueSize = meta->albumArtURISize; }
+        else if (markupIs(&parser->inner, p_DidlStreamContent)) { parser->value = meta->streamContent; parser->valueSize = meta->streamContentSize; }
+        // Only the first of repeated elements is kept
+        if (parser->value && (!parser->valueSize || *parser->value)) parser->value = 0;
+        parser->valueLength = 0;
+      }
+    }
+  }
+  return false;
+}
+
+void SonosUPnP::trackMetaClear(TrackMetaData *trackMetaData)
+{
+  if (trackMetaData->title && trackMetaData->titleSize) *trackMetaData->title = '\0';
+  if (trackMetaData->artist && trackMetaData->artistSize) *trackMetaData->artist = '\0';
+  if (trackMetaData->album && trackMetaData->albumSize) *trackMetaData->album = '\0';
+  if (trackMetaData->albumArtURI && trackMetaData->albumArtURISize) *trackMetaData->albumArtURI = '\0';
+  if (trackMetaData->streamContent && trackMetaData->streamContentSize) *trackMetaData->streamContent = '\0';
+}
+
+void SonosUPnP::textFilterBegin(TextFilter *filter, PGM_P **paths, uint8_t pathSize, uint8_t count)
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    filter->names[i] = paths[i][pathSize - 1];
+  }
+  filter->pending = (1 << count) - 1;
+  filter->candidates = 0;
+  filter->inTag = false;
+  filter->inName = false;
+  filter->lastChar = 0;
+}
+
+bool SonosUPnP::textFilterSkip(TextFilter *filter, char character)
+{
+  // Returns true at the end of a tag when no pending path ends with its name,
+  // or when it is a closing or empty element; the matchers only take a value
+  // from the text right after an opening tag named like their last element
+  if (!filter->inTag)
+  {
+    if (character == '<')
+    {
+      filter->inTag = true;
+      filter->inName = true;
+      filter->namePos = 0;
+      filter->candidates = filter->pending;
+      filter->lastChar = character;
+    }
+    return false;
+  }
+  if (character == '>')
+  {
+    filter->inTag = false;
+    if (filter->inName) textFilterEndName(filter);
+    return !filter->candidates || filter->lastChar == '/';
+  }
+  if (filter->inName)
+  {
+    if (character == ' ' || character == '\t' || character == '\r' || character == '\n' || character == '/')
+    {
+      textFilterEndName(filter);
+    }
+    else
+    {
+      for (uint8_t i = 0; i < UPNP_MAX_XPATHS; i++)
+      {
+        if ((filter->candidates & (1 << i)) && (char)pgm_read_byte(filter->names[i] + filter->namePos) != character)
+        {
+          filter->candidates &= ~(1 << i);
+        }
+      }
+      filter->namePos++;
+      if (!filter->candidates) filter->inName = false;
+    }
+  }
+  filter->lastChar = character;
+  return false;
+}
+
+void SonosUPnP::textFilterEndName(TextFilter *filter)
+{
+  for (uint8_t i = 0; i < UPNP_MAX_XPATHS; i++)
+  {
+    if ((filter->candidates & (1 << i)) && pgm_read_byte(filter->names[i] + filter->namePos))
+    {
+      filter->candidates &= ~(1 << i);
+    }
+  }
+  filter->inName = false;
+}
+
+uint16_t SonosUPnP::ethClient_browse(uint16_t index, BrowseItem *item, void (*itemCallback)(uint16_t index, BrowseItem *item), uint16_t *totalMatches)
+{
+  // The DIDL-Lite in <Result> is decoded on the fly and tokenized once more,
+  // which also decodes the values; only the current item is kept
+  BrowseItem noItem = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  if (!item) item = &noItem;
+  MarkupParser outer;
+  MarkupParser inner;
+  markupBegin(&outer);
+  markupBegin(&inner);
+  browseClear(item);
+  bool inResult = false;
+  bool inTotal = false;
+  bool inItem = false;
+  char *value = 0;
+  size_t valueSize = 0;
+  size_t valueLength = 0;
+  uint16_t count = 0;
+  int character;
+  char decoded;
+  char output;
+  while ((character = ethClient_read()) >= 0)
+  {
+    uint8_t event = markupParse(&outer, character, &decoded);
+    if (event == SONOS_MARKUP_START || event == SONOS_MARKUP_END)
+    {
+      for (; event != SONOS_MARKUP_NONE; event = markupNext(&outer))
+      {
+        inResult = event == SONOS_MARKUP_START && markupIs(&outer, p_Result);
+        inTotal = event == SONOS_MARKUP_START && markupIs(&outer, p_TotalMatches);
+      }
+      if (!inResult && !inTotal) ethClient_skipText();
+      continue;
+    }
+    if (event != SONOS_MARKUP_TEXT) continue;
+    if (inTotal)
+    {
+      if (totalMatches && decoded >= '0' && decoded <= '9') *totalMatches = *totalMatches * 10 + decoded - '0';
+      continue;
+    }
+    if (!inResult) continue;
+    event = markupParse(&inner, decoded, &output);
+    if (event == SONOS_MARKUP_TEXT)
+    {
+      if (value && valueLength + 1 < valueSize)
+      {
+        value[valueLength++] = output;
+        value[valueLength] = '\0';
+      }
+    }
+    else if (event == SONOS_MARKUP_ATTRIBUTE)
+    {
+      size_t idLength = item->id && item->idSize ? strlen(item->id) : 0;
+      if ((markupIs(&inner, p_DidlItem) || markupIs(&inner, p_DidlContainer)) &&
+          !strcmp_P(inner.attribute, p_DidlId) && idLength + 1 < item->idSize)
+      {
+        item->id[idLength++] = output;
+        item->id[idLength] = '\0';
+      }
+    }
+    else
+    {
+      for (; event != SONOS_MARKUP_NONE; event = markupNext(&inner))
+      {
+        value = 0;
+        if (markupIs(&inner, p_DidlItem) || markupIs(&inner, p_DidlContainer))
+        {
+          inItem = event == SONOS_MARKUP_START;
+          if (inItem) continue;
+          if (itemCallback) itemCallback(index + count, item);
+          count++;
+          browseClear(item);
+        }
+        else if (event == SONOS_MARKUP_START && inItem)
+        {
+          if (markupIs(&inner, p_DidlTitle)) { value = item->title; valueSize = item->titleSize; }
+          else if (markupIs(&inner, p_DidlCreator)) { value = item->artist; valueSize = item->artistSize; }
+          else if (markupIs(&inner, p_DidlAlbum)) { value = item->album; valueSize = item->albumSize; }
+          else if (markupIs(&inner, p_DidlRes)) { value = item->uri; valueSize = item->uriSize; }
+          // Only the first of repeated elements, e.g. res, is kept
+          if (value && (!valueSize || *value)) value = 0;
+          valueLength = 0;
+        }
+      }
+    }
+  }
+  return count;
+}
+
+void SonosUPnP::browseClear(BrowseItem *item)
+{
+  if (item->id && item->idSize) *item->id = '\0';
+  if (item->title && item->titleSize) *item->title = '\0';
+  if (item->artist && item->artistSize) *item->artist = '\0';
+  if (item->album && item->albumSize) *item->album = '\0';
+  if (item->uri && item->uriSize) *item->uri = '\0';
+}
+
+void SonosUPnP::markupBegin(MarkupParser *parser)
+{
+  parser->state = UPNP_MARKUP_IN_TEXT;
+  parser->endTag = false;
+  parser->emptyTag = false;
+  parser->nameLength = 0;
+  parser->attributeLength = 0;
+  parser->entityLength = 0;
+  *parser->name = '\0';
+  *parser->attribute = '\0';
+}
+
+uint8_t SonosUPnP::markupParse(MarkupParser *parser, char character, char *output)
+{
+  // Takes one character and returns what it completed: an entity decoded text
+  // or attribute value character in output, or a start or end tag;
+  // names longer than the buffer are cut and don't match any wanted name
+  switch (parser->state)
+  {
+    case UPNP_MARKUP_IN_TEXT:
+      if (character == '<')
+      {
+        parser->state = UPNP_MARKUP_IN_NAME;
+        parser->endTag = false;
+        parser->emptyTag = false;
+        parser->nameLength = 0;
+        return SONOS_MARKUP_NONE;
+      }
+      if (character == '&')
+      {
+        parser->state = UPNP_MARKUP_IN_ENTITY;
+        parser->entityState = UPNP_MARKUP_IN_TEXT;
+        parser->entityLength = 0;
+        return SONOS_MARKUP_NONE;
+      }
+      *output = character;
+      return SONOS_MARKUP_TEXT;
+    case UPNP_MARKUP_IN_ENTITY:
+      if (character != ';')
+      {
+        if (parser->entityLength < SONOS_MARKUP_ENTITY_SIZE - 1) parser->entity[parser->entityLength++] = character;
+        return SONOS_MARKUP_NONE;
+      }
+      parser->entity[parser->entityLength] = '\0';
+      parser->state = parser->entityState;
+      if (!strcmp(parser->entity, "lt")) *output = '<';
+      else if (!strcmp(parser->entity, "gt")) *output = '>';
+      else if (!strcmp(parser->entity, "amp")) *output = '&';
+      else if (!strcmp(parser->entity, "quot")) *output = '"';
+      else if (!strcmp(parser->entity, "apos")) *output = '\'';
+      else if (*parser->entity == '#')
+      {
+        // Numeric references beyond a single byte are replaced
+        bool hex = parser->entity[1] == 'x';
+        uint32_t code = strtoul(parser->entity + (hex ? 2 : 1), 0, hex ? 16 : 10);
+        *output = code < 0x100 ? code : '?';
+      }
+      else return SONOS_MARKUP_NONE;
+      return parser->state == UPNP_MARKUP_IN_TEXT ? SONOS_MARKUP_TEXT : SONOS_MARKUP_ATTRIBUTE;
+    case UPNP_MARKUP_IN_NAME:
+      if (character == '/' && !parser->nameLength)
+      {
+        parser->endTag = true;
+        return SONOS_MARKUP_NONE;
+      }
+      if (character != '>' && character != '/' && character != ' ' && character != '\t' && character != '\r' && character != '\n')
+      {
+        if (parser->nameLength < SONOS_MARKUP_NAME_SIZE - 1) parser->name[parser->nameLength++] = character;
+        return SONOS_MARKUP_NONE;
+      }
+      parser->name[parser->nameLength] = '\0';
+      parser->attributeLength = 0;
+      parser->state = UPNP_MARKUP_IN_ATTRIBUTES;
+      // The character that ended the name is handled as part of the attributes
+      // fall through
+    case UPNP_MARKUP_IN_ATTRIBUTES:
+      if (character == '>')
+      {
+        // A self-closing tag also ends, which markupNext() reports
+        parser->state = UPNP_MARKUP_IN_TEXT;
+        return parser->endTag ? SONOS_MARKUP_END : SONOS_MARKUP_START;
+      }
+      parser->emptyTag = character == '/';
+      if (character == '"' || character == '\'')
+      {
+        parser->attribute[parser->attributeLength] = '\0';
+        parser->quote = character;
+        parser->state = UPNP_MARKUP_IN_VALUE;
+      }
+      else if (character == ' ' || character == '\t' || character == '\r' || character == '\n' || character == '/')
+      {
+        parser->attributeLength = 0;
+      }
+      else if (character != '=' && parser->attributeLength < sizeof(parser->attribute) - 1)
+      {
+        parser->attribute[parser->attributeLength++] = character;
+      }
+      return SONOS_MARKUP_NONE;
+    case UPNP_MARKUP_IN_VALUE:
+      if (character == parser->quote)
+      {
+        parser->attributeLength = 0;
+        parser->state = UPNP_MARKUP_IN_ATTRIBUTES;
+        return SONOS_MARKUP_NONE;
+      }
+      if (character == '&')
+      {
+        parser->state = UPNP_MARKUP_IN_ENTITY;
+        parser->entityState = UPNP_MARKUP_IN_VALUE;
+        parser->entityLength = 0;
+        return SONOS_MARKUP_NONE;
+      }
+      *output = character;
+      return SONOS_MARKUP_ATTRIBUTE;
+  }
+  return SONOS_MARKUP_NONE;
+}
+
+uint8_t SonosUPnP::markupNext(MarkupParser *parser)
+{
+  // Called after a start tag, and again after each event it returns, until
+  // none is left; gives the end of a self-closing tag
+  if (!parser->emptyTag) return SONOS_MARKUP_NONE;
+  parser->emptyTag = false;
+  return SONOS_MARKUP_END;
+}
+
+bool SonosUPnP::markupIs(MarkupParser *parser, PGM_P name_P)
+{
+  return !strcmp_P(parser->name, name_P);
+}
+
+bool SonosUPnP::upnpGetString(IPAddress speakerIP, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value, PGM_P *path, uint8_t pathSize, char *resultBuffer, size_t resultBufferSize)
+{
+  bool found = false;
+  if (upnpPost(speakerIP, upnpMessageType, action_P, field, value, "", 0, 0, ""))
+  {
+    xPath.reset();
+    found = ethClient_xPath(path, pathSize, resultBuffer, resultBufferSize);
+    if (!found) requestFail(SONOS_ERROR_NO_VALUE);
+  }
+  ethClient_stop();
+  return found;
+}
+
+SonosUPnP::CacheEntry *SonosUPnP::cacheFind(IPAddress ip, bool create)
+{
+  // Reuses the least recently used entry when the speaker is not in the cache
+  CacheEntry *oldest = &cacheEntries[0];
+  for (uint8_t i = 0; i < SONOS_CACHE_SPEAKERS; i++)
+  {
+    CacheEntry *entry = &cacheEntries[i];
+    if (entry->ip == ip) return entry;
+    if (!oldest->valid) continue;
+    if (!entry->valid || (uint32_t)(millis() - entry->lastUsed) > (uint32_t)(millis() - oldest->lastUsed)) oldest = entry;
+  }
+  if (!create) return 0;
+  oldest->ip = ip;
+  oldest->valid = 0;
+  oldest->lastUsed = millis();
+  return oldest;
+}
+
+bool SonosUPnP::cacheGet(IPAddress ip, uint8_t field, int8_t *value)
+{
+  if (!cacheTTL[field]) return false;
+  CacheEntry *entry = cacheFind(ip, false);
+  if (entry && entry->valid & (1 << field) && (uint32_t)(millis() - entry->updated[field]) < cacheTTL[field])
+  {
+    // A hit answers the getter like a request that succeeded
+    entry->lastUsed = millis();
+    *value = entry->values[field];
+    cacheHits[field]++;
+    lastResult.error = SONOS_ERROR_NONE;
+    lastResult.httpStatus = 0;
+    lastResult.upnpError = 0;
+    return true;
+  }
+  cacheMisses[field]++;
+  return false;
+}
+
+void SonosUPnP::cacheSet(IPAddress ip, uint8_t field, int8_t value)
+{
+  if (!cacheTTL[field]) return;
+  CacheEntry *entry = cacheFind(ip, true);
+  entry->values[field] = value;
+  entry->updated[field] = millis();
+  entry->lastUsed = entry->updated[field];
+  entry->valid |= 1 << field;
+}
+
+void SonosUPnP::cacheInvalidate(IPAddress ip, uint8_t field)
+{
+  CacheEntry *entry = cacheFind(ip, false);
+  if (entry) entry->valid &= ~(1 << field);
 }
 
 uint32_t SonosUPnP::getTimeInSeconds(const char *time)
@@ -21,6 +21,7 @@
 #define SonosUPnP_h
 
 //#define SONOS_WRITE_ONLY_MODE
+//#define SONOS_STATS_MODE
 
 #include <Arduino.h>
 #if (defined(__AVR__))
@@ -31,34 +32,89 @@
 #ifndef SONOS_WRITE_ONLY_MODE
 #include "../../MicroXPath/src/MicroXPath_P.h"
 #endif
-#include "../../Ethernet/src/EthernetClient.h"
+#include "SonosTransport.h"
 
 // HTTP:
 #define HTTP_VERSION " HTTP/1.1\n"
-#define HEADER_HOST "Host: %d.%d.%d.%d:%d\n"
+#define HEADER_HOST "Host: "
 #define HEADER_CONTENT_TYPE "Content-Type: text/xml; charset=\"utf-8\"\n"
-#define HEADER_CONTENT_LENGTH "Content-Length: %d\n"
+#define HEADER_CONTENT_LENGTH "Content-Length: "
 #define HEADER_SOAP_ACTION "SOAPAction: \"urn:"
 #define HEADER_SOAP_ACTION_END "\"\n"
 #define HEADER_CONNECTION "Connection: close\n"
+#define HEADER_CONNECTION_KEEP_ALIVE "Connection: keep-alive\n"
+#define HEADER_CONTENT_LENGTH_NAME "content-length:"
+#define HEADER_CONNECTION_CLOSE_NAME "connection: close"
+// Status codes from here on are errors
+#define HTTP_STATUS_ERROR 300
+#define UPNP_HEADER_STATUS_DONE 4
 
 // SOAP tag data:
 #define SOAP_ENVELOPE_START "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
 #define SOAP_ENVELOPE_END "</s:Envelope>"
 #define SOAP_BODY_START "<s:Body>"
 #define SOAP_BODY_END "</s:Body>"
-#define SOAP_TAG_START "<%s>"
-#define SOAP_TAG_END "</%s>"
 #define SOAP_TAG_LEN 5
 #define SOAP_TAG_ENVELOPE "s:Envelope"
 #define SOAP_TAG_BODY "s:Body"
 
+// SOAP fault, sent with HTTP status 500:
+/*
+<s:Fault>
+  <faultcode>s:Client</faultcode>
+  <faultstring>UPnPError</faultstring>
+  <detail>
+    <UPnPError xmlns="urn:schemas-upnp-org:control-1-0">
+      <errorCode>701</errorCode>
+    </UPnPError>
+  </detail>
+</s:Fault>
+*/
+#define SOAP_TAG_FAULT "s:Fault"
+#define SOAP_TAG_DETAIL "detail"
+#define SOAP_TAG_UPNP_ERROR "UPnPError"
+#define SOAP_TAG_ERROR_CODE "errorCode"
+
 // UPnP config:
 #define UPNP_PORT 1400
-#define UPNP_MULTICAST_IP (byte[]) {239,255,255,250}
+#define UPNP_MULTICAST_IP IPAddress(239, 255, 255, 250)
 #define UPNP_MULTICAST_PORT 1900
 #define UPNP_MULTICAST_TIMEOUT_S 2
 #define UPNP_RESPONSE_TIMEOUT_MS 3000
+// Connects block; those of asynchronous requests are made from poll() and
+// given up sooner, so an offline speaker doesn't stall loop() for long
+#define UPNP_CONNECT_TIMEOUT_MS 1000
+#ifndef UPNP_ASYNC_CONNECT_TIMEOUT_MS
+  #define UPNP_ASYNC_CONNECT_TIMEOUT_MS 200
+#endif
+// Max number of values that can be read from one response in a single pass
+#define UPNP_MAX_XPATHS 8
+// Number of connections that can be open at the same time, either kept alive
+// or serving an asynchronous request
+#ifndef UPNP_MAX_CONNECTIONS
+  #if (defined(__AVR__))
+    #define UPNP_MAX_CONNECTIONS 2
+  #else
+    #define UPNP_MAX_CONNECTIONS 4
+  #endif
+#endif
+// Responses are read from the client in blocks of up to this size
+#ifndef UPNP_READ_BUFFER_SIZE
+  #if (defined(__AVR__))
+    #define UPNP_READ_BUFFER_SIZE 32
+  #else
+    #define UPNP_READ_BUFFER_SIZE 1460
+  #endif
+#endif
+// Requests are gathered in a write buffer of this size and sent whenever it
+// fills up, a buffer up to the TCP MSS (1460) sends a small request in one segment
+#ifndef UPNP_WRITE_BUFFER_SIZE
+  #if (defined(__AVR__))
+    #define UPNP_WRITE_BUFFER_SIZE 128
+  #else
+    #define UPNP_WRITE_BUFFER_SIZE 1460
+  #endif
+#endif
 
 // UPnP tag data:
 #define SOAP_ACTION_START_TAG_START "<u:"
@@ -66,7 +122,6 @@
 #define SOAP_ACTION_START_TAG_END "\">"
 #define SOAP_ACTION_END_TAG_START "</u:"
 #define SOAP_ACTION_END_TAG_END ">"
-#define SOAP_ACTION_TAG_LEN 24
 
 // UPnP service data:
 #define UPNP_URN_SCHEMA "schemas-upnp-org:service:"
@@ -79,6 +134,47 @@
 #define UPNP_DEVICE_PROPERTIES 3
 #define UPNP_DEVICE_PROPERTIES_SERVICE "DeviceProperties:1"
 #define UPNP_DEVICE_PROPERTIES_ENDPOINT "/DeviceProperties/Control"
+#define UPNP_GROUP_RENDERING_CONTROL 4
+#define UPNP_GROUP_RENDERING_CONTROL_SERVICE "GroupRenderingControl:1"
+#define UPNP_GROUP_RENDERING_CONTROL_ENDPOINT "/MediaRenderer/GroupRenderingControl/Control"
+#define UPNP_CONTENT_DIRECTORY 5
+#define UPNP_CONTENT_DIRECTORY_SERVICE "ContentDirectory:1"
+#define UPNP_CONTENT_DIRECTORY_ENDPOINT "/MediaServer/ContentDirectory/Control"
+#define UPNP_ZONE_GROUP_TOPOLOGY 6
+#define UPNP_ZONE_GROUP_TOPOLOGY_SERVICE "ZoneGroupTopology:1"
+#define UPNP_ZONE_GROUP_TOPOLOGY_ENDPOINT "/ZoneGroupTopology/Control"
+
+// UPnP request templates, the fixed parts of a request are concatenated per
+// service at compile time and runtime values are spliced in between them:
+/*
+POST /MediaRenderer/RenderingControl/Control HTTP/1.1        <- REQUEST_START
+Host: [192.168.0.201:1400]
+Content-Type: text/xml; charset="utf-8"                       <- HEADER_MID
+Content-Length: [323]
+SOAPAction: "urn:schemas-upnp-org:service:RenderingControl:1#  <- SOAP_ACTION
+[SetVolume]"                                                   <- HEADER_END
+Connection: keep-alive
+
+<s:Envelope ...><s:Body><u:[SetVolume]                         <- ACTION_NS
+ xmlns:u="urn:schemas-upnp-org:service:RenderingControl:1"><InstanceID>0</InstanceID>
+[<DesiredVolume>17</DesiredVolume><Channel>Master</Channel>]</u:[SetVolume]
+></s:Body></s:Envelope>                                        <- REQUEST_END
+*/
+#define UPNP_REQUEST_START(endpoint) "POST " endpoint HTTP_VERSION HEADER_HOST
+#define UPNP_REQUEST_HEADER_MID "\n" HEADER_CONTENT_TYPE HEADER_CONTENT_LENGTH
+#define UPNP_REQUEST_SOAP_ACTION(service) "\n" HEADER_SOAP_ACTION UPNP_URN_SCHEMA service "#"
+#define UPNP_REQUEST_HEADER_END(connection) HEADER_SOAP_ACTION_END connection "\n" SOAP_ENVELOPE_START SOAP_BODY_START SOAP_ACTION_START_TAG_START
+#define UPNP_REQUEST_ACTION_NS(service) UPNP_REQUEST_SERVICE_NS(service) SONOS_INSTANCE_ID_0_TAG
+// Services without instances, e.g. ContentDirectory and ZoneGroupTopology, take no InstanceID argument
+#define UPNP_REQUEST_SERVICE_NS(service) SOAP_ACTION_START_TAG_NS UPNP_URN_SCHEMA service SOAP_ACTION_START_TAG_END
+#define UPNP_REQUEST_END SOAP_ACTION_END_TAG_END SOAP_BODY_END SOAP_ENVELOPE_END
+// Constant part of the content length, the action name and arguments are added at runtime
+#define UPNP_REQUEST_BODY_LEN(service) UPNP_REQUEST_BODY_LEN_NS(UPNP_REQUEST_ACTION_NS(service))
+#define UPNP_REQUEST_BODY_LEN_NS(actionNs) ( \
+  sizeof(SOAP_ENVELOPE_START SOAP_BODY_START SOAP_ACTION_START_TAG_START) - 1 + \
+  sizeof(actionNs) - 1 + \
+  sizeof(SOAP_ACTION_END_TAG_START) - 1 + \
+  sizeof(UPNP_REQUEST_END) - 1)
 
 // Sonos speaker state control:
 /*
@@ -115,8 +211,41 @@
 #define SONOS_TAG_CURRENT_URI "CurrentURI"
 #define SONOS_URI_META_LIGHT_START "<CurrentURIMetaData>"
 #define SONOS_URI_META_LIGHT_END "</CurrentURIMetaData>"
-#define SONOS_RADIO_META_FULL_START "<CurrentURIMetaData>&lt;DIDL-Lite xmlns:dc=&quot;http://purl.org/dc/elements/1.1/&quot; xmlns:upnp=&quot;urn:schemas-upnp-org:metadata-1-0/upnp/&quot; xmlns:r=&quot;urn:schemas-rinconnetworks-com:metadata-1-0/&quot; xmlns=&quot;urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/&quot;&gt;&lt;item id=&quot;R:0/0/46&quot; parentID=&quot;R:0/0&quot; restricted=&quot;true&quot;&gt;&lt;dc:title&gt;"
-#define SONOS_RADIO_META_FULL_END "&lt;/dc:title&gt;&lt;upnp:class&gt;object.item.audioItem.audioBroadcast&lt;/upnp:class&gt;&lt;desc id=&quot;cdudn&quot; nameSpace=&quot;urn:schemas-rinconnetworks-com:metadata-1-0/&quot;&gt;SA_RINCON65031_&lt;/desc&gt;&lt;/item&gt;&lt;/DIDL-Lite&gt;</CurrentURIMetaData>"
+
+// DIDL-Lite meta data, entity escaped inside CurrentURIMetaData or
+// EnqueuedURIMetaData, so the values in it are escaped twice:
+/*
+<DIDL-Lite xmlns:dc="http://purl.org/dc/elements/1.1/" xmlns:upnp="urn:schemas-upnp-org:metadata-1-0/upnp/" xmlns:r="urn:schemas-rinconnetworks-com:metadata-1-0/" xmlns="urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/">
+  <item id="-1" parentID="-1" restricted="true">
+    <dc:title>Rock &amp; Roll</dc:title>
+    <dc:creator>Artist</dc:creator>
+    <upnp:album>Album</upnp:album>
+    <upnp:albumArtURI>http://server/art.jpg</upnp:albumArtURI>
+    <upnp:class>object.item.audioItem.musicTrack</upnp:class>
+    <desc id="cdudn" nameSpace="urn:schemas-rinconnetworks-com:metadata-1-0/">SA_RINCON65031_</desc>
+  </item>
+</DIDL-Lite>
+*/
+#define SONOS_META_START "&lt;DIDL-Lite xmlns:dc=&quot;http://purl.org/dc/elements/1.1/&quot; xmlns:upnp=&quot;urn:schemas-upnp-org:metadata-1-0/upnp/&quot; xmlns:r=&quot;urn:schemas-rinconnetworks-com:metadata-1-0/&quot; xmlns=&quot;urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/&quot;&gt;&lt;item id=&quot;-1&quot; parentID=&quot;-1&quot; restricted=&quot;true&quot;&gt;"
+#define SONOS_META_END "&lt;/item&gt;&lt;/DIDL-Lite&gt;"
+#define SONOS_META_TAG_OPEN "&lt;"
+#define SONOS_META_TAG_CLOSE "&lt;/"
+#define SONOS_META_TAG_END "&gt;"
+#define SONOS_META_TITLE "dc:title"
+#define SONOS_META_CREATOR "dc:creator"
+#define SONOS_META_ALBUM "upnp:album"
+#define SONOS_META_ALBUM_ART_URI "upnp:albumArtURI"
+#define SONOS_META_CLASS "upnp:class"
+#define SONOS_META_DESC "desc"
+#define SONOS_META_DESC_START "&lt;desc id=&quot;cdudn&quot; nameSpace=&quot;urn:schemas-rinconnetworks-com:metadata-1-0/&quot;&gt;"
+#define SONOS_META_ESCAPED_AMP "&amp;amp;"
+#define SONOS_META_ESCAPED_LT "&amp;lt;"
+#define SONOS_META_ESCAPED_GT "&amp;gt;"
+#define SONOS_META_ESCAPED_QUOT "&amp;quot;"
+#define SONOS_META_CLASS_TRACK "object.item.audioItem.musicTrack"
+#define SONOS_META_CLASS_RADIO "object.item.audioItem.audioBroadcast"
+#define SONOS_META_CLASS_PLAYLIST "object.container.playlistContainer"
+#define SONOS_META_DESC_RADIO "SA_RINCON65031_"
 
 #define SONOS_TAG_BECOME_COORDINATOR_OF_STANDALONE_GROUP "BecomeCoordinatorOfStandaloneGroup"
 
@@ -137,6 +266,8 @@
 #define SONOS_TAG_REMOVE_ALL_TRACKS_FROM_QUEUE "RemoveAllTracksFromQueue"
 #define SONOS_PLAYLIST_META_LIGHT_START "<EnqueuedURIMetaData></EnqueuedURIMetaData><DesiredFirstTrackNumberEnqueued>"
 #define SONOS_PLAYLIST_META_LIGHT_END "0</DesiredFirstTrackNumberEnqueued><EnqueueAsNext>1</EnqueueAsNext>"
+#define SONOS_QUEUE_META_START "<EnqueuedURIMetaData>"
+#define SONOS_QUEUE_META_END "</EnqueuedURIMetaData><DesiredFirstTrackNumberEnqueued>0</DesiredFirstTrackNumberEnqueued><EnqueueAsNext>1</EnqueueAsNext>"
 //#define SONOS_PLAYLIST_META_FULL_START "<EnqueuedURIMetaData>&lt;DIDL-Lite xmlns:dc=&quot;http://purl.org/dc/elements/1.1/&quot; xmlns:upnp=&quot;urn:schemas-upnp-org:metadata-1-0/upnp/&quot; xmlns:r=&quot;urn:schemas-rinconnetworks-com:metadata-1-0/&quot; xmlns=&quot;urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/&quot;&gt;&lt;item id=&quot;SQ:0&quot; parentID=&quot;SQ:&quot; restricted=&quot;true&quot;&gt;&lt;dc:title&gt;"
 //#define SONOS_PLAYLIST_META_FULL_END "&lt;/dc:title&gt;&lt;upnp:class&gt;object.container.playlistContainer&lt;/upnp:class&gt;&lt;desc id=&quot;cdudn&quot; nameSpace=&quot;urn:schemas-rinconnetworks-com:metadata-1-0/&quot;&gt;RINCON_AssociatedZPUDN&lt;/desc&gt;&lt;/item&gt;&lt;/DIDL-Lite&gt;</EnqueuedURIMetaData><DesiredFirstTrackNumberEnqueued>0</DesiredFirstTrackNumberEnqueued><EnqueueAsNext>1</EnqueueAsNext>"
 
@@ -145,7 +276,18 @@
 <u:GetPositionInfoResponse>
   <Track>1</Track>
   <TrackDuration>0:03:21</TrackDuration>
-  <TrackMetaData>[Meta data in DIDL-Lite]</TrackMetaData>
+  <TrackMetaData>
+    &lt;DIDL-Lite ...&gt;
+      &lt;item id="-1" parentID="-1" restricted="true"&gt;
+        &lt;res protocolInfo="sonos.com-http:*:audio/mp4:*"&gt;x-sonosapi-hls:...&lt;/res&gt;
+        &lt;r:streamContent&gt;Artist - Song&lt;/r:streamContent&gt;
+        &lt;upnp:albumArtURI&gt;/getaa?s=1&amp;amp;u=...&lt;/upnp:albumArtURI&gt;
+        &lt;dc:title&gt;Rock &amp;amp; Roll&lt;/dc:title&gt;
+        &lt;dc:creator&gt;Artist&lt;/dc:creator&gt;
+        &lt;upnp:album&gt;Album&lt;/upnp:album&gt;
+      &lt;/item&gt;
+    &lt;/DIDL-Lite&gt;
+  </TrackMetaData>
   <TrackURI></TrackURI>
   <RelTime>0:01:23</RelTime>
   <AbsTime>NOT_IMPLEMENTED</AbsTime>
@@ -158,6 +300,7 @@
 #define SONOS_TAG_TRACK "Track"
 #define SONOS_TAG_TRACK_DURATION "TrackDuration"
 #define SONOS_TAG_TRACK_URI "TrackURI"
+#define SONOS_TAG_TRACK_META_DATA "TrackMetaData"
 #define SONOS_TAG_REL_TIME "RelTime"
 #define SONOS_SOURCE_UNKNOWN 0
 #define SONOS_SOURCE_FILE 1
@@ -227,6 +370,61 @@
 #define SONOS_CHANNEL_TAG_START "<Channel>"
 #define SONOS_CHANNEL_TAG_END "</Channel>"
 
+// Group volume, sent to the group coordinator:
+/*
+<u:SetGroupVolume>
+  <InstanceID>0</InstanceID>
+  <DesiredVolume>[0-100]</DesiredVolume>
+</u:SetGroupVolume>
+<u:SetRelativeGroupVolume>
+  <InstanceID>0</InstanceID>
+  <Adjustment>[-100-100]</Adjustment>
+</u:SetRelativeGroupVolume>
+*/
+#define SONOS_TAG_SET_GROUP_VOLUME "SetGroupVolume"
+#define SONOS_TAG_SET_RELATIVE_GROUP_VOLUME "SetRelativeGroupVolume"
+#define SONOS_TAG_ADJUSTMENT "Adjustment"
+
+// Relative volume and volume ramps:
+/*
+<u:SetRelativeVolume>
+  <InstanceID>0</InstanceID>
+  <Channel>Master</Channel>
+  <Adjustment>[-100-100]</Adjustment>
+</u:SetRelativeVolume>
+<u:SetRelativeVolumeResponse>
+  <NewVolume>[0-100]</NewVolume>
+</u:SetRelativeVolumeResponse>
+<u:RampToVolume>
+  <InstanceID>0</InstanceID>
+  <Channel>Master</Channel>
+  <RampType>[SLEEP_TIMER_RAMP_TYPE/ALARM_RAMP_TYPE/AUTOPLAY_RAMP_TYPE]</RampType>
+  <DesiredVolume>[0-100]</DesiredVolume>
+  <ResetVolumeAfter>0</ResetVolumeAfter>
+  <ProgramURI></ProgramURI>
+</u:RampToVolume>
+<u:RampToVolumeResponse>
+  <RampTime>[seconds]</RampTime>
+</u:RampToVolumeResponse>
+*/
+#define SONOS_TAG_SET_RELATIVE_VOLUME "SetRelativeVolume"
+#define SONOS_TAG_SET_RELATIVE_VOLUME_RESPONSE "u:SetRelativeVolumeResponse"
+#define SONOS_TAG_NEW_VOLUME "NewVolume"
+#define SONOS_TAG_RAMP_TO_VOLUME "RampToVolume"
+#define SONOS_TAG_RAMP_TO_VOLUME_RESPONSE "u:RampToVolumeResponse"
+#define SONOS_TAG_RAMP_TIME "RampTime"
+#define SONOS_RAMP_TAG_START "<Channel>Master</Channel><RampType>"
+#define SONOS_RAMP_TAG_END "</RampType><ResetVolumeAfter>0</ResetVolumeAfter><ProgramURI></ProgramURI>"
+// Slowly from the current volume, as when a sleep timer ends
+#define SONOS_RAMP_SLEEP_TIMER 0
+#define SONOS_RAMP_SLEEP_TIMER_VALUE "SLEEP_TIMER_RAMP_TYPE"
+// From zero after a pause, as an alarm starts
+#define SONOS_RAMP_ALARM 1
+#define SONOS_RAMP_ALARM_VALUE "ALARM_RAMP_TYPE"
+// Quickly from zero
+#define SONOS_RAMP_AUTOPLAY 2
+#define SONOS_RAMP_AUTOPLAY_VALUE "AUTOPLAY_RAMP_TYPE"
+
 // Play Mode:
 /*
 <u:GetTransportSettingsResponse>
@@ -267,6 +465,136 @@
 #define SONOS_STATE_STOPPED 3
 #define SONOS_STATE_STOPPED_VALUE "STOPPED"
 
+// Queue and saved queue browsing, the DIDL-Lite result is entity escaped and
+// its values once more:
+/*
+<u:Browse>
+  <ObjectID>[Q:0/SQ:/SQ:3]</ObjectID>
+  <BrowseFlag>BrowseDirectChildren</BrowseFlag>
+  <Filter>dc:title,res,dc:creator,upnp:album</Filter>
+  <StartingIndex>0</StartingIndex>
+  <RequestedCount>20</RequestedCount>
+  <SortCriteria></SortCriteria>
+</u:Browse>
+<u:BrowseResponse>
+  <Result>
+    &lt;DIDL-Lite xmlns:dc="http://purl.org/dc/elements/1.1/" ...&gt;
+      &lt;item id="Q:0/1" parentID="Q:0" restricted="true"&gt;
+        &lt;res protocolInfo="x-file-cifs:*:audio/mpeg:*"&gt;x-file-cifs://server/music/track.mp3&lt;/res&gt;
+        &lt;dc:title&gt;Rock &amp;amp; Roll&lt;/dc:title&gt;
+        &lt;dc:creator&gt;Artist&lt;/dc:creator&gt;
+        &lt;upnp:album&gt;Album&lt;/upnp:album&gt;
+      &lt;/item&gt;
+    &lt;/DIDL-Lite&gt;
+  </Result>
+  <NumberReturned>1</NumberReturned>
+  <TotalMatches>12</TotalMatches>
+  <UpdateID>3</UpdateID>
+</u:BrowseResponse>
+*/
+#define SONOS_BROWSE_QUEUE "Q:0"
+#define SONOS_BROWSE_SAVED_QUEUES "SQ:"
+#define SONOS_TAG_BROWSE "Browse"
+#define SONOS_TAG_OBJECT_ID "ObjectID"
+#define SONOS_BROWSE_START "<BrowseFlag>BrowseDirectChildren</BrowseFlag><Filter>dc:title,res,dc:creator,upnp:album</Filter><StartingIndex>"
+#define SONOS_BROWSE_MID "</StartingIndex><RequestedCount>"
+#define SONOS_BROWSE_END "</RequestedCount><SortCriteria></SortCriteria>"
+#define SONOS_TAG_RESULT "Result"
+#define SONOS_TAG_TOTAL_MATCHES "TotalMatches"
+#define SONOS_DIDL_ITEM "item"
+#define SONOS_DIDL_CONTAINER "container"
+#define SONOS_DIDL_ID "id"
+#define SONOS_DIDL_TITLE "dc:title"
+#define SONOS_DIDL_CREATOR "dc:creator"
+#define SONOS_DIDL_ALBUM "upnp:album"
+#define SONOS_DIDL_RES "res"
+#define SONOS_DIDL_ALBUM_ART_URI "upnp:albumArtURI"
+#define SONOS_DIDL_STREAM_CONTENT "r:streamContent"
+#define SONOS_MARKUP_NAME_SIZE 20
+#define SONOS_MARKUP_ENTITY_SIZE 8
+#define SONOS_MARKUP_ATTRIBUTE_SIZE 12
+#define SONOS_MARKUP_NONE 0
+#define SONOS_MARKUP_TEXT 1
+#define SONOS_MARKUP_START 2
+#define SONOS_MARKUP_END 3
+#define SONOS_MARKUP_ATTRIBUTE 4
+#define UPNP_MARKUP_IN_TEXT 0
+#define UPNP_MARKUP_IN_ENTITY 1
+#define UPNP_MARKUP_IN_NAME 2
+#define UPNP_MARKUP_IN_ATTRIBUTES 3
+#define UPNP_MARKUP_IN_VALUE 4
+
+// Asynchronous requests:
+#define SONOS_ASYNC_IDLE 0
+#define SONOS_ASYNC_PENDING 1
+#define SONOS_ASYNC_DONE 2
+#define SONOS_ASYNC_FAILED 3
+#define SONOS_ASYNC_SET 0
+#define SONOS_ASYNC_GET_STATE 1
+#define SONOS_ASYNC_GET_PLAY_MODE 2
+#define SONOS_ASYNC_GET_TRACK_NUMBER 3
+#define SONOS_ASYNC_GET_TRACK_DURATION 4
+#define SONOS_ASYNC_GET_TRACK_POSITION 5
+#define SONOS_ASYNC_GET_MUTE 6
+#define SONOS_ASYNC_GET_VOLUME 7
+#define SONOS_ASYNC_GET_BASS 8
+#define SONOS_ASYNC_GET_TREBLE 9
+#define SONOS_ASYNC_GET_LOUDNESS 10
+#define SONOS_ASYNC_SET_RELATIVE_VOLUME 11
+#define SONOS_ASYNC_RAMP_TO_VOLUME 12
+#define UPNP_ASYNC_CONNECT 4
+#define UPNP_ASYNC_HEADER 5
+#define UPNP_ASYNC_BODY 6
+#define UPNP_ASYNC_VALUE_SIZE 8
+#define UPNP_ASYNC_RESULT_SIZE 20
+
+// State cache fields, each has its own TTL where 0 (default) disables caching
+#define SONOS_CACHE_STATE 0
+#define SONOS_CACHE_PLAY_MODE 1
+#define SONOS_CACHE_VOLUME 2
+#define SONOS_CACHE_MUTE 3
+#define SONOS_CACHE_BASS 4
+#define SONOS_CACHE_TREBLE 5
+#define SONOS_CACHE_LOUDNESS 6
+#define SONOS_CACHE_FIELDS 7
+#ifndef SONOS_CACHE_SPEAKERS
+  #if (defined(__AVR__))
+    #define SONOS_CACHE_SPEAKERS 2
+  #else
+    #define SONOS_CACHE_SPEAKERS 8
+  #endif
+#endif
+
+// Request statistics and trace, kept with SONOS_STATS_MODE; the time histogram
+// buckets end at 1, 2, 5, 10, 20, 50, 100, 200 and 500 ms, the last one is open
+#define SONOS_STATS_BUCKETS 10
+#ifndef SONOS_STATS_SPEAKERS
+  #if (defined(__AVR__))
+    #define SONOS_STATS_SPEAKERS 2
+  #else
+    #define SONOS_STATS_SPEAKERS 8
+  #endif
+#endif
+#ifndef SONOS_STATS_ACTIONS
+  #if (defined(__AVR__))
+    #define SONOS_STATS_ACTIONS 4
+  #else
+    #define SONOS_STATS_ACTIONS 24
+  #endif
+#endif
+#define SONOS_ERROR_NONE 0
+#define SONOS_ERROR_NO_CONNECTION 1
+#define SONOS_ERROR_CONNECT 2
+#define SONOS_ERROR_TIMEOUT 3
+#define SONOS_ERROR_CLOSED 4
+#define SONOS_ERROR_NO_VALUE 5
+#define SONOS_ERROR_HTTP 6
+#define SONOS_ERROR_UPNP 7
+// Retries of failed requests, off by default; the wait before retry n is
+// backoff * 2^n, of which the last half is random
+#define SONOS_RETRY_MAX 5
+#define SONOS_RETRY_BACKOFF_MS 100
+
 struct TrackInfo
 {
   uint16_t number;
@@ -275,53 +603,153 @@ struct TrackInfo
   char *uri;
 };
 
+struct TrackMetaData
+{
+  char *title;
+  size_t titleSize;
+  char *artist;
+  size_t artistSize;
+  char *album;
+  size_t albumSize;
+  char *albumArtURI;
+  size_t albumArtURISize;
+  char *streamContent;
+  size_t streamContentSize;
+};
+
+struct SonosResult
+{
+  uint8_t error;
+  uint16_t httpStatus;
+  uint16_t upnpError;
+};
+
+struct SonosStats
+{
+  uint32_t requests;
+  uint32_t failures;
+  uint32_t connectFailures;
+  uint32_t timeouts;
+  uint32_t bytesSent;
+  uint32_t bytesReceived;
+  uint16_t connectTime[SONOS_STATS_BUCKETS];
+  uint16_t firstByteTime[SONOS_STATS_BUCKETS];
+  uint16_t totalTime[SONOS_STATS_BUCKETS];
+};
+
+struct MetaData
+{
+  const char *title;
+  const char *artist;
+  const char *album;
+  const char *albumArtURI;
+  const char *itemClass;
+  const char *desc;
+};
+
+struct BrowseItem
+{
+  char *id;
+  size_t idSize;
+  char *title;
+  size_t titleSize;
+  char *artist;
+  size_t artistSize;
+  char *album;
+  size_t albumSize;
+  char *uri;
+  size_t uriSize;
+};
+
+class SonosBatch;
+class SonosTopology;
+
 class SonosUPnP
 {
 
   public:
 
-    SonosUPnP(EthernetClient client, void (*ethernetErrCallback)(void));
-
-    void setAVTransportURI(IPAddress speakerIP, const char *scheme, const char *address);
-    void seekTrack(IPAddress speakerIP, uint16_t index);
-    void seekTime(IPAddress speakerIP, uint8_t hour, uint8_t minute, uint8_t second);
-    void setPlayMode(IPAddress speakerIP, uint8_t playMode);
-    void play(IPAddress speakerIP);
-    void playFile(IPAddress speakerIP, const char *path);
-    void playHttp(IPAddress speakerIP, const char *address);
-    void playRadio(IPAddress speakerIP, const char *address, const char *title);
-    void playLineIn(IPAddress speakerIP, const char *speakerID);
-    void playQueue(IPAddress speakerIP, const char *speakerID);
-    void playConnectToMaster(IPAddress speakerIP, const char *masterSpeakerID);
-    void disconnectFromMaster(IPAddress speakerIP);
-    void stop(IPAddress speakerIP);
-    void pause(IPAddress speakerIP);
-    void skip(IPAddress speakerIP, uint8_t direction);
-    void setMute(IPAddress speakerIP, bool state);
-    void setVolume(IPAddress speakerIP, uint8_t volume);
-    void setVolume(IPAddress speakerIP, uint8_t volume, const char *channel);
-    void setBass(IPAddress speakerIP, int8_t bass);
-    void setTreble(IPAddress speakerIP, int8_t treble);
-    void setLoudness(IPAddress speakerIP, bool state);
-    void setStatusLight(IPAddress speakerIP, bool state);
-    void addPlaylistToQueue(IPAddress speakerIP, uint16_t playlistIndex);
-    void addTrackToQueue(IPAddress speakerIP, const char *scheme, const char *address);
-    void removeAllTracksFromQueue(IPAddress speakerIP);
+    SonosUPnP(SonosClient client, void (*ethernetErrCallback)(void));
+
+    void setKeepAlive(bool keepAlive);
+    void setEarlyAbort(bool earlyAbort);
+    void setFireAndForget(bool fireAndForget);
+    void closeConnections();
+    void setRetry(uint8_t retries, uint16_t backoff);
+    const SonosResult *getLastResult();
+    uint8_t getLastError();
+
+    void setAsyncCallback(void (*asyncCallback)(int8_t handle, IPAddress speakerIP, uint8_t request, bool success, int32_t value));
+    bool poll();
+    uint8_t getAsyncStatus(int8_t handle);
+    int32_t endAsync(int8_t handle);
+    const SonosResult *getAsyncResult(int8_t handle);
+    int8_t beginPlay(IPAddress speakerIP);
+    int8_t beginPause(IPAddress speakerIP);
+    int8_t beginStop(IPAddress speakerIP);
+    int8_t beginSkip(IPAddress speakerIP, uint8_t direction);
+    int8_t beginSetMute(IPAddress speakerIP, bool state);
+    int8_t beginSetVolume(IPAddress speakerIP, uint8_t volume);
+    int8_t beginSetBass(IPAddress speakerIP, int8_t bass);
+    int8_t beginSetTreble(IPAddress speakerIP, int8_t treble);
+    int8_t beginSetLoudness(IPAddress speakerIP, bool state);
+    int8_t beginSetRelativeVolume(IPAddress speakerIP, int8_t adjustment);
+    int8_t beginRampToVolume(IPAddress speakerIP, uint8_t volume, uint8_t rampType);
+    uint8_t playMany(const IPAddress *speakerIPs, uint8_t count, bool *results);
+    uint8_t pauseMany(const IPAddress *speakerIPs, uint8_t count, bool *results);
+    uint8_t stopMany(const IPAddress *speakerIPs, uint8_t count, bool *results);
+    uint8_t setMuteMany(const IPAddress *speakerIPs, uint8_t count, bool state, bool *results);
+    uint8_t setVolumeMany(const IPAddress *speakerIPs, uint8_t count, uint8_t volume, bool *results);
+
+    bool setAVTransportURI(IPAddress speakerIP, const char *scheme, const char *address);
+    bool setAVTransportURI(IPAddress speakerIP, const char *scheme, const char *address, const MetaData *meta);
+    bool seekTrack(IPAddress speakerIP, uint16_t index);
+    bool seekTime(IPAddress speakerIP, uint8_t hour, uint8_t minute, uint8_t second);
+    bool setPlayMode(IPAddress speakerIP, uint8_t playMode);
+    bool play(IPAddress speakerIP);
+    bool playFile(IPAddress speakerIP, const char *path);
+    bool playHttp(IPAddress speakerIP, const char *address);
+    bool playRadio(IPAddress speakerIP, const char *address, const char *title);
+    bool playLineIn(IPAddress speakerIP, const char *speakerID);
+    bool playQueue(IPAddress speakerIP, const char *speakerID);
+    bool playConnectToMaster(IPAddress speakerIP, const char *masterSpeakerID);
+    bool disconnectFromMaster(IPAddress speakerIP);
+    bool stop(IPAddress speakerIP);
+    bool pause(IPAddress speakerIP);
+    bool skip(IPAddress speakerIP, uint8_t direction);
+    bool setMute(IPAddress speakerIP, bool state);
+    bool setVolume(IPAddress speakerIP, uint8_t volume);
+    bool setVolume(IPAddress speakerIP, uint8_t volume, const char *channel);
+    bool setBass(IPAddress speakerIP, int8_t bass);
+    bool setTreble(IPAddress speakerIP, int8_t treble);
+    bool setLoudness(IPAddress speakerIP, bool state);
+    bool setGroupVolume(IPAddress coordinatorIP, uint8_t volume);
+    bool setRelativeGroupVolume(IPAddress coordinatorIP, int8_t adjustment);
+    bool setRelativeVolume(IPAddress speakerIP, int8_t adjustment);
+    bool rampToVolume(IPAddress speakerIP, uint8_t volume, uint8_t rampType);
+    bool setStatusLight(IPAddress speakerIP, bool state);
+    bool addPlaylistToQueue(IPAddress speakerIP, uint16_t playlistIndex);
+    bool addTrackToQueue(IPAddress speakerIP, const char *scheme, const char *address);
+    bool addTrackToQueue(IPAddress speakerIP, const char *scheme, const char *address, const MetaData *meta);
+    bool removeAllTracksFromQueue(IPAddress speakerIP);
     
     #ifndef SONOS_WRITE_ONLY_MODE
     
-    void setRepeat(IPAddress speakerIP, bool repeat);
-    void setShuffle(IPAddress speakerIP, bool shuffle);
-    void toggleRepeat(IPAddress speakerIP);
-    void toggleShuffle(IPAddress speakerIP);
-    void togglePause(IPAddress speakerIP);
-    void toggleMute(IPAddress speakerIP);
-    void toggleLoudness(IPAddress speakerIP);
+    bool setRepeat(IPAddress speakerIP, bool repeat);
+    bool setShuffle(IPAddress speakerIP, bool shuffle);
+    bool toggleRepeat(IPAddress speakerIP);
+    bool toggleShuffle(IPAddress speakerIP);
+    bool togglePause(IPAddress speakerIP);
+    bool toggleMute(IPAddress speakerIP);
+    bool toggleLoudness(IPAddress speakerIP);
     uint8_t getState(IPAddress speakerIP);
     uint8_t getPlayMode(IPAddress speakerIP);
     bool getRepeat(IPAddress speakerIP);
     bool getShuffle(IPAddress speakerIP);
     TrackInfo getTrackInfo(IPAddress speakerIP, char *uriBuffer, size_t uriBufferSize);
+    TrackInfo getTrackInfo(IPAddress speakerIP, char *uriBuffer, size_t uriBufferSize, TrackMetaData *trackMetaData);
+    bool getPositionInfo(IPAddress speakerIP, TrackInfo *trackInfo, char *uriBuffer, size_t uriBufferSize);
+    bool getPositionInfo(IPAddress speakerIP, TrackInfo *trackInfo, char *uriBuffer, size_t uriBufferSize, TrackMetaData *trackMetaData);
     uint16_t getTrackNumber(IPAddress speakerIP);
     void getTrackURI(IPAddress speakerIP, char *resultBuffer, size_t resultBufferSize);
     uint8_t getSource(IPAddress speakerIP);
@@ -336,31 +764,296 @@ class SonosUPnP
     int8_t getBass(IPAddress speakerIP);
     int8_t getTreble(IPAddress speakerIP);
     bool getLoudness(IPAddress speakerIP);
+    uint16_t browse(IPAddress speakerIP, const char *objectID, uint16_t start, uint16_t count, BrowseItem *item, void (*itemCallback)(uint16_t index, BrowseItem *item), uint16_t *totalMatches);
+    uint16_t browseQueue(IPAddress speakerIP, uint16_t start, uint16_t count, BrowseItem *item, void (*itemCallback)(uint16_t index, BrowseItem *item), uint16_t *totalMatches);
+    uint16_t browseSavedQueues(IPAddress speakerIP, uint16_t start, uint16_t count, BrowseItem *item, void (*itemCallback)(uint16_t index, BrowseItem *item), uint16_t *totalMatches);
+    int8_t beginGetState(IPAddress speakerIP);
+    int8_t beginGetPlayMode(IPAddress speakerIP);
+    int8_t beginGetTrackNumber(IPAddress speakerIP);
+    int8_t beginGetTrackDuration(IPAddress speakerIP);
+    int8_t beginGetTrackPosition(IPAddress speakerIP);
+    int8_t beginGetMute(IPAddress speakerIP);
+    int8_t beginGetVolume(IPAddress speakerIP);
+    int8_t beginGetBass(IPAddress speakerIP);
+    int8_t beginGetTreble(IPAddress speakerIP);
+    int8_t beginGetLoudness(IPAddress speakerIP);
+    void setTopology(SonosTopology *topology);
+    void setCacheTTL(uint8_t field, uint16_t ttl);
+    void clearCache();
+    void clearCache(IPAddress speakerIP);
+    uint32_t getCacheHits(uint8_t field);
+    uint32_t getCacheMisses(uint8_t field);
+    void resetCacheStats();
     
     #endif
 
+    #ifdef SONOS_STATS_MODE
+
+    void setTraceCallback(void (*traceCallback)(IPAddress speakerIP, PGM_P action_P, uint8_t error, uint32_t time));
+    const SonosStats *getStats();
+    const SonosStats *getSpeakerStats(IPAddress speakerIP);
+    const SonosStats *getActionStats(const char *action);
+    const SonosStats *getActionStats(uint8_t index, PGM_P *action_P);
+    void resetStats();
+    static uint32_t getStatsBucketLimit(uint8_t bucket);
+
+    #endif
+
   private:
 
-    EthernetClient ethClient;
+    friend class SonosBatch;
+    friend class SonosTopology;
+    friend class SonosHousehold;
+    friend class SonosFade;
+
+    struct RequestTemplate
+    {
+      PGM_P start_P;
+      PGM_P soapAction_P;
+      PGM_P actionNs_P;
+      uint8_t startLength;
+      uint8_t soapActionLength;
+      uint8_t actionNsLength;
+      uint16_t bodyLength;
+    };
+
+    static const RequestTemplate requestTemplates[];
+
+    struct MetaWriter
+    {
+      bool send;
+      char *buffer;
+      uint16_t length;
+    };
+
+    struct Connection
+    {
+      SonosClient client;
+      IPAddress ip;
+      uint32_t lastUsed;
+      int32_t bodyLeft;
+      bool reusable;
+      uint8_t headerLineLength;
+      uint8_t headerLengthPos;
+      uint8_t headerClosePos;
+      // Asynchronous request
+      uint8_t state;
+      uint8_t request;
+      uint8_t upnpMessageType;
+      bool reused;
+      bool found;
+      bool owned;
+      bool detached;
+      PGM_P action_P;
+      const char *field;
+      char value[UPNP_ASYNC_VALUE_SIZE];
+      PGM_P extraStart_P;
+      PGM_P extraEnd_P;
+      const char *extraValue;
+      SonosResult requestResult;
+      uint8_t headerStatusPos;
+      #ifndef SONOS_WRITE_ONLY_MODE
+      // Response value, or the UPnP error code of a fault
+      PGM_P path[6];
+      MicroXPath_P xPath;
+      char result[UPNP_ASYNC_RESULT_SIZE];
+      #endif
+      #ifdef SONOS_STATS_MODE
+      PGM_P statsAction_P;
+      uint32_t statsStart;
+      uint32_t statsConnectTime;
+      uint32_t statsFirstByteTime;
+      uint32_t statsSent;
+      uint32_t statsReceived;
+      bool statsConnected;
+      bool statsFirstByte;
+      #endif
+    };
+
+    Connection connections[UPNP_MAX_CONNECTIONS];
+    Connection *connection;
+    SonosClient *ethClient;
+    bool keepAlive;
+    bool earlyAbort;
+    bool fireAndForget;
+    uint8_t retries;
+    uint16_t retryBackoff;
+    SonosResult lastResult;
+    SonosBatch *batch;
+    const MetaData *meta;
+    char writeBuffer[UPNP_WRITE_BUFFER_SIZE];
+    uint16_t writeLength;
+    uint8_t readBuffer[UPNP_READ_BUFFER_SIZE];
+    uint16_t readPosition;
+    uint16_t readLength;
 
     void (*ethernetErrCallback)(void);
-    void seek(IPAddress speakerIP, const char *mode, const char *data);
-    void setAVTransportURI(IPAddress speakerIP, const char *scheme, const char *address, PGM_P metaStart_P, PGM_P metaEnd_P, const char *metaValue);
-    void upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P);
-    void upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value);
-    void upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue);
+    void (*asyncCallback)(int8_t handle, IPAddress speakerIP, uint8_t request, bool success, int32_t value);
+    int8_t beginAsync(IPAddress ip, uint8_t request, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue, PGM_P response_P, PGM_P result_P);
+    void pollAsync(int8_t handle);
+    void completeAsync(int8_t handle, uint8_t state);
+    int32_t convertAsyncResult(Connection *asyncConnection);
+    const char *getRampTypeValue(uint8_t rampType);
+    uint8_t fanOut(const IPAddress *speakerIPs, uint8_t count, bool *results, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue);
+    void cacheWriteThrough(IPAddress ip, PGM_P action_P, const char *value, PGM_P extraStart_P, const char *extraValue, bool success);
+    bool seek(IPAddress speakerIP, const char *mode, const char *data);
+    bool setAVTransportURI(IPAddress speakerIP, const char *scheme, const char *address, PGM_P metaStart_P, PGM_P metaEnd_P, const char *metaValue);
+    bool upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P);
+    bool upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value);
+    bool upnpSet(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue);
     bool upnpPost(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue);
-    const char *getUpnpService(uint8_t upnpMessageType);
-    const char *getUpnpEndpoint(uint8_t upnpMessageType);
+    bool upnpAttempt(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue);
+    bool upnpSend(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue);
+    bool retryable(PGM_P action_P);
+    void upnpWriteRequest(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *valueA, const char *valueB, PGM_P extraStart_P, PGM_P extraEnd_P, const char *extraValue);
+    void getUpnpTemplate(uint8_t upnpMessageType, RequestTemplate *requestTemplate);
+    uint16_t metaWrite(const MetaData *meta, bool send, char *buffer);
+    void metaWriteElement(MetaWriter *writer, PGM_P name_P, const char *value);
+    void metaWriteEscaped(MetaWriter *writer, const char *value);
+    void metaWrite_P(MetaWriter *writer, PGM_P data_P);
+    void metaWrite(MetaWriter *writer, const char *data, size_t length);
+    IPAddress routeRequest(IPAddress ip, uint8_t upnpMessageType, PGM_P action_P);
+    bool isGroupChange(PGM_P action_P);
+    Connection *findConnection(IPAddress ip);
+    void collectDetached(IPAddress ip);
+    uint8_t ethClient_connect(IPAddress ip, PGM_P action_P);
+    void ethClient_resetHeader();
+    bool ethClient_readHeaders();
+    bool ethClient_parseHeader(char character);
+    bool ethClient_checkStatus();
+    bool ethClient_waitAvailable();
+    bool ethClient_fill();
+    int ethClient_read();
+    void ethClient_skipText();
+    void ethClient_discard(bool wait);
     void ethClient_write(const char *data);
-    void ethClient_write_P(PGM_P data_P, char *buffer, size_t bufferSize);
+    void ethClient_write(const char *data, size_t length);
+    void ethClient_write_P(PGM_P data_P);
+    void ethClient_write_P(PGM_P data_P, size_t length);
+    void ethClient_flush();
     void ethClient_stop();
+    void requestBegin(Connection *requestConnection, PGM_P action_P);
+    void requestFail(uint8_t error);
+    void statsConnect(bool connected);
+
+    #ifndef SONOS_STATS_MODE
+
+    // Compiled away without statistics
+    void statsBegin(Connection *, PGM_P) {}
+    void statsSend(uint16_t) {}
+    void statsReceive(uint16_t) {}
+    void statsEnd(Connection *) {}
+    void statsRecord(IPAddress, PGM_P, uint8_t, uint32_t, Connection *) {}
+
+    #else
+
+    void statsBegin(Connection *statsConnection, PGM_P action_P);
+    void statsSend(uint16_t length);
+    void statsReceive(uint16_t length);
+    void statsEnd(Connection *statsConnection);
+    void statsRecord(IPAddress ip, PGM_P action_P, uint8_t error, uint32_t time, Connection *statsConnection);
+
+    struct StatsSpeaker
+    {
+      IPAddress ip;
+      SonosStats stats;
+    };
+
+    struct StatsAction
+    {
+      PGM_P action_P;
+      SonosStats stats;
+    };
+
+    SonosStats statsTotal;
+    StatsSpeaker statsSpeakers[SONOS_STATS_SPEAKERS];
+    StatsAction statsActions[SONOS_STATS_ACTIONS];
+    void (*traceCallback)(IPAddress speakerIP, PGM_P action_P, uint8_t error, uint32_t time);
+    SonosStats *statsFind(IPAddress ip);
+    SonosStats *statsFind(PGM_P action_P);
+    void statsAdd(SonosStats *stats, uint8_t error, uint32_t time, Connection *statsConnection);
+    void statsCount(uint16_t *histogram, uint32_t time);
+
+    #endif
 
     #ifndef SONOS_WRITE_ONLY_MODE
 
+    // Follows tag names next to the xPath matchers, to tell when the text up
+    // to the next tag can't be a wanted value
+    struct TextFilter
+    {
+      PGM_P names[UPNP_MAX_XPATHS];
+      uint8_t pending;
+      uint8_t candidates;
+      uint8_t namePos;
+      bool inTag;
+      bool inName;
+      char lastChar;
+    };
+
+    // Streaming XML tokenizer state, one per level of escaping
+    struct MarkupParser
+    {
+      uint8_t state;
+      bool endTag;
+      bool emptyTag;
+      uint8_t nameLength;
+      uint8_t attributeLength;
+      uint8_t entityLength;
+      uint8_t entityState;
+      char quote;
+      char name[SONOS_MARKUP_NAME_SIZE];
+      char attribute[SONOS_MARKUP_ATTRIBUTE_SIZE];
+      char entity[SONOS_MARKUP_ENTITY_SIZE];
+    };
+
+    // Follows <TrackMetaData> in the outer document and the DIDL-Lite inside it
+    struct TrackMetaParser
+    {
+      MarkupParser outer;
+      MarkupParser inner;
+      bool inMetaData;
+      bool inItem;
+      char *value;
+      size_t valueSize;
+      size_t valueLength;
+    };
+
+    struct CacheEntry
+    {
+      IPAddress ip;
+      uint32_t lastUsed;
+      uint32_t updated[SONOS_CACHE_FIELDS];
+      int8_t values[SONOS_CACHE_FIELDS];
+      uint8_t valid;
+    };
+
+    CacheEntry cacheEntries[SONOS_CACHE_SPEAKERS];
+    uint16_t cacheTTL[SONOS_CACHE_FIELDS];
+    uint32_t cacheHits[SONOS_CACHE_FIELDS];
+    uint32_t cacheMisses[SONOS_CACHE_FIELDS];
+    SonosTopology *topology;
+
     MicroXPath_P xPath;
-    void ethClient_xPath(PGM_P *path, uint8_t pathSize, char *resultBuffer, size_t resultBufferSize);
-    void upnpGetString(IPAddress speakerIP, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value, PGM_P *path, uint8_t pathSize, char *resultBuffer, size_t resultBufferSize);
+    CacheEntry *cacheFind(IPAddress ip, bool create);
+    bool cacheGet(IPAddress ip, uint8_t field, int8_t *value);
+    void cacheSet(IPAddress ip, uint8_t field, int8_t value);
+    void cacheInvalidate(IPAddress ip, uint8_t field);
+    void textFilterBegin(TextFilter *filter, PGM_P **paths, uint8_t pathSize, uint8_t count);
+    bool textFilterSkip(TextFilter *filter, char character);
+    void textFilterEndName(TextFilter *filter);
+    bool ethClient_xPath(PGM_P *path, uint8_t pathSize, char *resultBuffer, size_t resultBufferSize);
+    void ethClient_xPath(PGM_P **paths, uint8_t pathSize, char **resultBuffers, size_t *resultBufferSizes, uint8_t resultCount);
+    void ethClient_xPath(PGM_P **paths, uint8_t pathSize, char **resultBuffers, size_t *resultBufferSizes, uint8_t resultCount, TrackMetaData *trackMetaData);
+    bool trackMetaParse(TrackMetaParser *parser, TrackMetaData *trackMetaData, char character);
+    void trackMetaClear(TrackMetaData *trackMetaData);
+    uint16_t ethClient_browse(uint16_t index, BrowseItem *item, void (*itemCallback)(uint16_t index, BrowseItem *item), uint16_t *totalMatches);
+    void browseClear(BrowseItem *item);
+    void markupBegin(MarkupParser *parser);
+    uint8_t markupParse(MarkupParser *parser, char character, char *output);
+    uint8_t markupNext(MarkupParser *parser);
+    bool markupIs(MarkupParser *parser, PGM_P name_P);
+    bool upnpGetString(IPAddress speakerIP, uint8_t upnpMessageType, PGM_P action_P, const char *field, const char *value, PGM_P *path, uint8_t pathSize, char *resultBuffer, size_t resultBufferSize);
     uint32_t getTimeInSeconds(const char *time);
     uint32_t uiPow(uint16_t base, uint16_t exp);
     uint8_t convertState(const char *input);
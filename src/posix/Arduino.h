@@ -0,0 +1,84 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+// The part of the Arduino API used by the library, for building it on a
+// POSIX host; add the posix directory to the include path
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "pgmspace.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// Binary constants, from the Arduino binary.h, as far as the library uses them
+#define B0 0
+#define B1 1
+#define B00 0
+#define B01 1
+#define B10 2
+#define B11 3
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+using std::min;
+using std::max;
+
+// Time is kept in 32 bits, and wraps around, like on the Arduino
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void yield();
+long random(long howBig);
+long random(long howSmall, long howBig);
+
+char *itoa(int value, char *buffer, int radix);
+char *ltoa(long value, char *buffer, int radix);
+char *utoa(unsigned value, char *buffer, int radix);
+char *ultoa(unsigned long value, char *buffer, int radix);
+#if defined(__GLIBC__) && __GLIBC__ == 2 && __GLIBC_MINOR__ < 38
+size_t strlcpy(char *destination, const char *source, size_t size);
+#endif
+
+class IPAddress
+{
+
+  public:
+
+    IPAddress();
+    IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth);
+    IPAddress(uint32_t address);
+    IPAddress(const uint8_t *address);
+
+    operator uint32_t() const;
+    bool operator==(const IPAddress &address) const;
+    bool operator!=(const IPAddress &address) const;
+    uint8_t operator[](int index) const;
+    uint8_t &operator[](int index);
+
+  private:
+
+    uint8_t address[4];
+};
+
+#endif
@@ -0,0 +1,613 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#include "../SonosTransport.h"
+
+#ifdef SONOS_POSIX_TRANSPORT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+struct PosixSocket
+{
+  bool used;
+  bool closed;
+  int fd;
+  uint16_t rxPosition;
+  uint16_t rxLength;
+  uint16_t txLength;
+  uint8_t rx[POSIX_RX_BUFFER_SIZE];
+  uint8_t tx[POSIX_TX_BUFFER_SIZE];
+};
+
+static PosixSocket sockets[POSIX_MAX_SOCK_NUM];
+static int epollFd = -1;
+static uint64_t bytesReceived = 0;
+
+static void posixWatch(int fd, bool edgeTriggered)
+{
+  // Every socket is watched by one epoll instance, used by posixWait. TCP
+  // connections only report new data and the close, or a kept connection with
+  // unread data or one the speaker has closed would never let it sleep
+  if (epollFd < 0) epollFd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event;
+  event.events = edgeTriggered ? EPOLLIN | EPOLLRDHUP | EPOLLET : EPOLLIN;
+  event.data.fd = fd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static sockaddr_in posixAddress(IPAddress ip, uint16_t port)
+{
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(((uint32_t)ip[0] << 24) | ((uint32_t)ip[1] << 16) | ((uint32_t)ip[2] << 8) | ip[3]);
+  return address;
+}
+
+static IPAddress posixIP(const sockaddr_in &address)
+{
+  uint32_t ip = ntohl(address.sin_addr.s_addr);
+  return IPAddress(ip >> 24, ip >> 16, ip >> 8, ip);
+}
+
+static bool posixPoll(int fd, short events, uint32_t timeout)
+{
+  struct pollfd pollFd = { fd, events, 0 };
+  return poll(&pollFd, 1, timeout) > 0;
+}
+
+static uint8_t posixAllocate(int fd)
+{
+  for (uint8_t sock = 0; sock < POSIX_MAX_SOCK_NUM; sock++)
+  {
+    PosixSocket *socket = &sockets[sock];
+    if (socket->used) continue;
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    socket->used = true;
+    socket->closed = false;
+    socket->fd = fd;
+    socket->rxPosition = 0;
+    socket->rxLength = 0;
+    socket->txLength = 0;
+    posixWatch(fd, true);
+    return sock;
+  }
+  close(fd);
+  return POSIX_SOCK_NONE;
+}
+
+static bool posixSend(PosixSocket *socket, const uint8_t *data, size_t size)
+{
+  while (size)
+  {
+    ssize_t sent = send(socket->fd, data, size, MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && posixPoll(socket->fd, POLLOUT, POSIX_CONNECT_TIMEOUT_MS)) continue;
+      if (errno == EINTR) continue;
+      socket->closed = true;
+      return false;
+    }
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+static void posixFlush(PosixSocket *socket)
+{
+  if (!socket->txLength) return;
+  posixSend(socket, socket->tx, socket->txLength);
+  socket->txLength = 0;
+}
+
+static int posixFill(PosixSocket *socket)
+{
+  // Pending output is sent before looking for input, the speaker will not
+  // answer a request that is still in the buffer
+  posixFlush(socket);
+  if (socket->rxPosition < socket->rxLength) return socket->rxLength - socket->rxPosition;
+  if (socket->closed) return 0;
+  ssize_t received = recv(socket->fd, socket->rx, sizeof(socket->rx), MSG_DONTWAIT);
+  if (received > 0)
+  {
+    bytesReceived += received;
+    socket->rxPosition = 0;
+    socket->rxLength = received;
+    return received;
+  }
+  if (!received || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) socket->closed = true;
+  return 0;
+}
+
+bool posixWait(uint32_t timeout)
+{
+  // Blocks until something new arrives or the timeout is reached; requests
+  // still in the output buffers are sent first. Data already waiting is not
+  // waited for, a caller only waits after finding nothing on its own socket
+  for (uint8_t sock = 0; sock < POSIX_MAX_SOCK_NUM; sock++)
+  {
+    if (sockets[sock].used) posixFlush(&sockets[sock]);
+  }
+  if (epollFd < 0)
+  {
+    delay(timeout);
+    return false;
+  }
+  struct epoll_event events[8];
+  return epoll_wait(epollFd, events, 8, timeout) > 0;
+}
+
+uint64_t posixBytesReceived()
+{
+  return bytesReceived;
+}
+
+uint32_t millis()
+{
+  // From the full clock, micros() wraps a thousand times as often
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint32_t micros()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void delay(uint32_t ms)
+{
+  struct timespec duration = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000 };
+  while (nanosleep(&duration, &duration) && errno == EINTR);
+}
+
+long random(long howBig)
+{
+  // Arduino style, 0 up to but not including howBig
+  if (howBig <= 0) return 0;
+  return ::random() % howBig;
+}
+
+long random(long howSmall, long howBig)
+{
+  if (howSmall >= howBig) return howSmall;
+  return howSmall + random(howBig - howSmall);
+}
+
+void yield()
+{
+  // Busy waits for a response sleep here until there is something to read
+  posixWait(1);
+}
+
+char *itoa(int value, char *buffer, int radix)
+{
+  return ltoa(value, buffer, radix);
+}
+
+char *ltoa(long value, char *buffer, int radix)
+{
+  if (value < 0 && radix == 10)
+  {
+    *buffer = '-';
+    ultoa(-(unsigned long)value, buffer + 1, radix);
+    return buffer;
+  }
+  return ultoa(value, buffer, radix);
+}
+
+char *utoa(unsigned value, char *buffer, int radix)
+{
+  return ultoa(value, buffer, radix);
+}
+
+char *ultoa(unsigned long value, char *buffer, int radix)
+{
+  char digits[sizeof(unsigned long) * 8 + 1];
+  uint8_t length = 0;
+  do
+  {
+    uint8_t digit = value % radix;
+    digits[length++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+    value /= radix;
+  }
+  while (value);
+  for (uint8_t i = 0; i < length; i++)
+  {
+    buffer[i] = digits[length - i - 1];
+  }
+  buffer[length] = '\0';
+  return buffer;
+}
+
+#if defined(__GLIBC__) && __GLIBC__ == 2 && __GLIBC_MINOR__ < 38
+size_t strlcpy(char *destination, const char *source, size_t size)
+{
+  size_t length = strlen(source);
+  if (size)
+  {
+    size_t copied = length < size - 1 ? length : size - 1;
+    memcpy(destination, source, copied);
+    destination[copied] = '\0';
+  }
+  return length;
+}
+#endif
+
+
+IPAddress::IPAddress()
+{
+  memset(address, 0, sizeof(address));
+}
+
+IPAddress::IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth)
+{
+  address[0] = first;
+  address[1] = second;
+  address[2] = third;
+  address[3] = fourth;
+}
+
+IPAddress::IPAddress(uint32_t address)
+{
+  // Same byte order as the Arduino, first octet in the lowest byte
+  memcpy(this->address, &address, sizeof(this->address));
+}
+
+IPAddress::IPAddress(const uint8_t *address)
+{
+  memcpy(this->address, address, sizeof(this->address));
+}
+
+IPAddress::operator uint32_t() const
+{
+  uint32_t value;
+  memcpy(&value, address, sizeof(value));
+  return value;
+}
+
+bool IPAddress::operator==(const IPAddress &address) const
+{
+  return !memcmp(this->address, address.address, sizeof(this->address));
+}
+
+bool IPAddress::operator!=(const IPAddress &address) const
+{
+  return !(*this == address);
+}
+
+uint8_t IPAddress::operator[](int index) const
+{
+  return address[index];
+}
+
+uint8_t &IPAddress::operator[](int index)
+{
+  return address[index];
+}
+
+
+PosixClient::PosixClient()
+{
+  this->sock = POSIX_SOCK_NONE;
+  this->connectTimeout = POSIX_CONNECT_TIMEOUT_MS;
+}
+
+PosixClient::PosixClient(uint8_t sock)
+{
+  this->sock = sock;
+  this->connectTimeout = POSIX_CONNECT_TIMEOUT_MS;
+}
+
+int PosixClient::connect(IPAddress ip, uint16_t port)
+{
+  if (sock != POSIX_SOCK_NONE) stop();
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return 0;
+  sockaddr_in address = posixAddress(ip, port);
+  if (::connect(fd, (sockaddr *)&address, sizeof(address)) && errno != EINPROGRESS)
+  {
+    close(fd);
+    return 0;
+  }
+  // Blocks until connected, like the Arduino Ethernet library
+  int error = 0;
+  socklen_t errorSize = sizeof(error);
+  if (!posixPoll(fd, POLLOUT, connectTimeout) ||
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorSize) || error)
+  {
+    close(fd);
+    return 0;
+  }
+  sock = posixAllocate(fd);
+  return sock != POSIX_SOCK_NONE;
+}
+
+void PosixClient::setConnectionTimeout(uint16_t timeout)
+{
+  // Like the Arduino Ethernet library, for the connects that follow
+  this->connectTimeout = timeout;
+}
+
+uint8_t PosixClient::connected()
+{
+  // Still connected while there is data left to read, like the W5100
+  if (sock == POSIX_SOCK_NONE) return 0;
+  return posixFill(&sockets[sock]) || !sockets[sock].closed;
+}
+
+int PosixClient::available()
+{
+  if (sock == POSIX_SOCK_NONE) return 0;
+  return posixFill(&sockets[sock]);
+}
+
+int PosixClient::read()
+{
+  if (!available()) return -1;
+  PosixSocket *socket = &sockets[sock];
+  return socket->rx[socket->rxPosition++];
+}
+
+int PosixClient::read(uint8_t *buffer, size_t size)
+{
+  int length = available();
+  if (!length) return -1;
+  if ((size_t)length > size) length = size;
+  PosixSocket *socket = &sockets[sock];
+  memcpy(buffer, socket->rx + socket->rxPosition, length);
+  socket->rxPosition += length;
+  return length;
+}
+
+int PosixClient::peek()
+{
+  if (!available()) return -1;
+  PosixSocket *socket = &sockets[sock];
+  return socket->rx[socket->rxPosition];
+}
+
+size_t PosixClient::write(uint8_t data)
+{
+  return write(&data, 1);
+}
+
+size_t PosixClient::write(const uint8_t *buffer, size_t size)
+{
+  // Small writes are collected and sent together when the buffer is full or
+  // when the response is read
+  if (sock == POSIX_SOCK_NONE) return 0;
+  PosixSocket *socket = &sockets[sock];
+  if (socket->closed) return 0;
+  if (socket->txLength + size > sizeof(socket->tx))
+  {
+    posixFlush(socket);
+    if (size > sizeof(socket->tx)) return posixSend(socket, buffer, size) ? size : 0;
+  }
+  memcpy(socket->tx + socket->txLength, buffer, size);
+  socket->txLength += size;
+  return size;
+}
+
+size_t PosixClient::print(const char *data)
+{
+  return write((const uint8_t *)data, strlen(data));
+}
+
+void PosixClient::flush()
+{
+  if (sock != POSIX_SOCK_NONE) posixFlush(&sockets[sock]);
+}
+
+void PosixClient::stop()
+{
+  if (sock == POSIX_SOCK_NONE) return;
+  PosixSocket *socket = &sockets[sock];
+  if (socket->used)
+  {
+    if (!socket->closed) posixFlush(socket);
+    close(socket->fd);
+    socket->used = false;
+  }
+  sock = POSIX_SOCK_NONE;
+}
+
+IPAddress PosixClient::remoteIP()
+{
+  sockaddr_in address;
+  socklen_t addressSize = sizeof(address);
+  if (sock == POSIX_SOCK_NONE || getpeername(sockets[sock].fd, (sockaddr *)&address, &addressSize)) return IPAddress();
+  return posixIP(address);
+}
+
+PosixClient::operator bool()
+{
+  return sock != POSIX_SOCK_NONE;
+}
+
+bool PosixClient::operator==(const PosixClient &client) const
+{
+  return sock == client.sock;
+}
+
+bool PosixClient::operator!=(const PosixClient &client) const
+{
+  return sock != client.sock;
+}
+
+
+PosixServer::PosixServer(uint16_t port)
+{
+  this->port = port;
+  this->fd = -1;
+}
+
+void PosixServer::begin()
+{
+  if (fd >= 0) return;
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return;
+  int enable = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  sockaddr_in address = posixAddress(IPAddress(0, 0, 0, 0), port);
+  if (bind(fd, (sockaddr *)&address, sizeof(address)) || listen(fd, POSIX_LISTEN_BACKLOG))
+  {
+    close(fd);
+    fd = -1;
+    return;
+  }
+  posixWatch(fd, false);
+}
+
+PosixClient PosixServer::available()
+{
+  // Returns the next incoming connection, its request is read by the caller
+  if (fd < 0) return PosixClient();
+  int clientFd = accept4(fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (clientFd < 0) return PosixClient();
+  return PosixClient(posixAllocate(clientFd));
+}
+
+
+PosixUDP::PosixUDP()
+{
+  this->fd = -1;
+  this->packetLength = 0;
+  this->packetPosition = 0;
+  this->outLength = 0;
+}
+
+uint8_t PosixUDP::begin(uint16_t port)
+{
+  stop();
+  fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return 0;
+  int enable = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  sockaddr_in address = posixAddress(IPAddress(0, 0, 0, 0), port);
+  if (bind(fd, (sockaddr *)&address, sizeof(address)))
+  {
+    close(fd);
+    fd = -1;
+    return 0;
+  }
+  posixWatch(fd, false);
+  return 1;
+}
+
+void PosixUDP::stop()
+{
+  if (fd < 0) return;
+  close(fd);
+  fd = -1;
+}
+
+int PosixUDP::beginPacket(IPAddress ip, uint16_t port)
+{
+  outIP = ip;
+  outPort = port;
+  outLength = 0;
+  return fd >= 0;
+}
+
+size_t PosixUDP::write(uint8_t data)
+{
+  return write(&data, 1);
+}
+
+size_t PosixUDP::write(const uint8_t *buffer, size_t size)
+{
+  if (outLength + size > sizeof(out)) size = sizeof(out) - outLength;
+  memcpy(out + outLength, buffer, size);
+  outLength += size;
+  return size;
+}
+
+int PosixUDP::endPacket()
+{
+  sockaddr_in address = posixAddress(outIP, outPort);
+  return sendto(fd, out, outLength, 0, (sockaddr *)&address, sizeof(address)) == (ssize_t)outLength;
+}
+
+int PosixUDP::parsePacket()
+{
+  // Skips what is left of the previous packet, like the Arduino Ethernet library
+  packetLength = 0;
+  packetPosition = 0;
+  if (fd < 0) return 0;
+  sockaddr_in address;
+  socklen_t addressSize = sizeof(address);
+  ssize_t received = recvfrom(fd, packet, sizeof(packet), MSG_DONTWAIT, (sockaddr *)&address, &addressSize);
+  if (received <= 0) return 0;
+  packetLength = received;
+  packetIP = posixIP(address);
+  packetPort = ntohs(address.sin_port);
+  return received;
+}
+
+int PosixUDP::available()
+{
+  return packetLength - packetPosition;
+}
+
+int PosixUDP::read()
+{
+  return available() ? packet[packetPosition++] : -1;
+}
+
+int PosixUDP::read(uint8_t *buffer, size_t size)
+{
+  size_t length = available();
+  if (!length) return -1;
+  if (length > size) length = size;
+  memcpy(buffer, packet + packetPosition, length);
+  packetPosition += length;
+  return length;
+}
+
+int PosixUDP::peek()
+{
+  return available() ? packet[packetPosition] : -1;
+}
+
+IPAddress PosixUDP::remoteIP()
+{
+  return packetIP;
+}
+
+uint16_t PosixUDP::remotePort()
+{
+  return packetPort;
+}
+
+#endif
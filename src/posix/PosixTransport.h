@@ -0,0 +1,123 @@
+/************************************************************************/
+/* Sonos UPnP, an UPnP based read/write remote control library, v1.1.   */
+/*                                                                      */
+/* This library is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or    */
+/* (at your option) any later version.                                  */
+/*                                                                      */
+/* This library is distributed in the hope that it will be useful, but  */
+/* WITHOUT ANY WARRANTY; without even the implied warranty of           */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU     */
+/* General Public License for more details.                             */
+/*                                                                      */
+/* You should have received a copy of the GNU General Public License    */
+/* along with this library. If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                      */
+/* Written by Thomas Mittet (code@lookout.no) January 2015.             */
+/************************************************************************/
+
+#ifndef PosixTransport_h
+#define PosixTransport_h
+
+#include <Arduino.h>
+
+// Sockets are kept in a fixed table, like the sockets of the W5100, so the
+// client objects are small handles that can be copied
+#ifndef POSIX_MAX_SOCK_NUM
+#define POSIX_MAX_SOCK_NUM 32
+#endif
+#define POSIX_SOCK_NONE 0xFF
+#define POSIX_RX_BUFFER_SIZE 1460
+#define POSIX_TX_BUFFER_SIZE 1460
+#define POSIX_UDP_PACKET_SIZE 1472
+#define POSIX_CONNECT_TIMEOUT_MS 3000
+#define POSIX_LISTEN_BACKLOG 8
+
+bool posixWait(uint32_t timeout);
+// Total TCP payload received by all clients, for measuring parse throughput
+uint64_t posixBytesReceived();
+
+class PosixClient
+{
+
+  public:
+
+    PosixClient();
+    PosixClient(uint8_t sock);
+
+    int connect(IPAddress ip, uint16_t port);
+    void setConnectionTimeout(uint16_t timeout);
+    uint8_t connected();
+    int available();
+    int read();
+    int read(uint8_t *buffer, size_t size);
+    int peek();
+    size_t write(uint8_t data);
+    size_t write(const uint8_t *buffer, size_t size);
+    size_t print(const char *data);
+    void flush();
+    void stop();
+    IPAddress remoteIP();
+    operator bool();
+    bool operator==(const PosixClient &client) const;
+    bool operator!=(const PosixClient &client) const;
+
+  private:
+
+    uint8_t sock;
+    uint16_t connectTimeout;
+};
+
+class PosixServer
+{
+
+  public:
+
+    PosixServer(uint16_t port);
+
+    void begin();
+    PosixClient available();
+
+  private:
+
+    uint16_t port;
+    int fd;
+};
+
+class PosixUDP
+{
+
+  public:
+
+    PosixUDP();
+
+    uint8_t begin(uint16_t port);
+    void stop();
+    int beginPacket(IPAddress ip, uint16_t port);
+    size_t write(uint8_t data);
+    size_t write(const uint8_t *buffer, size_t size);
+    int endPacket();
+    int parsePacket();
+    int available();
+    int read();
+    int read(uint8_t *buffer, size_t size);
+    int peek();
+    IPAddress remoteIP();
+    uint16_t remotePort();
+
+  private:
+
+    int fd;
+    IPAddress packetIP;
+    uint16_t packetPort;
+    size_t packetLength;
+    size_t packetPosition;
+    uint8_t packet[POSIX_UDP_PACKET_SIZE];
+    IPAddress outIP;
+    uint16_t outPort;
+    size_t outLength;
+    uint8_t out[POSIX_UDP_PACKET_SIZE];
+};
+
+#endif